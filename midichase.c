@@ -0,0 +1,386 @@
+/*
+ * midichase.c - Controller chasing for Steevs MIDI Library. Tracks the
+ *				 program, controllers, pitch wheel and pressure of every
+ *				 channel so a player can put a device right after a seek.
+ * Version 1.4
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of
+ *  the License,or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "midifile.h"
+
+
+/* Steps of the burst for each channel, in the order they are sent */
+#define CHASE_STEP_RESET		0			/* reset all controllers, so unset means default */
+#define CHASE_STEP_BANK			1			/* bank MSB then LSB, which must precede the program */
+#define CHASE_STEP_PROGRAM		3
+#define CHASE_STEP_CC			4			/* CC 1..119 */
+#define CHASE_STEP_PITCH		(CHASE_STEP_CC + 119)
+#define CHASE_STEP_PRESSURE		(CHASE_STEP_PITCH + 1)
+#define CHASE_STEPS				(CHASE_STEP_PRESSURE + 1)
+
+/* Data entry only means something with the parameter selected at the
+** time, which a single value per controller can't capture. 120 and up
+** are channel mode messages, not settings. */
+static BOOL _midiChaseIsChased(int iCC)
+{
+	switch(iCC)
+	{
+	case	ccDateEntry:
+	case	ccDateEntry + 32:
+	case	96:						/* data increment */
+	case	97:						/* data decrement */
+		return FALSE;
+	}
+	return iCC < 120;
+}
+
+/* What Reset All Controllers leaves alone, as RP-015 has it: bank,
+** volume, pan, the sound controllers and the effects depths. The
+** program survives too, but isn't a controller. */
+static BOOL _midiChaseSurvivesReset(int iCC)
+{
+	switch(iCC)
+	{
+	case	ccBankSelect:
+	case	ccBankSelectLSB:
+	case	ccVolume:
+	case	ccPan:
+		return TRUE;
+	}
+	return (iCC >= ccSoundController1 && iCC <= ccSoundController10)
+		|| (iCC >= ccEffect1Depth && iCC <= ccEffect5Depth);
+}
+
+void midiChaseInit(MIDI_CHASE *pChase)
+{
+	memset(pChase, MIDI_CHASE_UNSET, sizeof(*pChase));
+	pChase->wUsed = 0;
+	pChase->dwTempo = 0;
+}
+
+static void _midiChaseSet(MIDI_CHASE *pChase, BYTE bStatus, BYTE bData1, BYTE bData2)
+{
+	int iChn = bStatus & 0x0f, i;
+
+	switch(bStatus & 0xf0)
+	{
+	case	msgSetParameter:
+		if (bData1 == ccResetAllControllers)
+		{
+			for(i=0; i < 128; ++i)
+				if (!_midiChaseSurvivesReset(i))
+					pChase->bCC[iChn][i] = MIDI_CHASE_UNSET;
+			pChase->wPitch[iChn] = 0xffff;
+			pChase->bPressure[iChn] = MIDI_CHASE_UNSET;
+		}
+		else if (bData1 < 128 && _midiChaseIsChased(bData1))
+		{
+			pChase->bCC[iChn][bData1] = bData2;
+			pChase->wUsed |= 1 << iChn;
+		}
+		break;
+
+	case	msgSetProgram:
+		pChase->bProgram[iChn] = bData1;
+		pChase->wUsed |= 1 << iChn;
+		break;
+
+	case	msgChangePressure:
+		pChase->bPressure[iChn] = bData1;
+		pChase->wUsed |= 1 << iChn;
+		break;
+
+	case	msgSetPitchWheel:
+		pChase->wPitch[iChn] = (WORD)(bData1 | (bData2 << 7));
+		pChase->wUsed |= 1 << iChn;
+		break;
+	}
+}
+
+/* Feed this every message from midiReadGetNextMessage(), or a merge, in
+** the order they are played. Anything that isn't state is ignored. */
+void midiChaseUpdate(MIDI_CHASE *pChase, const MIDI_MSG *pMsg)
+{
+	int iPitch;
+
+	switch(pMsg->iType)
+	{
+	case	msgSetParameter:
+		_midiChaseSet(pChase, (BYTE)(msgSetParameter | ((pMsg->MsgData.NoteParameter.iChannel - 1) & 0x0f)),
+						(BYTE)pMsg->MsgData.NoteParameter.iControl, (BYTE)pMsg->MsgData.NoteParameter.iParam);
+		break;
+
+	case	msgSetProgram:
+		_midiChaseSet(pChase, (BYTE)(msgSetProgram | ((pMsg->MsgData.ChangeProgram.iChannel - 1) & 0x0f)),
+						(BYTE)pMsg->MsgData.ChangeProgram.iProgram, 0);
+		break;
+
+	case	msgChangePressure:
+		_midiChaseSet(pChase, (BYTE)(msgChangePressure | ((pMsg->MsgData.ChangePressure.iChannel - 1) & 0x0f)),
+						(BYTE)pMsg->MsgData.ChangePressure.iPressure, 0);
+		break;
+
+	case	msgSetPitchWheel:
+		iPitch = pMsg->MsgData.PitchWheel.iPitch + MIDI_WHEEL_CENTRE;
+		_midiChaseSet(pChase, (BYTE)(msgSetPitchWheel | ((pMsg->MsgData.PitchWheel.iChannel - 1) & 0x0f)),
+						(BYTE)(iPitch & 0x7f), (BYTE)((iPitch >> 7) & 0x7f));
+		break;
+
+	case	msgMetaEvent:
+		if (pMsg->MsgData.MetaEvent.iType == metaSetTempo)
+			pChase->dwTempo = pMsg->MsgData.MetaEvent.Data.Tempo.dwMicros;
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* The same for MIDI_EVENTs from midiReadGetNextEvent() or a merge. pMF is
+** only needed for reading tempo changes. */
+void midiChaseUpdateEvent(MIDI_CHASE *pChase, const _MIDI_FILE *pMF, const MIDI_EVENT *pEvent)
+{
+	if (pEvent->bStatus >= msgNoteOff && pEvent->bStatus < msgSysEx1)
+		_midiChaseSet(pChase, pEvent->bStatus, pEvent->bData1, pEvent->bData2);
+	else
+		midiTempoGetEventTempo(pMF, pEvent, &pChase->dwTempo);
+}
+
+/* TRUE if a channel event would leave the state exactly as it is, so a
+** device that has followed along doesn't need to be sent it */
+BOOL midiChaseIsRedundant(const MIDI_CHASE *pChase, const MIDI_EVENT *pEvent)
+{
+	int iChn = pEvent->bStatus & 0x0f;
+
+	switch(pEvent->bStatus & 0xf0)
+	{
+	case	msgSetParameter:
+		return pEvent->bData1 < 128 && pChase->bCC[iChn][pEvent->bData1] == pEvent->bData2;
+	case	msgSetProgram:
+		return pChase->bProgram[iChn] == pEvent->bData1;
+	case	msgChangePressure:
+		return pChase->bPressure[iChn] == pEvent->bData1;
+	case	msgSetPitchWheel:
+		return pChase->wPitch[iChn] == (pEvent->bData1 | (pEvent->bData2 << 7));
+	}
+	return FALSE;
+}
+
+/* Produces the chase burst one short message at a time. Set *piPos to 0
+** for the first call; returns the number of bytes written to pMsg (up to
+** 3), or 0 when there is nothing left. Only channels the song has used
+** are touched. The tempo is for the player, so isn't part of the burst. */
+int midiChaseGetNextMsg(const MIDI_CHASE *pChase, int *piPos, BYTE *pMsg)
+{
+	int iChn, iStep, iCC;
+
+	for(; *piPos < 16 * CHASE_STEPS; ++*piPos)
+	{
+		iChn = *piPos / CHASE_STEPS;
+		iStep = *piPos % CHASE_STEPS;
+
+		if (!(pChase->wUsed & (1 << iChn)))
+		{
+			*piPos = (iChn + 1) * CHASE_STEPS - 1;		/* skip the whole channel */
+			continue;
+		}
+
+		if (iStep == CHASE_STEP_RESET)
+		{
+			iCC = ccResetAllControllers;
+			pMsg[2] = 0;
+		}
+		else if (iStep == CHASE_STEP_PROGRAM)
+		{
+			if (pChase->bProgram[iChn] == MIDI_CHASE_UNSET)
+				continue;
+			pMsg[0] = (BYTE)(msgSetProgram | iChn);
+			pMsg[1] = pChase->bProgram[iChn];
+			++*piPos;
+			return 2;
+		}
+		else if (iStep == CHASE_STEP_PITCH)
+		{
+			if (pChase->wPitch[iChn] == 0xffff)
+				continue;
+			pMsg[0] = (BYTE)(msgSetPitchWheel | iChn);
+			pMsg[1] = (BYTE)(pChase->wPitch[iChn] & 0x7f);
+			pMsg[2] = (BYTE)((pChase->wPitch[iChn] >> 7) & 0x7f);
+			++*piPos;
+			return 3;
+		}
+		else if (iStep == CHASE_STEP_PRESSURE)
+		{
+			if (pChase->bPressure[iChn] == MIDI_CHASE_UNSET)
+				continue;
+			pMsg[0] = (BYTE)(msgChangePressure | iChn);
+			pMsg[1] = pChase->bPressure[iChn];
+			++*piPos;
+			return 2;
+		}
+		else
+		{
+			if (iStep < CHASE_STEP_PROGRAM)
+				iCC = iStep == CHASE_STEP_BANK ? ccBankSelect : ccBankSelectLSB;
+			else if ((iCC = iStep - CHASE_STEP_CC + 1) == ccBankSelectLSB)
+				continue;		/* already sent */
+
+			if (pChase->bCC[iChn][iCC] == MIDI_CHASE_UNSET)
+				continue;
+			pMsg[2] = pChase->bCC[iChn][iCC];
+		}
+
+		pMsg[0] = (BYTE)(msgSetParameter | iChn);
+		pMsg[1] = (BYTE)iCC;
+		++*piPos;
+		return 3;
+	}
+
+	return 0;
+}
+
+
+/*
+** Seeking
+*/
+static void _midiChaseSetFilter(MIDI_FILTER *pFilter)
+{
+	midiFilterInit(pFilter, FALSE);
+	pFilter->wChannels = 0xffff;
+	midiFilterSetMsg(pFilter, msgSetParameter, TRUE);
+	midiFilterSetMsg(pFilter, msgSetProgram, TRUE);
+	midiFilterSetMsg(pFilter, msgChangePressure, TRUE);
+	midiFilterSetMsg(pFilter, msgSetPitchWheel, TRUE);
+	midiFilterSetMsg(pFilter, msgMetaEvent, TRUE);
+	midiFilterSetMeta(pFilter, metaSetTempo, TRUE);
+}
+
+static BOOL _midiChaseAddPoint(MIDI_SEEK_INDEX *pIndex, int *piAlloc, DWORD dwPos, const MIDI_CHASE *pChase)
+{
+	if (pIndex->iNumChase == *piAlloc)
+	{
+		int iAlloc = *piAlloc ? *piAlloc * 2 : 16;
+		void *p = realloc(pIndex->pChase, iAlloc * sizeof(MIDI_CHASE_POINT));
+
+		if (!p)
+			return FALSE;
+		pIndex->pChase = (MIDI_CHASE_POINT *)p;
+		*piAlloc = iAlloc;
+	}
+
+	pIndex->pChase[pIndex->iNumChase].dwPos = dwPos;
+	pIndex->pChase[pIndex->iNumChase].State = *pChase;
+	++pIndex->iNumChase;
+	return TRUE;
+}
+
+/* Adds channel state snapshots to a seek index from midiSeekBuildIndex(),
+** at most one every dwEvery ticks. Each one is a couple of KB, so pick
+** dwEvery with the song length in mind. The file's read positions are
+** left as they were. */
+BOOL midiChaseBuildIndex(MIDI_SEEK_INDEX *pIndex, const _MIDI_FILE *pMF, DWORD dwEvery)
+{
+	MIDI_READ_STATE Saved;
+	MIDI_FILTER filter;
+	MIDI_MERGE merge;
+	MIDI_CHASE state;
+	MIDI_MSG msg;
+	DWORD dwNext = 0;
+	int iAlloc = 0;
+	BOOL bOK = TRUE;
+
+	free(pIndex->pChase);
+	pIndex->pChase = NULL;
+	pIndex->iNumChase = 0;
+	if (!dwEvery)
+		dwEvery = 1;
+
+	_midiChaseSetFilter(&filter);
+	midiReadRewind(pMF, &Saved, &filter);
+	midiChaseInit(&state);
+	midiReadInitMessage(&msg);
+	midiMergeInit(&merge, pMF);
+
+	while(bOK && midiMergeGetNextMessage(&merge, &msg, NULL))
+	{
+		/* Everything applied so far is before this tick */
+		if (msg.dwAbsPos >= dwNext)
+		{
+			bOK = _midiChaseAddPoint(pIndex, &iAlloc, msg.dwAbsPos, &state);
+			dwNext = msg.dwAbsPos + dwEvery;
+		}
+		midiChaseUpdate(&state, &msg);
+	}
+
+	midiReadFreeMessage(&msg);
+	midiReadRestore(pMF, &Saved);
+
+	if (!bOK)
+	{
+		free(pIndex->pChase);
+		pIndex->pChase = NULL;
+		pIndex->iNumChase = 0;
+	}
+	return bOK;
+}
+
+/* As midiSeekToTick(), also filling pChase with the channel state at dwTick
+** ready for midiChaseGetNextMsg(). Only the events since the nearest
+** snapshot in pIndex are decoded to get it. */
+BOOL midiChaseSeekToTick(_MIDI_FILE *pMF, const MIDI_SEEK_INDEX *pIndex, DWORD dwTick, MIDI_CHASE *pChase)
+{
+	const MIDI_FILTER *pFilter = pMF->pFilter;
+	MIDI_FILTER filter;
+	MIDI_MERGE merge;
+	MIDI_MSG msg;
+	DWORD dwFrom = 0, dwPos;
+
+	midiChaseInit(pChase);
+	if (pIndex && pIndex->iNumChase && pIndex->pChase[0].dwPos <= dwTick)
+	{
+		int lo = 0, hi = pIndex->iNumChase - 1, mid;
+
+		while(lo < hi)
+		{
+			mid = (lo + hi + 1) / 2;
+			if (pIndex->pChase[mid].dwPos <= dwTick)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		*pChase = pIndex->pChase[lo].State;
+		dwFrom = pIndex->pChase[lo].dwPos;
+	}
+
+	if (dwFrom < dwTick)
+	{
+		_midiChaseSetFilter(&filter);
+		pMF->pFilter = &filter;
+		midiSeekToTick(pMF, pIndex, dwFrom);
+		midiReadInitMessage(&msg);
+		midiMergeInit(&merge, pMF);
+
+		while(midiMergeGetNextPos(&merge, &dwPos) && dwPos < dwTick && midiMergeGetNextMessage(&merge, &msg, NULL))
+			midiChaseUpdate(pChase, &msg);
+
+		midiReadFreeMessage(&msg);
+		pMF->pFilter = pFilter;
+	}
+
+	return midiSeekToTick(pMF, pIndex, dwTick);
+}
@@ -0,0 +1,211 @@
+/*
+ * midicompile.c - Compiled songs for Steevs MIDI Library. Turns a song
+ *				   into one stream of ready timed messages, which a small
+ *				   player can send out without any timing maths.
+ * Version 1.4
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of
+ *  the License,or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "midifile.h"
+
+/*
+** File layout, all values big endian like the MIDI file itself:
+**
+**	"MIDC", version, number of records
+**	per record (MIDI_COMPILED_RECORD bytes):
+**		microseconds since the previous record (4 bytes)
+**		number of MIDI bytes, 0-3
+**		the MIDI bytes, padded with 0
+**
+** Channel messages always have their status byte. SysEx is split over as
+** many records as it needs, all but the first with no delay. A record with
+** no bytes is only a wait; one ends the song, and they also make up delays
+** too long for 4 bytes.
+*/
+#define MIDI_COMPILED_VERSION	1
+#define MIDI_COMPILED_HEADER	12
+
+
+static BYTE *_midiCompilePut(BYTE *p, DWORD v)
+{
+	p[0] = (BYTE)(v >> 24);
+	p[1] = (BYTE)(v >> 16);
+	p[2] = (BYTE)(v >> 8);
+	p[3] = (BYTE)v;
+	return p + 4;
+}
+
+static DWORD _midiCompileGet(const BYTE *p)
+{
+	return ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | p[3];
+}
+
+static BOOL _midiCompileWrite(FILE *fp, QWORD qwDelta, const BYTE *pMsg, int iLen, DWORD *pdwCount)
+{
+	BYTE rec[MIDI_COMPILED_RECORD];
+
+	memset(rec, 0, sizeof(rec));
+	while(qwDelta > 0xffffffffUL)
+	{
+		_midiCompilePut(rec, 0xffffffffUL);
+		if (fwrite(rec, 1, sizeof(rec), fp) != sizeof(rec))
+			return FALSE;
+		++*pdwCount;
+		qwDelta -= 0xffffffffUL;
+	}
+
+	_midiCompilePut(rec, (DWORD)qwDelta);
+	rec[4] = (BYTE)iLen;
+	memcpy(rec + 5, pMsg, iLen);
+	++*pdwCount;
+	return fwrite(rec, 1, sizeof(rec), fp) == sizeof(rec);
+}
+
+/* Writes pMF to pFilename as a compiled song. The tracks are merged,
+** ticks are turned into microseconds through the tempo map, and meta
+** events are left out. Each record's delay is worked out from its exact
+** time in the song, so rounding never builds up. The file's read
+** positions are left as they were. Format 2 songs aren't compiled. */
+BOOL midiCompileFile(const _MIDI_FILE *pMF, const char *pFilename)
+{
+	MIDI_READ_STATE Saved;
+	MIDI_TEMPO_MAP map;
+	MIDI_MERGE merge;
+	MIDI_EVENT ev;
+	BYTE hdr[MIDI_COMPILED_HEADER], msg[3];
+	QWORD qwLast = 0, qwAt;
+	DWORD dwCount = 0, dwEnd = 0, dwOff;
+	FILE *fp;
+	BOOL bOK;
+	int n;
+
+	/* Format 2 patterns don't play as one song */
+	if (pMF->Header.iVersion == 2)
+		return FALSE;
+	if (!midiTempoBuild(&map, pMF))
+		return FALSE;
+	if ((fp = fopen(pFilename, "wb")) == NULL)
+	{
+		midiTempoFree(&map);
+		return FALSE;
+	}
+
+	/* The count is filled in once it's known */
+	memcpy(hdr, "MIDC", 4);
+	_midiCompilePut(_midiCompilePut(hdr + 4, MIDI_COMPILED_VERSION), 0);
+	bOK = fwrite(hdr, 1, sizeof(hdr), fp) == sizeof(hdr);
+
+	midiReadRewind(pMF, &Saved, NULL);
+	midiMergeInit(&merge, pMF);
+
+	while(bOK && midiMergeGetNextEvent(&merge, &ev))
+	{
+		if (ev.dwAbsPos > dwEnd)
+			dwEnd = ev.dwAbsPos;
+		if (ev.bStatus > msgSysEx1 && ev.bStatus != msgSysEx2)
+			continue;		/* meta events, tempo included, are done with */
+
+		qwAt = midiTempoTickToMicros(&map, ev.dwAbsPos);
+
+		if (ev.bStatus < msgSysEx1)
+		{
+			msg[0] = ev.bStatus;
+			msg[1] = ev.bData1;
+			msg[2] = ev.bData2;
+			n = (ev.bStatus & 0xf0) == msgSetProgram || (ev.bStatus & 0xf0) == msgChangePressure ? 2 : 3;
+			bOK = _midiCompileWrite(fp, qwAt - qwLast, msg, n, &dwCount);
+			qwLast = qwAt;
+		}
+		else
+		{
+			/* An 0xf7 event is sent exactly as it is, an 0xf0 one with its status */
+			n = 0;
+			dwOff = 0;
+			if (ev.bStatus == msgSysEx1)
+				msg[n++] = msgSysEx1;
+			while(bOK)
+			{
+				DWORD dwGot = midiReadGetEventPayloadPart(pMF, &ev, dwOff, msg + n, 3 - n);
+
+				dwOff += dwGot;
+				n += dwGot;
+				if (!n)
+					break;
+				bOK = _midiCompileWrite(fp, qwAt - qwLast, msg, n, &dwCount);
+				qwLast = qwAt;
+				if (n < 3)
+					break;
+				n = 0;
+			}
+		}
+	}
+
+	/* The song lasts until its last end of track marker */
+	if (bOK)
+		bOK = _midiCompileWrite(fp, midiTempoTickToMicros(&map, dwEnd) - qwLast, msg, 0, &dwCount);
+
+	midiReadRestore(pMF, &Saved);
+	midiTempoFree(&map);
+
+	_midiCompilePut(hdr, dwCount);
+	bOK = bOK && fseek(fp, 8, SEEK_SET) == 0 && fwrite(hdr, 1, 4, fp) == 4;
+	return fclose(fp) == 0 && bOK;
+}
+
+/*
+** Playing a compiled song. Nothing here needs the rest of the library,
+** so a player can be built from just these two functions.
+*/
+/* pData is the whole compiled file, which must stay put while it's played */
+BOOL midiCompileInit(MIDI_COMPILED *pSong, const BYTE *pData, DWORD dwSize)
+{
+	DWORD dwCount;
+
+	pSong->pNext = NULL;
+	pSong->dwLeft = 0;
+
+	if (dwSize < MIDI_COMPILED_HEADER || memcmp(pData, "MIDC", 4) || _midiCompileGet(pData + 4) != MIDI_COMPILED_VERSION)
+		return FALSE;
+	dwCount = _midiCompileGet(pData + 8);
+	if (dwCount > (dwSize - MIDI_COMPILED_HEADER) / MIDI_COMPILED_RECORD)
+		return FALSE;
+
+	pSong->pNext = pData + MIDI_COMPILED_HEADER;
+	pSong->dwLeft = dwCount;
+	return TRUE;
+}
+
+/* Gets the next record: wait *pdwDelay microseconds, then send the *piLen
+** bytes in pMsg, which may be none. FALSE at the end of the song. */
+BOOL midiCompileGetNext(MIDI_COMPILED *pSong, DWORD *pdwDelay, BYTE *pMsg, int *piLen)
+{
+	const BYTE *p = pSong->pNext;
+
+	if (!pSong->dwLeft)
+		return FALSE;
+
+	*pdwDelay = _midiCompileGet(p);
+	*piLen = p[4] & 3;
+	pMsg[0] = p[5];
+	pMsg[1] = p[6];
+	pMsg[2] = p[7];
+
+	pSong->pNext = p + MIDI_COMPILED_RECORD;
+	--pSong->dwLeft;
+	return TRUE;
+}
@@ -0,0 +1,76 @@
+/*
+ * midiconvert.c - Format conversion for Steevs MIDI Library. Merges the
+ *				   tracks of a song into the single track of a format 0
+ *				   file, so it can be played with just one read position.
+ * Version 1.4
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of
+ *  the License,or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdlib.h>
+#include "midifile.h"
+
+
+/* Writes pMF to pFilename as a format 0 file. Events come out in the order
+** a merged read plays them: by time, then by track, then as they were in
+** their track, so nothing that happens at the same moment changes order.
+** Delta times are worked out afresh and the writer uses running status
+** wherever the merged stream allows it. The end of track markers are
+** replaced by one at the end of the longest track.
+** Format 2 songs are separate patterns rather than parts of one song, so
+** aren't converted. */
+BOOL midiConvertToFormat0(const _MIDI_FILE *pMF, const char *pFilename)
+{
+	MIDI_READ_STATE Saved;
+	_MIDI_FILE out;
+	MIDI_MERGE merge;
+	MIDI_EVENT ev;
+	DWORD dwEnd = 0;
+	BOOL bOK;
+
+	if (pMF->Header.iVersion == 2)
+		return FALSE;
+
+	midiFileCreate(&out, pFilename, TRUE, &bOK);
+	if (!bOK)
+		return FALSE;
+	midiFileSetPPQN(&out, pMF->Header.PPQN);
+	midiFileSetVersion(&out, 0);
+
+	midiReadRewind(pMF, &Saved, NULL);
+	midiMergeInit(&merge, pMF);
+
+	while(bOK && midiMergeGetNextEvent(&merge, &ev))
+	{
+		if (ev.dwAbsPos > dwEnd)
+			dwEnd = ev.dwAbsPos;
+
+		/* End of track markers go, as do system messages, which have no
+		** place in a file */
+		if (ev.bStatus == msgMetaEvent ? ev.bData1 == metaEndSequence : ev.bStatus > msgSysEx1 && ev.bStatus != msgSysEx2)
+			continue;
+
+		/* Moved on by absolute time, as the gap needn't fit an int */
+		bOK = midiFileFlushTrack(&out, 0, FALSE, ev.dwAbsPos)
+			&& midiTrackAddEvent(&out, 0, pMF, &ev);
+	}
+
+	/* The song still lasts until its longest track's end of track marker */
+	if (bOK)
+		bOK = midiFileFlushTrack(&out, 0, FALSE, dwEnd) && midiSongAddEndSequence(&out, 0);
+
+	midiReadRestore(pMF, &Saved);
+	return midiFileClose(&out) && bOK;
+}
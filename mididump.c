@@ -62,199 +62,180 @@ void playMidiFile(const char *pFilename)
 
 	if (open_success)
 	{
-		static MIDI_MSG msg[MAX_MIDI_TRACKS];
-		int i, iNum;
-		unsigned int j;
-		int any_track_had_data = 1;
-		DWORD current_midi_tick = 0;
-		DWORD bpm = 192;
-		float ms_per_tick;
-		DWORD ticks_to_wait = 0;
-
-		iNum = midiReadGetNumTracks(&pMF);
-
-		for(i=0; i< iNum; i++)
-		{
-			midiReadInitMessage(&msg[i]);
-			midiReadGetNextMessage(&pMF, i, &msg[i]);
-		}
-		
+		static MIDI_MSG msg;
+		MIDI_FILTER filter;
+		MIDI_MERGE merge;
+		MIDI_TEMPO_MAP tempo;
+
+		/* The floppies only play notes, so don't decode anything else */
+		midiFilterInit(&filter, FALSE);
+		filter.wChannels = 0xffff;
+		midiFilterSetMsg(&filter, msgNoteOff, TRUE);
+		midiFilterSetMsg(&filter, msgNoteOn, TRUE);
+		midiFilterSetMsg(&filter, msgSetProgram, TRUE);
+		midiFilterSetMsg(&filter, msgMetaEvent, TRUE);
+		midiFilterSetMeta(&filter, metaSetTempo, TRUE);
+		midiFileSetFilter(&pMF, &filter);
+
+		midiTempoBuild(&tempo, &pMF);
+		midiReadInitMessage(&msg);
+		midiMergeInit(&merge, &pMF);
 		
 		printf("start playing...\r\n");
+		t1 = clock();
 
-		while(any_track_had_data)
+		/* Events from all tracks arrive in time order. Each one is due at a fixed
+		** time from the start, so rounding never builds up over the song. */
+		while(midiMergeGetNextMessage(&merge, &msg, &i))
 		{
-			any_track_had_data = 1;
-			ticks_to_wait = -1;
+			t2 = t1 + (clock_t)(midiTempoTickToMicros(&tempo, msg.dwAbsPos) * CLOCKS_PER_SEC / 1000000);
 
-			for(i=0; i < iNum; i++)
+			while( clock() < t2 )
 			{
-				while(current_midi_tick == pMF.Track[i].pos && pMF.Track[i].ptr2 != pMF.Track[i].pEnd2)
+				// just wait here...
+			}
+
+			//printf("[Track: %d]", i);
+
+			if (msg.bImpliedMsg)
+			{ ev = msg.iImpliedMsg; }
+			else
+			{ ev = msg.iType; }
+
+			//printf(" %06d ", msg.dwAbsPos);
+
+
+			if (muGetMIDIMsgName(str, ev))
+				;//printf("%s  ", str);
+
+			switch(ev)
+			{
+			case	msgNoteOff:
+				muGetNameFromNote(str, msg.MsgData.NoteOff.iNote);
+		//		printf("(%d) %s", msg.MsgData.NoteOff.iChannel, str);
+				midiOutShortMsg(hMidiOut, (0 << 16) | (msg.MsgData.NoteOff.iNote << 8) | (0x80 + msg.MsgData.NoteOff.iChannel - 1) ); // note off
+				break;
+			case	msgNoteOn:
+				muGetNameFromNote(str, msg.MsgData.NoteOn.iNote);
+		//		printf("  (%d) %s %d", msg.MsgData.NoteOn.iChannel, str, msg.MsgData.NoteOn.iVolume);
+				midiOutShortMsg(hMidiOut, (msg.MsgData.NoteOn.iVolume << 16) | (msg.MsgData.NoteOn.iNote << 8) | (0x90 + msg.MsgData.NoteOn.iChannel - 1) ); // note on	
+				break;
+			case	msgNoteKeyPressure:
+				muGetNameFromNote(str, msg.MsgData.NoteKeyPressure.iNote);
+				printf("(%d) %s %d", msg.MsgData.NoteKeyPressure.iChannel,
+					str,
+					msg.MsgData.NoteKeyPressure.iPressure);
+				break;
+			case	msgSetParameter:
+				muGetControlName(str, msg.MsgData.NoteParameter.iControl);
+				printf("(%d) %s -> %d", msg.MsgData.NoteParameter.iChannel,
+					str, msg.MsgData.NoteParameter.iParam);
+				break;
+			case	msgSetProgram:
+				midiOutShortMsg(hMidiOut, (0 << 16) | (msg.MsgData.ChangeProgram.iProgram << 8) | 0xC0 + msg.MsgData.ChangeProgram.iChannel); // set program
+
+				muGetInstrumentName(str, msg.MsgData.ChangeProgram.iProgram);
+				printf("(%d) %s", msg.MsgData.ChangeProgram.iChannel, str);
+				break;
+			case	msgChangePressure:
+				muGetControlName(str, msg.MsgData.ChangePressure.iPressure);
+				printf("(%d) %s", msg.MsgData.ChangePressure.iChannel, str);
+				break;
+			case	msgSetPitchWheel:
+				//printf("(%d) %d", msg.MsgData.PitchWheel.iChannel,
+					//msg.MsgData.PitchWheel.iPitch);
+				break;
+
+			case	msgMetaEvent:
+				printf("---- ");
+				switch(msg.MsgData.MetaEvent.iType)
 				{
-					//printf("[Track: %d]", i);
-
-					if (msg[i].bImpliedMsg)
-					{ ev = msg[i].iImpliedMsg; }
-					else
-					{ ev = msg[i].iType; }
-
-					//printf(" %06d ", msg[i].dwAbsPos);
-
-
-					if (muGetMIDIMsgName(str, ev))
-						;//printf("%s  ", str);
-
-					switch(ev)
-					{
-					case	msgNoteOff:
-						muGetNameFromNote(str, msg[i].MsgData.NoteOff.iNote);
-				//		printf("(%d) %s", msg[i].MsgData.NoteOff.iChannel, str);
-						midiOutShortMsg(hMidiOut, (0 << 16) | (msg[i].MsgData.NoteOff.iNote << 8) | (0x80 + msg[i].MsgData.NoteOff.iChannel - 1) ); // note off
-						break;
-					case	msgNoteOn:
-						muGetNameFromNote(str, msg[i].MsgData.NoteOn.iNote);
-				//		printf("  (%d) %s %d", msg[i].MsgData.NoteOn.iChannel, str, msg[i].MsgData.NoteOn.iVolume);
-						midiOutShortMsg(hMidiOut, (msg[i].MsgData.NoteOn.iVolume << 16) | (msg[i].MsgData.NoteOn.iNote << 8) | (0x90 + msg[i].MsgData.NoteOn.iChannel - 1) ); // note on	
-						break;
-					case	msgNoteKeyPressure:
-						muGetNameFromNote(str, msg[i].MsgData.NoteKeyPressure.iNote);
-						printf("(%d) %s %d", msg[i].MsgData.NoteKeyPressure.iChannel,
-							str,
-							msg[i].MsgData.NoteKeyPressure.iPressure);
-						break;
-					case	msgSetParameter:
-						muGetControlName(str, msg[i].MsgData.NoteParameter.iControl);
-						printf("(%d) %s -> %d", msg[i].MsgData.NoteParameter.iChannel,
-							str, msg[i].MsgData.NoteParameter.iParam);
-						break;
-					case	msgSetProgram:
-						midiOutShortMsg(hMidiOut, (0 << 16) | (msg[i].MsgData.ChangeProgram.iProgram << 8) | 0xC0 + msg[i].MsgData.ChangeProgram.iChannel); // set program
-
-						muGetInstrumentName(str, msg[i].MsgData.ChangeProgram.iProgram);
-						printf("(%d) %s", msg[i].MsgData.ChangeProgram.iChannel, str);
-						break;
-					case	msgChangePressure:
-						muGetControlName(str, msg[i].MsgData.ChangePressure.iPressure);
-						printf("(%d) %s", msg[i].MsgData.ChangePressure.iChannel, str);
-						break;
-					case	msgSetPitchWheel:
-						//printf("(%d) %d", msg[i].MsgData.PitchWheel.iChannel,
-							//msg[i].MsgData.PitchWheel.iPitch);
-						break;
-
-					case	msgMetaEvent:
-						printf("---- ");
-						switch(msg[i].MsgData.MetaEvent.iType)
-						{
-						case	metaMIDIPort:
-							printf("MIDI Port = %d", msg[i].MsgData.MetaEvent.Data.iMIDIPort);
-							break;
-
-						case	metaSequenceNumber:
-							printf("Sequence Number = %d",msg[i].MsgData.MetaEvent.Data.iSequenceNumber);
-							break;
-
-						case	metaTextEvent:
-							printf("Text = '%s'",msg[i].MsgData.MetaEvent.Data.Text.pData);
-							break;
-						case	metaCopyright:
-							printf("Copyright = '%s'",msg[i].MsgData.MetaEvent.Data.Text.pData);
-							break;
-						case	metaTrackName:
-							printf("Track name = '%s'",msg[i].MsgData.MetaEvent.Data.Text.pData);
-							break;
-						case	metaInstrument:
-							printf("Instrument = '%s'",msg[i].MsgData.MetaEvent.Data.Text.pData);
-							break;
-						case	metaLyric:
-							printf("Lyric = '%s'",msg[i].MsgData.MetaEvent.Data.Text.pData);
-							break;
-						case	metaMarker:
-							printf("Marker = '%s'",msg[i].MsgData.MetaEvent.Data.Text.pData);
-							break;
-						case	metaCuePoint:
-							printf("Cue point = '%s'",msg[i].MsgData.MetaEvent.Data.Text.pData);
-							break;
-						case	metaEndSequence:
-							printf("End Sequence");
-							break;
-						case	metaSetTempo:
-							bpm = msg[i].MsgData.MetaEvent.Data.Tempo.iBPM;
-							ms_per_tick = 60000.0f / (bpm * pMF.Header.PPQN);
-							printf("Tempo = %d", msg[i].MsgData.MetaEvent.Data.Tempo.iBPM);
-							break;
-						case	metaSMPTEOffset:
-							printf("SMPTE offset = %d:%d:%d.%d %d",
-								msg[i].MsgData.MetaEvent.Data.SMPTE.iHours,
-								msg[i].MsgData.MetaEvent.Data.SMPTE.iMins,
-								msg[i].MsgData.MetaEvent.Data.SMPTE.iSecs,
-								msg[i].MsgData.MetaEvent.Data.SMPTE.iFrames,
-								msg[i].MsgData.MetaEvent.Data.SMPTE.iFF
-								);
-							break;
-						case	metaTimeSig:
-							printf("Time sig = %d/%d",msg[i].MsgData.MetaEvent.Data.TimeSig.iNom,
-								msg[i].MsgData.MetaEvent.Data.TimeSig.iDenom/MIDI_NOTE_CROCHET);
-							break;
-						case	metaKeySig:
-							if (muGetKeySigName(str, msg[i].MsgData.MetaEvent.Data.KeySig.iKey))
-								printf("Key sig = %s", str);
-							break;
-
-						case	metaSequencerSpecific:
-							printf("Sequencer specific = ");
-							HexList(msg[i].MsgData.MetaEvent.Data.Sequencer.pData, msg[i].MsgData.MetaEvent.Data.Sequencer.iSize); // ok
-							printf("\r\n");
-							break;
-						}
-						break;
-
-					case	msgSysEx1:
-					case	msgSysEx2:
-						printf("Sysex = ");
-						HexList(msg[i].MsgData.SysEx.pData, msg[i].MsgData.SysEx.iSize); // ok
-						break;
-					}
-
-					if (ev == msgSysEx1 || ev == msgSysEx1 || (ev==msgMetaEvent && msg[i].MsgData.MetaEvent.iType==metaSequencerSpecific))
-					{
-						// Already done a hex dump
-					}
-					else
-					{
-						/*
-						printf("  [");
-						if (msg[i].bImpliedMsg) printf("%X!", msg[i].iImpliedMsg);
-						for(j=0;j<msg[i].iMsgSize;j++)
-							printf("%X ", msg[i].data[j]);
-						printf("]\r\n");
-						*/
-					}
-
-					if(midiReadGetNextMessage(&pMF, i, &msg[i]))
-					{
-						any_track_had_data = 1; // 0 ???
-					}
+				case	metaMIDIPort:
+					printf("MIDI Port = %d", msg.MsgData.MetaEvent.Data.iMIDIPort);
+					break;
+
+				case	metaSequenceNumber:
+					printf("Sequence Number = %d",msg.MsgData.MetaEvent.Data.iSequenceNumber);
+					break;
+
+				case	metaTextEvent:
+					printf("Text = '%s'",msg.MsgData.MetaEvent.Data.Text.pData);
+					break;
+				case	metaCopyright:
+					printf("Copyright = '%s'",msg.MsgData.MetaEvent.Data.Text.pData);
+					break;
+				case	metaTrackName:
+					printf("Track name = '%s'",msg.MsgData.MetaEvent.Data.Text.pData);
+					break;
+				case	metaInstrument:
+					printf("Instrument = '%s'",msg.MsgData.MetaEvent.Data.Text.pData);
+					break;
+				case	metaLyric:
+					printf("Lyric = '%s'",msg.MsgData.MetaEvent.Data.Text.pData);
+					break;
+				case	metaMarker:
+					printf("Marker = '%s'",msg.MsgData.MetaEvent.Data.Text.pData);
+					break;
+				case	metaCuePoint:
+					printf("Cue point = '%s'",msg.MsgData.MetaEvent.Data.Text.pData);
+					break;
+				case	metaEndSequence:
+					printf("End Sequence");
+					break;
+				case	metaSetTempo:
+					printf("Tempo = %d", msg.MsgData.MetaEvent.Data.Tempo.iBPM);
+					break;
+				case	metaSMPTEOffset:
+					printf("SMPTE offset = %d:%d:%d.%d %d",
+						msg.MsgData.MetaEvent.Data.SMPTE.iHours,
+						msg.MsgData.MetaEvent.Data.SMPTE.iMins,
+						msg.MsgData.MetaEvent.Data.SMPTE.iSecs,
+						msg.MsgData.MetaEvent.Data.SMPTE.iFrames,
+						msg.MsgData.MetaEvent.Data.SMPTE.iFF
+						);
+					break;
+				case	metaTimeSig:
+					printf("Time sig = %d/%d",msg.MsgData.MetaEvent.Data.TimeSig.iNom,
+						msg.MsgData.MetaEvent.Data.TimeSig.iDenom/MIDI_NOTE_CROCHET);
+					break;
+				case	metaKeySig:
+					if (muGetKeySigName(str, msg.MsgData.MetaEvent.Data.KeySig.iKey))
+						printf("Key sig = %s", str);
+					break;
+
+				case	metaSequencerSpecific:
+					printf("Sequencer specific = ");
+					HexList(msg.MsgData.MetaEvent.Data.Sequencer.pData, msg.MsgData.MetaEvent.Data.Sequencer.iSize); // ok
+					printf("\r\n");
+					break;
 				}
+				break;
 
-				ticks_to_wait = (pMF.Track[i].pos - current_midi_tick > 0 && ticks_to_wait > pMF.Track[i].pos - current_midi_tick) ? pMF.Track[i].pos - current_midi_tick : ticks_to_wait;
+			case	msgSysEx1:
+			case	msgSysEx2:
+				printf("Sysex = ");
+				HexList(msg.MsgData.SysEx.pData, msg.MsgData.SysEx.iSize); // ok
+				break;
 			}
 
-			if(ticks_to_wait == -1)
-				ticks_to_wait = 0;
-
-			// wait microseconds per tick here
-			t2 = clock() + ticks_to_wait * ms_per_tick;
-
-			while( clock() < t2 )
+			if (ev == msgSysEx1 || ev == msgSysEx1 || (ev==msgMetaEvent && msg.MsgData.MetaEvent.iType==metaSequencerSpecific))
 			{
-				// just wait here...
+				// Already done a hex dump
+			}
+			else
+			{
+				/*
+				printf("  [");
+				if (msg.bImpliedMsg) printf("%X!", msg.iImpliedMsg);
+				for(j=0;j<msg.iMsgSize;j++)
+					printf("%X ", msg.data[j]);
+				printf("]\r\n");
+				*/
 			}
-			
-			current_midi_tick += ticks_to_wait;
 		}
 
 		midiReadFreeMessage(&msg);
+		midiTempoFree(&tempo);
 		midiFileClose(&pMF);
 
 
@@ -21,52 +21,61 @@
  *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE				/* for copy_file_range() */
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #ifndef  __APPLE__
 #include <malloc.h>
 #endif
+#if defined(__linux__)
+#include <unistd.h>
+#include <sys/sendfile.h>
+#define MIDI_HAVE_SENDFILE
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define MIDI_HAVE_COPY_FILE_RANGE
+#endif
+#endif
 #include "midifile.h"
 
-static FILE* g_file;
-
-
-static void read_mem_from_pos(void* dst, DWORD pos, DWORD length)
+static void read_mem_from_pos(MIDI_SOURCE *pSrc, void* dst, DWORD pos, DWORD length)
 {
-	fseek(g_file, pos, SEEK_SET);
-	fread(dst, 1, length, g_file);
+	midiSourceRead(pSrc, pos, dst, length);
 }
 
-static DWORD read_dword_value_from_pos(DWORD pos)
+static BYTE read_byte_value_from_pos(MIDI_SOURCE *pSrc, DWORD pos)
 {
-	DWORD ret = 0;
-	read_mem_from_pos(&ret, pos, sizeof(DWORD));
+	BYTE ret;
+	DWORD ofs = pos - pSrc->dwWinPos;
+
+	/* Fast path - almost every byte is already sitting in the window */
+	if (ofs < pSrc->dwWinLen)
+		return pSrc->pWin[ofs];
 
+	midiSourceRead(pSrc, pos, &ret, 1);
 	return ret;
 }
 
-static WORD read_word_value_from_pos(DWORD pos)
+/* MIDI files are big endian, so multi byte values are assembled here
+** rather than read straight into a host sized variable */
+static DWORD read_dword_value_from_pos(MIDI_SOURCE *pSrc, DWORD pos)
 {
-	WORD ret = 0;
-	read_mem_from_pos(&ret, pos, sizeof(WORD));
+	BYTE b[4];
+	read_mem_from_pos(pSrc, b, pos, 4);
 
-	return ret;
+	return ((DWORD)b[0] << 24) | ((DWORD)b[1] << 16) | ((DWORD)b[2] << 8) | b[3];
 }
 
-static BYTE read_byte_value_from_pos(DWORD pos)
+static WORD read_word_value_from_pos(MIDI_SOURCE *pSrc, DWORD pos)
 {
-	BYTE ret = 0;
-	read_mem_from_pos(&ret, pos, sizeof(BYTE));
+	BYTE b[2];
+	read_mem_from_pos(pSrc, b, pos, 2);
 
-	return ret;
+	return (WORD)((b[0] << 8) | b[1]);
 }
 
-static void read_string_from_pos_s(void* dst, DWORD pos, DWORD max_length)
-{
-	read_mem_from_pos(dst, pos, max_length - 2);
-	((BYTE*)dst)[max_length - 1] = '\0'; // if the input sting is too long, just cut it.
-}
 
 
 
@@ -76,8 +85,6 @@ static void read_string_from_pos_s(void* dst, DWORD pos, DWORD max_length)
 ** Internal Functions
 */
 #define DT_DEF				32			/* assume maximum delta-time + msg is no more than 32 bytes */
-#define SWAP_WORD(w)		(WORD)(((w)>>8)|((w)<<8))
-#define SWAP_DWORD(d)		(DWORD)((d)>>24)|(((d)>>8)&0xff00)|(((d)<<8)&0xff0000)|(((d)<<24))
 
 #define _VAR_CAST				_MIDI_FILE *pMF = (_MIDI_FILE *)_pMF
 #define IsFilePtrValid(pMF)		(pMF)
@@ -103,7 +110,8 @@ static BOOL _midiValidateTrack(const _MIDI_FILE *pMF, int iTrack)
 		return FALSE;
 	*/
 
-	if (iTrack < 0 || iTrack>=pMF->Header.iNumTracks)
+	/* The header's count can be anything, only MAX_MIDI_TRACKS are kept */
+	if (iTrack < 0 || iTrack>=pMF->Header.iNumTracks || iTrack >= MAX_MIDI_TRACKS)
 		return FALSE;
 	}
 	
@@ -178,7 +186,7 @@ int length = ppqn;
 }
 
 
-static int		midiFileSetTracksDefaultChannel(_MIDI_FILE *_pMF, int iTrack, int iChannel)
+int		midiFileSetTracksDefaultChannel(_MIDI_FILE *_pMF, int iTrack, int iChannel)
 {
 int prev;
 
@@ -195,7 +203,7 @@ int prev;
 	return prev;
 }
 
-static int		midiFileGetTracksDefaultChannel(const _MIDI_FILE *_pMF, int iTrack)
+int		midiFileGetTracksDefaultChannel(const _MIDI_FILE *_pMF, int iTrack)
 {
 	_VAR_CAST;
 	if (!IsFilePtrValid(pMF))				return 0;
@@ -204,7 +212,7 @@ static int		midiFileGetTracksDefaultChannel(const _MIDI_FILE *_pMF, int iTrack)
 	return pMF->Track[iTrack].iDefaultChannel+1;
 }
 
-static int		midiFileSetPPQN(_MIDI_FILE *_pMF, int PPQN)
+int		midiFileSetPPQN(_MIDI_FILE *_pMF, int PPQN)
 {
 int prev;
 
@@ -215,14 +223,14 @@ int prev;
 	return prev;
 }
 
-static int		midiFileGetPPQN(const _MIDI_FILE *_pMF)
+int		midiFileGetPPQN(const _MIDI_FILE *_pMF)
 {
 	_VAR_CAST;
 	if (!IsFilePtrValid(pMF))				return MIDI_PPQN_DEFAULT;
 	return (int)pMF->Header.PPQN;
 }
 
-static int		midiFileSetVersion(_MIDI_FILE *_pMF, int iVersion)
+int		midiFileSetVersion(_MIDI_FILE *_pMF, int iVersion)
 {
 int prev;
 
@@ -234,7 +242,7 @@ int prev;
 	return prev;
 }
 
-static int			midiFileGetVersion(const _MIDI_FILE *_pMF)
+int			midiFileGetVersion(const _MIDI_FILE *_pMF)
 {
 	_VAR_CAST;
 	if (!IsFilePtrValid(pMF))				return MIDI_VERSION_DEFAULT;
@@ -243,38 +251,58 @@ static int			midiFileGetVersion(const _MIDI_FILE *_pMF)
 
 
 
-void midiFileOpen( _MIDI_FILE* pMF, const char *pFilename, BOOL* open_success )
+/* Takes the track table from an index rather than walking the chunk
+** headers for it, as long as it fits the file: the same number of tracks,
+** each after the last and all inside the file. */
+static BOOL _midiFileUseIndex(_MIDI_FILE *pMF, const MIDI_INDEX *pIndex, DWORD ptr2)
+{
+	DWORD dwSize = midiSourceGetSize(&pMF->Src);
+	int i, iNum = pMF->Header.iNumTracks < MAX_MIDI_TRACKS ? pMF->Header.iNumTracks : MAX_MIDI_TRACKS;
+
+	if (pIndex->iNumTracks != iNum || pIndex->dwSize != dwSize || dwSize < 8)
+		return FALSE;
+	for(i=0; i < iNum; ++i)
+	{
+		if (pIndex->pBase2[i] < ptr2 || pIndex->pBase2[i] > dwSize - 8 || pIndex->size[i] > dwSize - 8 - pIndex->pBase2[i])
+			return FALSE;
+		ptr2 = pIndex->pBase2[i] + pIndex->size[i] + 8;
+	}
+
+	for(i=0; i < iNum; ++i)
+	{
+		pMF->Track[i].pBase2 = pIndex->pBase2[i];
+		pMF->Track[i].ptr2 = pIndex->pBase2[i] + 8;
+		pMF->Track[i].size = pIndex->size[i];
+		pMF->Track[i].pEnd2 = pIndex->pBase2[i] + pIndex->size[i] + 8;
+	}
+	return TRUE;
+}
+
+static void _midiFileOpenSource( _MIDI_FILE* pMF, const MIDI_SOURCE_FUNCS *pFuncs, const void *pParam, MIDI_SOURCE_SECTOR *pCache, int iNumSectors, const MIDI_INDEX *pIndex, BOOL* open_success )
 {
+	MIDI_SOURCE *pSrc = &pMF->Src;
 	DWORD ptr2;
 	BOOL bValidFile = FALSE;
 	BYTE magic[4];
 
-	g_file = fopen(pFilename, "rb");
-
-	if(g_file)
+	if (midiSourceOpenCached(pSrc, pFuncs, pParam, pCache, iNumSectors))
 	{
+		pMF->pArena = NULL;
+		pMF->pFilter = NULL;
+		pMF->pWriter = NULL;
 		pMF->ptr2 = 0;
 		ptr2 = pMF->ptr2;
-		read_mem_from_pos(magic, ptr2, 4); // read magic sequence
+		read_mem_from_pos(pSrc, magic, ptr2, 4); // read magic sequence
 
 		// Is this a valid MIDI file ?
 		if (magic[0] == 'M' && magic[1] == 'T' &&  magic[2] == 'h' && magic[3] == 'd')
 		{
-			DWORD dwData2;
-			WORD wData2;
 			int i;
 
-			dwData2 = read_dword_value_from_pos(ptr2 + 4);
-			pMF->Header.iHeaderSize = SWAP_DWORD(dwData2);
-
-			wData2 = read_word_value_from_pos(ptr2 + 8);
-			pMF->Header.iVersion = (WORD)SWAP_WORD(wData2);
-					
-			wData2 = read_word_value_from_pos(ptr2 + 10);
-			pMF->Header.iNumTracks = (WORD)SWAP_WORD(wData2);
-					
-			wData2 = read_word_value_from_pos(ptr2 + 12);
-			pMF->Header.PPQN = (WORD)SWAP_WORD(wData2);
+			pMF->Header.iHeaderSize = read_dword_value_from_pos(pSrc, ptr2 + 4);
+			pMF->Header.iVersion = read_word_value_from_pos(pSrc, ptr2 + 8);
+			pMF->Header.iNumTracks = read_word_value_from_pos(pSrc, ptr2 + 10);
+			pMF->Header.PPQN = read_word_value_from_pos(pSrc, ptr2 + 12);
 					
 			ptr2 += pMF->Header.iHeaderSize + 8;
 			/*
@@ -284,23 +312,28 @@ void midiFileOpen( _MIDI_FILE* pMF, const char *pFilename, BOOL* open_success )
 			{
 				pMF->Track[i].pos = 0;
 				pMF->Track[i].last_status = 0;
+				pMF->Track[i].bFailed = FALSE;
 			}
 					
-			for(i=0; i < (pMF->Header.iNumTracks < MAX_MIDI_TRACKS ? pMF->Header.iNumTracks : MAX_MIDI_TRACKS); ++i)
+			if (!pIndex || !_midiFileUseIndex(pMF, pIndex, ptr2))
 			{
-				pMF->Track[i].pBase2 = ptr2;
-				pMF->Track[i].ptr2 = ptr2 + 8;
-				dwData2 = read_dword_value_from_pos(ptr2 + 4);
-
-				pMF->Track[i].size = SWAP_DWORD(dwData2);
-				pMF->Track[i].pEnd2 = ptr2 + pMF->Track[i].size + 8;
-				ptr2 += pMF->Track[i].size + 8;
+				for(i=0; i < (pMF->Header.iNumTracks < MAX_MIDI_TRACKS ? pMF->Header.iNumTracks : MAX_MIDI_TRACKS); ++i)
+				{
+					pMF->Track[i].pBase2 = ptr2;
+					pMF->Track[i].ptr2 = ptr2 + 8;
+					pMF->Track[i].size = read_dword_value_from_pos(pSrc, ptr2 + 4);
+					pMF->Track[i].pEnd2 = ptr2 + pMF->Track[i].size + 8;
+					ptr2 += pMF->Track[i].size + 8;
+				}
 			}
 						   
 			pMF->bOpenForWriting = FALSE;
-			pMF->pFile = NULL;
 			bValidFile = TRUE;
 		}
+		else
+		{
+			midiSourceClose(pSrc);
+		}
 	}
 	
 	if (!bValidFile)
@@ -309,9 +342,68 @@ void midiFileOpen( _MIDI_FILE* pMF, const char *pFilename, BOOL* open_success )
 		*open_success = TRUE;
 }
 
+void midiFileOpen( _MIDI_FILE* pMF, const char *pFilename, BOOL* open_success )
+{
+	_midiFileOpenSource(pMF, &midiSourceFile, pFilename, NULL, MIDI_SOURCE_CACHE_SECTORS, NULL, open_success);
+}
+
+/* Same as midiFileOpen, but the read cache is the iNumSectors sectors at
+** pCache rather than the heap, so a small target can keep it in a static
+** buffer of whatever size suits. pCache must stay valid until the file is
+** closed. */
+void midiFileOpenCached( _MIDI_FILE* pMF, const char *pFilename, MIDI_SOURCE_SECTOR *pCache, int iNumSectors, BOOL* open_success )
+{
+	_midiFileOpenSource(pMF, &midiSourceFile, pFilename, pCache, iNumSectors, NULL, open_success);
+}
+
+/* Same as midiFileOpen, but the track table comes from pIndex, i.e. one
+** read with midiIndexRead(), instead of a walk over every chunk header.
+** If it doesn't fit the file the headers are walked anyway, so the index
+** still has to be checked against the song afterwards. */
+void midiFileOpenIndexed( _MIDI_FILE* pMF, const char *pFilename, const MIDI_INDEX *pIndex, BOOL* open_success )
+{
+	_midiFileOpenSource(pMF, &midiSourceFile, pFilename, NULL, MIDI_SOURCE_CACHE_SECTORS, pIndex, open_success);
+}
+
+/* Same as midiFileOpen, but maps the whole file into memory. Message data
+** then points straight into the mapping instead of being copied. */
+void midiFileOpenMapped( _MIDI_FILE* pMF, const char *pFilename, BOOL* open_success )
+{
+	_midiFileOpenSource(pMF, &midiSourceMapped, pFilename, NULL, 0, NULL, open_success);
+}
+
+/* Makes all message data read from pMF come out of pArena rather than the
+** heap, or the heap again for NULL. Memory and mapped files never copy, so
+** don't use it. */
+void midiFileSetArena(_MIDI_FILE *pMF, MIDI_ARENA *pArena)
+{
+	pMF->pArena = pArena;
+}
+
+/* Only events passing pFilter are returned from now on, NULL for all.
+** The filter is not copied and must stay valid. */
+void midiFileSetFilter(_MIDI_FILE *pMF, const MIDI_FILTER *pFilter)
+{
+	pMF->pFilter = pFilter;
+}
+
+/* Parses a MIDI file that is already in memory, i.e. linked into flash.
+** The data is decoded in place and must stay valid until midiFileClose */
+void midiFileOpenMemory( _MIDI_FILE* pMF, const BYTE *pData, DWORD dwSize, BOOL* open_success )
+{
+	MIDI_SOURCE_MEM mem;
+
+	mem.pData = pData;
+	mem.dwSize = dwSize;
+	_midiFileOpenSource(pMF, &midiSourceMemory, &mem, NULL, 0, NULL, open_success);
+}
+
+/*
+** Writing
+*/
 typedef struct {
 		int	iIdx;
-		int	iEndPos;
+		DWORD	dwEndPos;
 		} MIDI_END_POINT;
 
 static int qs_cmp_pEndPoints(const void *e1, const void *e2)
@@ -319,347 +411,2065 @@ static int qs_cmp_pEndPoints(const void *e1, const void *e2)
 MIDI_END_POINT *p1 = (MIDI_END_POINT *)e1;
 MIDI_END_POINT *p2 = (MIDI_END_POINT *)e2;
 
-	return p1->iEndPos-p2->iEndPos;
+	/* Not a subtraction, the difference of two DWORDs needn't fit an int */
+	return (p1->dwEndPos > p2->dwEndPos) - (p1->dwEndPos < p2->dwEndPos);
 }
 
-/*
-static BOOL	midiFileSyncTracks(_MIDI_FILE *_pMF, int iTrack1, int iTrack2)
+static BOOL _midiWriteValid(const _MIDI_FILE *pMF, int iTrack)
 {
-int p1, p2;
+	if (!IsFilePtrValid(pMF) || !pMF->bOpenForWriting)	return FALSE;
+	if (!IsTrackValid(iTrack))							return FALSE;
+	return !pMF->pWriter->Track[iTrack].bEnded;
+}
 
-	_VAR_CAST;
-	if (!IsFilePtrValid(pMF))			return FALSE;
-	if (!IsTrackValid(iTrack1))			return FALSE;
-	if (!IsTrackValid(iTrack2))			return FALSE;
+#define MIDI_WRITE_MAX_DELTA	0x0fffffffUL	/* the most four bytes of variable length can hold */
 
-	p1 = pMF->Track[iTrack1].pos + pMF->Track[iTrack1].dt;
-	p2 = pMF->Track[iTrack2].pos + pMF->Track[iTrack2].dt;
-	
-	if (p1 < p2)		midiTrackIncTime(pMF, iTrack1, p2-p1, TRUE);
-	else if (p2 < p1)	midiTrackIncTime(pMF, iTrack2, p1-p2, TRUE);
-	
-	return TRUE;
+static int _midiWriteVarLen(BYTE *p, DWORD dwValue)
+{
+	BYTE tmp[4];
+	int i, n = 0;
+
+	do
+	{
+		tmp[n++] = (BYTE)(dwValue & 0x7f);
+		dwValue >>= 7;
+	} while(dwValue && n < 4);
+
+	for(i=0; i < n; ++i)
+		p[i] = (BYTE)(tmp[n - 1 - i] | (i < n - 1 ? 0x80 : 0));
+	return n;
 }
-*/
 
-BOOL midiFileClose(_MIDI_FILE *_pMF)
+/* Moves everything a track has in memory out to its spill file, keeping
+** just one block to carry on with */
+static BOOL _midiWriteSpill(MIDI_WRITE_TRACK *pWT)
 {
-	_VAR_CAST;
-	if (!IsFilePtrValid(pMF))			return FALSE;
+	MIDI_WRITE_BLOCK *pBlock, *pNext;
 
+	if (!pWT->pSpill && (pWT->pSpill = tmpfile()) == NULL)
+		return FALSE;
 
-	if (pMF->pFile)
-		return fclose(pMF->pFile)?FALSE:TRUE;
-	// free((void *)pMF); // this is not on heap anymore. it's now on the stack
+	for(pBlock=pWT->pFirst; pBlock; pBlock=pBlock->pNext)
+	{
+		if (fwrite(pBlock->data, 1, pBlock->dwUsed, (FILE *)pWT->pSpill) != pBlock->dwUsed)
+			return FALSE;
+		pWT->dwSpilled += pBlock->dwUsed;
+	}
+
+	for(pBlock=pWT->pFirst->pNext; pBlock; pBlock=pNext)
+	{
+		pNext = pBlock->pNext;
+		free(pBlock);
+	}
+	pWT->pFirst->pNext = NULL;
+	pWT->pFirst->dwUsed = 0;
+	pWT->pLast = pWT->pFirst;
 	return TRUE;
 }
 
-
-
-static DWORD _midiReadVarLen2(DWORD ptr2, DWORD *num)
+static BOOL _midiWriteBytes(const MIDI_WRITER *pWriter, MIDI_WRITE_TRACK *pWT, const BYTE *pData, DWORD dwLen)
 {
-	register DWORD value = read_byte_value_from_pos(ptr2++);
-	register BYTE c;
-
-	
-	if(value & 0x80)
+	while(dwLen)
 	{
-		value &= 0x7f;
-		do
+		MIDI_WRITE_BLOCK *pBlock = pWT->pLast;
+		DWORD n;
+
+		if (pBlock && pBlock->dwUsed == MIDI_WRITE_BLOCK_SIZE && pWriter->dwHighWater && pWT->dwSize - pWT->dwSpilled >= pWriter->dwHighWater)
+		{
+			if (!_midiWriteSpill(pWT))
+				return FALSE;
+			pBlock = pWT->pLast;
+		}
+		else if (!pBlock || pBlock->dwUsed == MIDI_WRITE_BLOCK_SIZE)
 		{
-			c = read_byte_value_from_pos(ptr2++);
+			if ((pBlock = (MIDI_WRITE_BLOCK *)malloc(sizeof(MIDI_WRITE_BLOCK))) == NULL)
+				return FALSE;
+			pBlock->pNext = NULL;
+			pBlock->dwUsed = 0;
+			if (pWT->pLast)
+				pWT->pLast->pNext = pBlock;
+			else
+				pWT->pFirst = pBlock;
+			pWT->pLast = pBlock;
+		}
 
-			value = (value << 7) + (c & 0x7f);
-		} 
-		while (c & 0x80);
+		n = MIDI_WRITE_BLOCK_SIZE - pBlock->dwUsed;
+		if (n > dwLen)
+			n = dwLen;
+		memcpy(pBlock->data + pBlock->dwUsed, pData, n);
+		pBlock->dwUsed += n;
+		pWT->dwSize += n;
+		pData += n;
+		dwLen -= n;
 	}
-	*num = value;
-
-	return ptr2;
+	return TRUE;
 }
 
-static BOOL _midiReadTrackCopyData2(MIDI_MSG *pMsg, DWORD ptr2, DWORD sz, BOOL bCopyPtrData)
+/* Writes one whole event, made of pData followed by pMore, once the track's
+** pending delta time has passed. The status byte is dropped whenever
+** running status allows it. */
+static BOOL _midiWriteEvent(_MIDI_FILE *pMF, int iTrack, const BYTE *pData, DWORD dwLen, const BYTE *pMore, DWORD dwMore)
 {
-	if (sz > pMsg->data_sz)
-	{
-		printf("sz was bigger: %d > %d\r\n", sz, pMsg->data_sz);
+	MIDI_FILE_TRACK *pTrk = &pMF->Track[iTrack];
+	MIDI_WRITE_TRACK *pWT = &pMF->pWriter->Track[iTrack];
+	BYTE dt[4];
 
-		pMsg->data = (BYTE *)realloc(pMsg->data, sz); // also acts as malloc. can be tolerated since it only allocs a few bytes
-		pMsg->data_sz = sz;
+	/* Longer gaps than a delta can hold are bridged with empty text events */
+	while(pWT->dt > MIDI_WRITE_MAX_DELTA)
+	{
+		if (!_midiWriteBytes(pMF->pWriter, pWT, dt, _midiWriteVarLen(dt, MIDI_WRITE_MAX_DELTA))
+			|| !_midiWriteBytes(pMF->pWriter, pWT, (const BYTE *)"\xff\x01\x00", 3))
+			return FALSE;
+		pTrk->pos += MIDI_WRITE_MAX_DELTA;
+		pWT->dt -= MIDI_WRITE_MAX_DELTA;
+		pTrk->last_status = 0;
 	}
 
-	if (!pMsg->data)
+	if (!_midiWriteBytes(pMF->pWriter, pWT, dt, _midiWriteVarLen(dt, pWT->dt)))
 		return FALSE;
+	pTrk->pos += pWT->dt;
+	pWT->dt = 0;
+	pWT->bUsed = TRUE;
 
-	if (bCopyPtrData && read_byte_value_from_pos(ptr2))
-		read_mem_from_pos(pMsg->data, ptr2, sz);
+	if (dwLen && pData[0] >= msgNoteOff && pData[0] < msgSysEx1)
+	{
+		if (pData[0] == pTrk->last_status)
+		{
+			++pData;
+			--dwLen;
+		}
+		else
+		{
+			pTrk->last_status = pData[0];
+		}
+	}
+	else
+	{
+		pTrk->last_status = 0;		/* SysEx and meta events cancel running status */
+	}
 
-	return TRUE;
+	return _midiWriteBytes(pMF->pWriter, pWT, pData, dwLen) && _midiWriteBytes(pMF->pWriter, pWT, pMore, dwMore);
 }
 
-int midiReadGetNumTracks(const _MIDI_FILE *_pMF)
+static BOOL _midiWriteMeta(_MIDI_FILE *pMF, int iTrack, BYTE bType, const BYTE *pData, DWORD dwLen)
 {
-	_VAR_CAST;
-	return pMF->Header.iNumTracks;
-}
+	BYTE hdr[6];
 
+	if (!_midiWriteValid(pMF, iTrack))
+		return FALSE;
 
-BOOL midiReadGetNextMessage(const _MIDI_FILE *_pMF, int iTrack, MIDI_MSG *pMsg)
-{
-	MIDI_FILE_TRACK *pTrack;
-	DWORD bptr2, pMsgDataPtr2;
-
-	int sz;
+	hdr[0] = msgMetaEvent;
+	hdr[1] = bType;
+	return _midiWriteEvent(pMF, iTrack, hdr, 2 + _midiWriteVarLen(hdr + 2, dwLen), pData, dwLen);
+}
 
-	BYTE bTmp[16];
+static BOOL _midiWriteBE(FILE *fp, DWORD dwValue, int iBytes)
+{
+	BYTE b[4];
+	int i;
 
-	_VAR_CAST;
+	for(i=0; i < iBytes; ++i)
+		b[i] = (BYTE)(dwValue >> (8 * (iBytes - 1 - i)));
+	return fwrite(b, 1, iBytes, fp) == (size_t)iBytes;
+}
 
-	// just remove and assume the track is valid?
-	if (!IsTrackValid(iTrack))
-		return FALSE;
-	
-	pTrack = &pMF->Track[iTrack];
+/* Appends the first dwLen bytes of a spill file to the output. Where the
+** system allows the kernel copies them directly, without them ever
+** passing through our memory. */
+static BOOL _midiWriteCopySpill(FILE *fpOut, FILE *fpSpill, DWORD dwLen)
+{
+	BYTE buf[MIDI_WRITE_BLOCK_SIZE];
+	size_t n;
 
-	/* FIXME: Check if there is data on this track first!!!	*/
-	if (pTrack->ptr2 >= pTrack->pEnd2)
+	if (fflush(fpOut) || fflush(fpSpill))
 		return FALSE;
-	
-	pTrack->ptr2 = _midiReadVarLen2(pTrack->ptr2, &pMsg->dt);
-	pTrack->pos += pMsg->dt;
-	pMsg->dwAbsPos = pTrack->pos;
 
-	bTmp[0] = read_byte_value_from_pos(pTrack->ptr2);
-	if(bTmp[0] & 0x80) /* Is this is sys message */
+#ifdef MIDI_HAVE_SENDFILE
 	{
-		pMsg->iType = (tMIDI_MSG)(bTmp[0] & 0xf0);
-		pMsgDataPtr2 = pTrack->ptr2 + 1;
+		int fdIn = fileno(fpSpill), fdOut = fileno(fpOut);
+		off_t off = 0;
 
-		/* SysEx & Meta events don't carry channel info, but something
-		** important in their lower bits that we must keep */
-		if (pMsg->iType == 0xf0)
+		while(dwLen)
 		{
-			pMsg->iType = (tMIDI_MSG)read_byte_value_from_pos(pTrack->ptr2);
+			ssize_t done = -1;
+#ifdef MIDI_HAVE_COPY_FILE_RANGE
+			loff_t lOff = off;
+
+			done = copy_file_range(fdIn, &lOff, fdOut, NULL, dwLen, 0);
+			off = (off_t)lOff;
+#endif
+			if (done < 0)
+				done = sendfile(fdOut, fdIn, &off, dwLen);
+			if (done <= 0)
+				break;
+			dwLen -= (DWORD)done;
 		}
+
+		/* Let stdio catch up with where the file descriptor is now */
+		if (fseek(fpOut, 0, SEEK_END) || fseek(fpSpill, off, SEEK_SET))
+			return FALSE;
 	}
-	else						/* just data - so use the last msg type */
+#else
+	if (fseek(fpSpill, 0, SEEK_SET))
+		return FALSE;
+#endif
+
+	/* Anything left over goes the slow way */
+	while(dwLen)
 	{
-		pMsg->iType = pMsg->iLastMsgType;
-		pMsgDataPtr2 = pTrack->ptr2;
+		n = fread(buf, 1, dwLen < sizeof(buf) ? dwLen : sizeof(buf), fpSpill);
+		if (!n || fwrite(buf, 1, n, fpOut) != n)
+			return FALSE;
+		dwLen -= (DWORD)n;
 	}
-	
-	pMsg->iLastMsgType = (tMIDI_MSG)pMsg->iType;
-
-	bTmp[0] = read_byte_value_from_pos(pTrack->ptr2);
+	return TRUE;
+}
 
-	pMsg->iLastMsgChnl = (BYTE)((bTmp[0]     ) & 0x0f) + 1;
+/* Finishes every track and writes the whole file in one pass. The track
+** lengths are all known by now, so nothing needs going back to patch. */
+static BOOL _midiFileWriteOut(_MIDI_FILE *pMF)
+{
+	MIDI_WRITER *pWriter = pMF->pWriter;
+	FILE *fp = (FILE *)pWriter->pFile;
+	const MIDI_WRITE_BLOCK *pBlock;
+	WORD iNumTracks = 0;
+	BOOL bOK = TRUE;
+	int i;
+
+	for(i=0; i < MAX_MIDI_TRACKS; ++i)
+		if (pWriter->Track[i].bUsed)
+		{
+			if (!pWriter->Track[i].bEnded)
+				bOK = midiSongAddEndSequence(pMF, i) && bOK;
+			++iNumTracks;
+		}
 
-	bTmp[0] = read_byte_value_from_pos(pMsgDataPtr2 + 0);
-	bTmp[1] = read_byte_value_from_pos(pMsgDataPtr2 + 1);
-	bTmp[2] = read_byte_value_from_pos(pMsgDataPtr2 + 2);
+	bOK = bOK && fwrite("MThd", 1, 4, fp) == 4 && _midiWriteBE(fp, 6, 4);
+	/* Format 0 only has room for one track */
+	bOK = bOK && _midiWriteBE(fp, iNumTracks > 1 && pMF->Header.iVersion == 0 ? 1 : pMF->Header.iVersion, 2);
+	bOK = bOK && _midiWriteBE(fp, iNumTracks, 2) && _midiWriteBE(fp, pMF->Header.PPQN, 2);
 
-	switch(pMsg->iType)
-	{
-	case	msgNoteOn:
-		pMsg->MsgData.NoteOn.iChannel = pMsg->iLastMsgChnl;
-		pMsg->MsgData.NoteOn.iNote = bTmp[0];
-		pMsg->MsgData.NoteOn.iVolume = bTmp[1];
+	for(i=0; i < MAX_MIDI_TRACKS && bOK; ++i)
+		if (pWriter->Track[i].bUsed)
+		{
+			bOK = fwrite("MTrk", 1, 4, fp) == 4 && _midiWriteBE(fp, pWriter->Track[i].dwSize, 4);
+			if (bOK && pWriter->Track[i].pSpill)
+				bOK = _midiWriteCopySpill(fp, (FILE *)pWriter->Track[i].pSpill, pWriter->Track[i].dwSpilled);
+			for(pBlock=pWriter->Track[i].pFirst; pBlock && bOK; pBlock=pBlock->pNext)
+				bOK = fwrite(pBlock->data, 1, pBlock->dwUsed, fp) == pBlock->dwUsed;
+		}
 
-		pMsg->iMsgSize = 3;
-		break;
+	return bOK;
+}
 
-	case	msgNoteOff:
-		pMsg->MsgData.NoteOff.iChannel = pMsg->iLastMsgChnl;
-		pMsg->MsgData.NoteOff.iNote = bTmp[0];
+/* Starts a new file, which is only written when it's closed. Up to
+** MAX_MIDI_TRACKS tracks can be added to in any order; empty ones are
+** left out. */
+void midiFileCreate(_MIDI_FILE *pMF, const char *pFilename, BOOL bOverwriteIfExists, BOOL *create_success)
+{
+	FILE *fp;
+	int i;
 
-		pMsg->iMsgSize = 3;
-		break;
+	*create_success = FALSE;
+	memset(pMF, 0, sizeof(*pMF));
 
-	case	msgNoteKeyPressure:
-		pMsg->MsgData.NoteKeyPressure.iChannel = pMsg->iLastMsgChnl;
-		pMsg->MsgData.NoteKeyPressure.iNote = bTmp[0];
-		pMsg->MsgData.NoteKeyPressure.iPressure = bTmp[1];
+	if (!bOverwriteIfExists && (fp = fopen(pFilename, "rb")) != NULL)
+	{
+		fclose(fp);
+		return;
+	}
 
-		pMsg->iMsgSize = 3;
-		break;
+	if ((pMF->pWriter = (MIDI_WRITER *)calloc(1, sizeof(MIDI_WRITER))) == NULL)
+		return;
+	if ((fp = fopen(pFilename, "wb")) == NULL)
+	{
+		free(pMF->pWriter);
+		pMF->pWriter = NULL;
+		return;
+	}
 
-	case	msgSetParameter:
-		pMsg->MsgData.NoteParameter.iChannel = pMsg->iLastMsgChnl;
-		pMsg->MsgData.NoteParameter.iControl = (tMIDI_CC)bTmp[0]; 
-		pMsg->MsgData.NoteParameter.iParam = bTmp[1];
-		pMsg->iMsgSize = 3;
-		break;
+	pMF->pWriter->pFile = fp;
+	pMF->bOpenForWriting = TRUE;
+	pMF->Header.PPQN = MIDI_PPQN_DEFAULT;
+	pMF->Header.iVersion = MIDI_VERSION_DEFAULT;
+	for(i=0; i < MAX_MIDI_TRACKS; ++i)
+		pMF->Track[i].iDefaultChannel = (BYTE)(i & 0x0f);
 
-	case	msgSetProgram:
-		pMsg->MsgData.ChangeProgram.iChannel = pMsg->iLastMsgChnl;
-		pMsg->MsgData.ChangeProgram.iProgram = bTmp[0];
-		pMsg->iMsgSize = 2;
-		break;
+	*create_success = TRUE;
+}
 
-	case	msgChangePressure:
-		pMsg->MsgData.ChangePressure.iChannel = pMsg->iLastMsgChnl;
-		pMsg->MsgData.ChangePressure.iPressure = bTmp[0];
-		pMsg->iMsgSize = 2;
-		break;
+/* Limits each track being written to about dwHighWater bytes of memory.
+** Beyond that it goes to a temporary file until the file is closed. 0, the
+** default, keeps everything in memory. */
+BOOL midiFileSetSpill(_MIDI_FILE *_pMF, DWORD dwHighWater)
+{
+	_VAR_CAST;
+	if (!IsFilePtrValid(pMF) || !pMF->bOpenForWriting)	return FALSE;
 
-	case	msgSetPitchWheel:
-		pMsg->MsgData.PitchWheel.iChannel = pMsg->iLastMsgChnl;
-		pMsg->MsgData.PitchWheel.iPitch = bTmp[0] | (bTmp[1] << 7);
-		pMsg->MsgData.PitchWheel.iPitch -= MIDI_WHEEL_CENTRE;
-		pMsg->iMsgSize = 3;
-		break;
+	pMF->pWriter->dwHighWater = dwHighWater;
+	return TRUE;
+}
 
-	case	msgMetaEvent:
-		/* We can use 'pTrack->ptr' from now on, since meta events
-		** always have bit 7 set */
-		bptr2 = pTrack->ptr2;
+/* Writes the note offs of any notes ending by dwEndTimePos, or all of them
+** with bFlushToEnd, and moves the track's time on to there */
+BOOL midiFileFlushTrack(_MIDI_FILE *_pMF, int iTrack, BOOL bFlushToEnd, DWORD dwEndTimePos)
+{
+	MIDI_END_POINT EndPoints[MAX_TRACK_POLYPHONY];
+	MIDI_FILE_TRACK *pTrk;
+	MIDI_WRITE_TRACK *pWT;
+	BYTE data[3];
+	DWORD now;
+	int i, num = 0;
 
-		bTmp[1] = read_byte_value_from_pos(pTrack->ptr2 + 1);
-		pMsg->MsgData.MetaEvent.iType = (tMIDI_META)bTmp[1];
-		pTrack->ptr2 = _midiReadVarLen2(pTrack->ptr2 + 2, &pMsg->iMsgSize);
+	_VAR_CAST;
+	if (!_midiWriteValid(pMF, iTrack))		return FALSE;
 
-		bTmp[0] = read_byte_value_from_pos(pTrack->ptr2 + 0);
-		bTmp[1] = read_byte_value_from_pos(pTrack->ptr2 + 1);
-		bTmp[2] = read_byte_value_from_pos(pTrack->ptr2 + 2);
-		bTmp[3] = read_byte_value_from_pos(pTrack->ptr2 + 3);
-		bTmp[4] = read_byte_value_from_pos(pTrack->ptr2 + 4);
+	pTrk = &pMF->Track[iTrack];
+	pWT = &pMF->pWriter->Track[iTrack];
+	for(i=0; i < MAX_TRACK_POLYPHONY; ++i)
+		if (pWT->LastNote[i].valid)
+		{
+			EndPoints[num].iIdx = i;
+			EndPoints[num].dwEndPos = pWT->LastNote[i].end_pos;
+			++num;
+		}
+	qsort(EndPoints, num, sizeof(MIDI_END_POINT), qs_cmp_pEndPoints);
 
-		sz = (pTrack->ptr2 - bptr2) + pMsg->iMsgSize;
+	/* Time only goes forwards */
+	now = pTrk->pos + pWT->dt;
+	if (bFlushToEnd)
+		dwEndTimePos = num ? EndPoints[num-1].dwEndPos : now;
+	if (dwEndTimePos < now)
+		dwEndTimePos = now;
 
-		if (_midiReadTrackCopyData2(pMsg, pTrack->ptr2, sz, FALSE) == FALSE)
+	for(i=0; i < num && EndPoints[i].dwEndPos <= dwEndTimePos; ++i)
+	{
+		MIDI_LAST_NOTE *pNote = &pWT->LastNote[EndPoints[i].iIdx];
+
+		/* A note on with no volume, so a run of notes shares one status byte */
+		data[0] = (BYTE)(msgNoteOn | pNote->chn);
+		data[1] = pNote->note;
+		data[2] = 0;
+		pWT->dt = pNote->end_pos > pTrk->pos ? pNote->end_pos - pTrk->pos : 0;
+		if (!_midiWriteEvent(pMF, iTrack, data, 3, NULL, 0))
 			return FALSE;
+		pNote->valid = FALSE;
+	}
 
-		/* Now copy the data...*/
-		read_mem_from_pos(pMsg->data, bptr2, sz);
-
-		/* Now place it in a neat structure */
-		switch(pMsg->MsgData.MetaEvent.iType)
-			{
-			case	metaMIDIPort:
-					pMsg->MsgData.MetaEvent.Data.iMIDIPort = bTmp[0];
-
-					break;
-			case	metaSequenceNumber:
-					pMsg->MsgData.MetaEvent.Data.iSequenceNumber = bTmp[0];
-					break;
-			case	metaTextEvent:
-			case	metaCopyright:
-			case	metaTrackName:
-			case	metaInstrument:
-			case	metaLyric:
-			case	metaMarker:
-			case	metaCuePoint:
-					/* TODO - Add NULL terminator ??? */
-					//pMsg->MsgData.MetaEvent.Data.Text.pData = pTrack->ptr2;
-					read_string_from_pos_s(pMsg->MsgData.MetaEvent.Data.Text.pData, pTrack->ptr2, sizeof(pMsg->MsgData.MetaEvent.Data.Text.pData));
-					break;
-			case	metaEndSequence:
-					/* NO DATA */
-					break;
-			case	metaSetTempo:
-					{
-					
-					DWORD us = bTmp[0] << 16 | (bTmp[1] << 8 ) | bTmp[2];
-					pMsg->MsgData.MetaEvent.Data.Tempo.iBPM = 60000000L/us;
-					}
-					break;
-			case	metaSMPTEOffset:
-					pMsg->MsgData.MetaEvent.Data.SMPTE.iHours = bTmp[0];
-					pMsg->MsgData.MetaEvent.Data.SMPTE.iMins= bTmp[1];
-					pMsg->MsgData.MetaEvent.Data.SMPTE.iSecs = bTmp[2];
-					pMsg->MsgData.MetaEvent.Data.SMPTE.iFrames = bTmp[3];
-					pMsg->MsgData.MetaEvent.Data.SMPTE.iFF = bTmp[4];
-					break;
-			case	metaTimeSig:
-					pMsg->MsgData.MetaEvent.Data.TimeSig.iNom = bTmp[0];
-					pMsg->MsgData.MetaEvent.Data.TimeSig.iDenom = bTmp[1] * MIDI_NOTE_MINIM;
-					/* TODO: Variations without 24 & 8 */
-					break;
-			case	metaKeySig:
-					//if (*pTrack->ptr & 0x80)
-					if (bTmp[0] & 0x80)
-						{
-						/* Do some trendy sign extending in reverse :) */
-						pMsg->MsgData.MetaEvent.Data.KeySig.iKey = ((256 - bTmp[0]) & keyMaskKey); 
-						pMsg->MsgData.MetaEvent.Data.KeySig.iKey |= keyMaskNeg;
-						}
-					else
-						{
-						pMsg->MsgData.MetaEvent.Data.KeySig.iKey = (tMIDI_KEYSIG)(bTmp[0] & keyMaskKey);
-						}
-					if (bTmp[1]) 
-						pMsg->MsgData.MetaEvent.Data.KeySig.iKey |= keyMaskMin;
-					break;
-			case	metaSequencerSpecific:
-					pMsg->MsgData.MetaEvent.Data.Sequencer.iSize = pMsg->iMsgSize;
-					read_string_from_pos_s(pMsg->MsgData.MetaEvent.Data.Sequencer.pData, pTrack->ptr2, sizeof(pMsg->MsgData.MetaEvent.Data.Sequencer.pData));
-
-					break;
-			}
+	pWT->dt = dwEndTimePos - pTrk->pos;
+	return TRUE;
+}
 
-		pTrack->ptr2 += pMsg->iMsgSize;
+BOOL	midiFileSyncTracks(_MIDI_FILE *_pMF, int iTrack1, int iTrack2)
+{
+DWORD p1, p2;
 
-		pMsg->iMsgSize = sz;
-		break;
+	_VAR_CAST;
+	if (!_midiWriteValid(pMF, iTrack1))		return FALSE;
+	if (!_midiWriteValid(pMF, iTrack2))		return FALSE;
 
-	case	msgSysEx1:
-	case	msgSysEx2:
-		bptr2 = pTrack->ptr2;
-		pTrack->ptr2 = _midiReadVarLen2(pTrack->ptr2 + 1, &pMsg->iMsgSize);
-		sz = (pTrack->ptr2 - bptr2) + pMsg->iMsgSize;
-							
-		if (_midiReadTrackCopyData2(pMsg, pTrack->ptr2, sz, FALSE) == FALSE)
-			return FALSE;
+	p1 = pMF->Track[iTrack1].pos + pMF->pWriter->Track[iTrack1].dt;
+	p2 = pMF->Track[iTrack2].pos + pMF->pWriter->Track[iTrack2].dt;
+	
+	if (p1 < p2)		midiTrackIncTime(pMF, iTrack1, p2-p1, TRUE);
+	else if (p2 < p1)	midiTrackIncTime(pMF, iTrack2, p1-p2, TRUE);
+	
+	return TRUE;
+}
 
-		/* Now copy the data... */
-		read_mem_from_pos(pMsg->data, bptr2, sz);
-		pTrack->ptr2 += pMsg->iMsgSize;
+BOOL midiFileClose(_MIDI_FILE *_pMF)
+{
+	_VAR_CAST;
+	if (!IsFilePtrValid(pMF))			return FALSE;
 
-		pMsg->iMsgSize = sz;
-		pMsg->MsgData.SysEx.pData = pMsg->data; // ok!
-		pMsg->MsgData.SysEx.iSize = sz;
-		break;
-	}
-	/*
-	** Standard MIDI messages use a common copy routine
-	*/
-	pMsg->bImpliedMsg = FALSE;
-	if ((pMsg->iType & 0xf0) != 0xf0)
+	if (pMF->bOpenForWriting)
 	{
-		bTmp[0] = read_byte_value_from_pos(pTrack->ptr2);
+		BOOL bOK = _midiFileWriteOut(pMF);
+		int i;
 
-		if (bTmp[0] & 0x80) 
-		{
-		}
-		else 
+		if (fclose((FILE *)pMF->pWriter->pFile))
+			bOK = FALSE;
+		for(i=0; i < MAX_MIDI_TRACKS; ++i)
 		{
-			pMsg->bImpliedMsg = TRUE;
-			pMsg->iImpliedMsg = pMsg->iLastMsgType;
-			pMsg->iMsgSize--;
-		}
+			if (pMF->pWriter->Track[i].pSpill)
+				fclose((FILE *)pMF->pWriter->Track[i].pSpill);		/* tmpfile() deletes it */
+			while(pMF->pWriter->Track[i].pFirst)
+			{
+				MIDI_WRITE_BLOCK *pNext = pMF->pWriter->Track[i].pFirst->pNext;
 
-		_midiReadTrackCopyData2(pMsg, pTrack->ptr2, pMsg->iMsgSize, TRUE);
-		pTrack->ptr2 += pMsg->iMsgSize;
+				free(pMF->pWriter->Track[i].pFirst);
+				pMF->pWriter->Track[i].pFirst = pNext;
+			}
+		}
+		free(pMF->pWriter);
+		pMF->pWriter = NULL;
+		pMF->bOpenForWriting = FALSE;
+		return bOK;
 	}
 
+	midiSourceClose(&pMF->Src);
+	// free((void *)pMF); // this is not on heap anymore. it's now on the stack
 	return TRUE;
 }
 
 
-// ok
-void midiReadInitMessage(MIDI_MSG *pMsg)
+/*
+** midiSong* Functions
+*/
+BOOL midiSongAddSMPTEOffset(_MIDI_FILE *_pMF, int iTrack, int iHours, int iMins, int iSecs, int iFrames, int iFFrames)
 {
-	pMsg->data = NULL;
-	pMsg->data_sz = 0;
-	pMsg->bImpliedMsg = FALSE;
+	BYTE tmp[5];
+
+	_VAR_CAST;
+	tmp[0] = (BYTE)iHours;
+	tmp[1] = (BYTE)iMins;
+	tmp[2] = (BYTE)iSecs;
+	tmp[3] = (BYTE)iFrames;
+	tmp[4] = (BYTE)iFFrames;
+	return _midiWriteMeta(pMF, iTrack, metaSMPTEOffset, tmp, sizeof(tmp));
 }
 
+BOOL midiSongAddSimpleTimeSig(_MIDI_FILE *_pMF, int iTrack, int iNom, int iDenom)
+{
+	return midiSongAddTimeSig(_pMF, iTrack, iNom, iDenom, 24, 8);
+}
 
-// ok!
-void midiReadFreeMessage(MIDI_MSG *pMsg)
+/* iDenom is a note length, e.g. MIDI_NOTE_CROCHET for 3/4 */
+BOOL midiSongAddTimeSig(_MIDI_FILE *_pMF, int iTrack, int iNom, int iDenom, int iClockInMetroTick, int iNotated32nds)
 {
-	if (pMsg->data)
-		free((void *)pMsg->data);
-	pMsg->data = NULL;
+	BYTE tmp[4];
+	int dd = 0;
+
+	_VAR_CAST;
+	if (iDenom <= 0)
+		return FALSE;
+	while((MIDI_NOTE_BREVE >> dd) > iDenom && dd < 7)
+		++dd;
+
+	tmp[0] = (BYTE)iNom;
+	tmp[1] = (BYTE)dd;					/* stored as a power of 2 */
+	tmp[2] = (BYTE)iClockInMetroTick;
+	tmp[3] = (BYTE)iNotated32nds;
+	return _midiWriteMeta(pMF, iTrack, metaTimeSig, tmp, sizeof(tmp));
+}
+
+BOOL midiSongAddKeySig(_MIDI_FILE *_pMF, int iTrack, tMIDI_KEYSIG iKey)
+{
+	BYTE tmp[2];
+
+	_VAR_CAST;
+	tmp[0] = (BYTE)(iKey & keyMaskNeg ? -(iKey & keyMaskKey) : (iKey & keyMaskKey));
+	tmp[1] = (BYTE)(iKey & keyMaskMin ? 1 : 0);
+	return _midiWriteMeta(pMF, iTrack, metaKeySig, tmp, sizeof(tmp));
+}
+
+/* iTempo is in beats per minute */
+BOOL midiSongAddTempo(_MIDI_FILE *_pMF, int iTrack, int iTempo)
+{
+	BYTE tmp[3];
+	DWORD us;
+
+	_VAR_CAST;
+	if (iTempo <= 0)
+		return FALSE;
+
+	us = 60000000L / iTempo;
+	tmp[0] = (BYTE)((us >> 16) & 0xff);
+	tmp[1] = (BYTE)((us >> 8) & 0xff);
+	tmp[2] = (BYTE)(us & 0xff);
+	return _midiWriteMeta(pMF, iTrack, metaSetTempo, tmp, sizeof(tmp));
+}
+
+BOOL midiSongAddMIDIPort(_MIDI_FILE *_pMF, int iTrack, int iPort)
+{
+	BYTE tmp[1];
+
+	_VAR_CAST;
+	tmp[0] = (BYTE)iPort;
+	return _midiWriteMeta(pMF, iTrack, metaMIDIPort, tmp, sizeof(tmp));
+}
+
+/* Any notes still sounding are stopped first. Nothing more can be added
+** to the track afterwards. */
+BOOL midiSongAddEndSequence(_MIDI_FILE *_pMF, int iTrack)
+{
+	_VAR_CAST;
+	if (!midiFileFlushTrack(pMF, iTrack, TRUE, 0))
+		return FALSE;
+	if (!_midiWriteMeta(pMF, iTrack, metaEndSequence, NULL, 0))
+		return FALSE;
+
+	pMF->pWriter->Track[iTrack].bEnded = TRUE;
+	return TRUE;
+}
+
+
+/*
+** midiTrack* Functions
+*/
+/* pData is one complete event. With bMovePtr it comes iDeltaTime after
+** the track's current time, otherwise at it. */
+BOOL midiTrackAddRaw(_MIDI_FILE *_pMF, int iTrack, int iDataSize, const BYTE *pData, BOOL bMovePtr, int iDeltaTime)
+{
+	_VAR_CAST;
+	if (!_midiWriteValid(pMF, iTrack))		return FALSE;
+	if (iDataSize <= 0)						return FALSE;
+
+	/* Notes ending on the way there must be stopped first */
+	if (bMovePtr && iDeltaTime > 0 && !midiTrackIncTime(pMF, iTrack, iDeltaTime, TRUE))
+		return FALSE;
+
+	return _midiWriteEvent(pMF, iTrack, pData, iDataSize, NULL, 0);
+}
+
+/* Copies an event read from pSrc, e.g. by a merge, to the track's current
+** time. Meta and SysEx payloads are streamed across, however big. */
+BOOL midiTrackAddEvent(_MIDI_FILE *_pMF, int iTrack, const _MIDI_FILE *pSrc, const MIDI_EVENT *pEvent)
+{
+	MIDI_WRITE_TRACK *pWT;
+	BYTE buf[256];
+	DWORD dwSize, dwOff, n;
+	int iHdr = 0;
+
+	_VAR_CAST;
+	if (!_midiWriteValid(pMF, iTrack))		return FALSE;
+
+	if (pEvent->bStatus >= msgNoteOff && pEvent->bStatus < msgSysEx1)
+	{
+		buf[0] = pEvent->bStatus;
+		buf[1] = pEvent->bData1;
+		buf[2] = pEvent->bData2;
+		n = (pEvent->bStatus & 0xf0) == msgSetProgram || (pEvent->bStatus & 0xf0) == msgChangePressure ? 2 : 3;
+		return _midiWriteEvent(pMF, iTrack, buf, n, NULL, 0);
+	}
+
+	/* System messages have no place in a file */
+	if (pEvent->bStatus != msgMetaEvent && pEvent->bStatus != msgSysEx1 && pEvent->bStatus != msgSysEx2)
+		return FALSE;
+
+	dwSize = midiReadGetEventPayloadSize(pSrc, pEvent);
+	buf[iHdr++] = pEvent->bStatus;
+	if (pEvent->bStatus == msgMetaEvent)
+		buf[iHdr++] = pEvent->bData1;
+	iHdr += _midiWriteVarLen(buf + iHdr, dwSize);
+	if (!_midiWriteEvent(pMF, iTrack, buf, iHdr, NULL, 0))
+		return FALSE;
+
+	pWT = &pMF->pWriter->Track[iTrack];
+	for(dwOff=0; dwOff < dwSize; dwOff += n)
+	{
+		if ((n = midiReadGetEventPayloadPart(pSrc, pEvent, dwOff, buf, sizeof(buf))) == 0)
+			return FALSE;
+		if (!_midiWriteBytes(pMF->pWriter, pWT, buf, n))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+BOOL midiTrackIncTime(_MIDI_FILE *_pMF, int iTrack, int iDeltaTime, BOOL bOverridePPQN)
+{
+	DWORD will_end_at;
+
+	_VAR_CAST;
+	if (!_midiWriteValid(pMF, iTrack))		return FALSE;
+
+	will_end_at = _midiGetLength(pMF->Header.PPQN, iDeltaTime, bOverridePPQN);
+	will_end_at += pMF->Track[iTrack].pos + pMF->pWriter->Track[iTrack].dt;
+
+	return midiFileFlushTrack(pMF, iTrack, FALSE, will_end_at);
+}
+
+BOOL midiTrackAddText(_MIDI_FILE *_pMF, int iTrack, tMIDI_TEXT iType, const char *pTxt)
+{
+	_VAR_CAST;
+	if (!pTxt)
+		return FALSE;
+	return _midiWriteMeta(pMF, iTrack, (BYTE)iType, (const BYTE *)pTxt, (DWORD)strlen(pTxt));
+}
+
+/* Sent on the track's default channel */
+BOOL midiTrackAddMsg(_MIDI_FILE *_pMF, int iTrack, tMIDI_MSG iMsg, int iParam1, int iParam2)
+{
+	BYTE data[3];
+	int sz;
+
+	_VAR_CAST;
+	if (!_midiWriteValid(pMF, iTrack))		return FALSE;
+	if (iMsg < msgNoteOff || iMsg > msgSetPitchWheel)	return FALSE;
+
+	data[0] = (BYTE)(iMsg | pMF->Track[iTrack].iDefaultChannel);
+	data[1] = (BYTE)(iParam1 & 0x7f);
+	data[2] = (BYTE)(iParam2 & 0x7f);
+
+	switch(iMsg)
+	{
+	case	msgSetProgram:			/* only one byte required for these msgs */
+	case	msgChangePressure:
+		sz = 2;
+		break;
+
+	case	msgSetPitchWheel:
+		data[1] = (BYTE)(iParam1 & 0x7f);
+		data[2] = (BYTE)((iParam1 >> 7) & 0x7f);
+		sz = 3;
+		break;
+
+	default:
+		sz = 3;
+		break;
+	}
+
+	return _midiWriteEvent(pMF, iTrack, data, sz, NULL, 0);
+}
+
+BOOL midiTrackSetKeyPressure(_MIDI_FILE *pMF, int iTrack, int iNote, int iAftertouch)
+{
+	return midiTrackAddMsg(pMF, iTrack, msgNoteKeyPressure, iNote, iAftertouch);
+}
+
+BOOL midiTrackAddControlChange(_MIDI_FILE *pMF, int iTrack, tMIDI_CC iCCType, int iParam)
+{
+	return midiTrackAddMsg(pMF, iTrack, msgControlChange, iCCType, iParam);
+}
+
+BOOL midiTrackAddProgramChange(_MIDI_FILE *pMF, int iTrack, int iInstrPatch)
+{
+	return midiTrackAddMsg(pMF, iTrack, msgSetProgram, iInstrPatch, 0);
+}
+
+BOOL midiTrackChangeKeyPressure(_MIDI_FILE *pMF, int iTrack, int iDeltaPressure)
+{
+	return midiTrackAddMsg(pMF, iTrack, msgChangePressure, iDeltaPressure, 0);
+}
+
+/* iWheelPos is relative to the centre, as MIDI_MSG's PitchWheel.iPitch */
+BOOL midiTrackSetPitchWheel(_MIDI_FILE *pMF, int iTrack, int iWheelPos)
+{
+	return midiTrackAddMsg(pMF, iTrack, msgSetPitchWheel, iWheelPos + MIDI_WHEEL_CENTRE, 0);
+}
+
+/* The note off is written when the track's time passes the end of the
+** note, so other events can be added while it sounds */
+BOOL midiTrackAddNote(_MIDI_FILE *_pMF, int iTrack, int iNote, int iLength, int iVol, BOOL bAutoInc, BOOL bOverrideLength)
+{
+	MIDI_WRITE_TRACK *pWT;
+	MIDI_LAST_NOTE *pNote = NULL;
+	BYTE data[3];
+	int i;
+
+	_VAR_CAST;
+	if (!_midiWriteValid(pMF, iTrack))		return FALSE;
+	if (!IsNoteValid(iNote))				return FALSE;
+
+	pWT = &pMF->pWriter->Track[iTrack];
+	for(i=0; i < MAX_TRACK_POLYPHONY && !pNote; ++i)
+		if (!pWT->LastNote[i].valid)
+			pNote = &pWT->LastNote[i];
+	if (!pNote)
+		return FALSE;
+
+	iLength = _midiGetLength(pMF->Header.PPQN, iLength, bOverrideLength);
+
+	data[0] = (BYTE)(msgNoteOn | pMF->Track[iTrack].iDefaultChannel);
+	data[1] = (BYTE)iNote;
+	data[2] = (BYTE)(iVol & 0x7f);
+	if (!_midiWriteEvent(pMF, iTrack, data, 3, NULL, 0))
+		return FALSE;
+
+	pNote->note = (BYTE)iNote;
+	pNote->chn = pMF->Track[iTrack].iDefaultChannel;
+	pNote->end_pos = pMF->Track[iTrack].pos + iLength;
+	pNote->valid = TRUE;
+
+	if (bAutoInc)
+		return midiTrackIncTime(pMF, iTrack, iLength, TRUE);
+	return TRUE;
+}
+
+BOOL midiTrackAddRest(_MIDI_FILE *_pMF, int iTrack, int iLength, BOOL bOverridePPQN)
+{
+	_VAR_CAST;
+	if (!_midiWriteValid(pMF, iTrack))		return FALSE;
+
+	iLength = _midiGetLength(pMF->Header.PPQN, iLength, bOverridePPQN);
+	return midiTrackIncTime(pMF, iTrack, iLength, TRUE);
+}
+
+/* The track's current time, i.e. where the next event will go */
+BOOL midiTrackGetEndPos(_MIDI_FILE *_pMF, int iTrack)
+{
+	_VAR_CAST;
+	if (!IsFilePtrValid(pMF) || !pMF->bOpenForWriting)	return FALSE;
+	if (!IsTrackValid(iTrack))							return FALSE;
+
+	return (BOOL)(pMF->Track[iTrack].pos + pMF->pWriter->Track[iTrack].dt);
+}
+
+
+
+/* Decodes a variable length value that is already in memory, with at least
+** MIDI_VARLEN_SCAN bytes readable at p. Returns the number of bytes used,
+** or 0 if it's longer than the 4 bytes the spec allows. */
+#define MIDI_VARLEN_SCAN	4
+
+static int _midiDecodeVarLen(const BYTE *p, DWORD *num)
+{
+	int iLen = !(p[0] & 0x80) ? 1 : !(p[1] & 0x80) ? 2 : !(p[2] & 0x80) ? 3 : !(p[3] & 0x80) ? 4 : 5;
+
+	switch(iLen)
+	{
+	case	1:	*num = p[0];
+				break;
+	case	2:	*num = ((DWORD)(p[0] & 0x7f) << 7) | p[1];
+				break;
+	case	3:	*num = ((DWORD)(p[0] & 0x7f) << 14) | ((DWORD)(p[1] & 0x7f) << 7) | p[2];
+				break;
+	case	4:	*num = ((DWORD)(p[0] & 0x7f) << 21) | ((DWORD)(p[1] & 0x7f) << 14) | ((DWORD)(p[2] & 0x7f) << 7) | p[3];
+				break;
+	default:	return 0;
+	}
+	return iLen;
+}
+
+static DWORD _midiReadVarLen2(MIDI_SOURCE *pSrc, DWORD ptr2, DWORD *num)
+{
+	register DWORD value;
+	register BYTE c;
+	DWORD ofs = ptr2 - pSrc->dwWinPos;
+
+	/* Decode straight out of the window when the whole value is there */
+	if (ofs < pSrc->dwWinLen && pSrc->dwWinLen - ofs >= MIDI_VARLEN_SCAN)
+	{
+		int iLen = _midiDecodeVarLen(pSrc->pWin + ofs, num);
+
+		if (iLen)
+			return ptr2 + iLen;
+	}
+
+	value = read_byte_value_from_pos(pSrc, ptr2++);
+	if(value & 0x80)
+	{
+		value &= 0x7f;
+		do
+		{
+			c = read_byte_value_from_pos(pSrc, ptr2++);
+
+			value = (value << 7) + (c & 0x7f);
+		} 
+		while (c & 0x80);
+	}
+	*num = value;
+
+	return ptr2;
+}
+
+/* Takes sz bytes from the arena, or as many as are left if it truncates.
+** *pdwSize is updated to what was actually given. */
+static BYTE *_midiArenaAlloc(MIDI_ARENA *pArena, DWORD *pdwSize)
+{
+	BYTE *p;
+
+	if (pArena->dwFlags & MIDI_ARENA_SCRATCH)
+		pArena->dwUsed = 0;
+
+	if (*pdwSize > pArena->dwSize - pArena->dwUsed)
+	{
+		if (!(pArena->dwFlags & MIDI_ARENA_TRUNCATE))
+			return NULL;
+		*pdwSize = pArena->dwSize - pArena->dwUsed;
+	}
+
+	p = pArena->pBase + pArena->dwUsed;
+	pArena->dwUsed += *pdwSize;
+	return p;
+}
+
+/* TRUE if sz bytes from ptr2 are all inside the source */
+#define _midiReadInSource(_pSrc, _ptr2, _sz)	((_sz) <= (_pSrc)->dwSize && (_ptr2) <= (_pSrc)->dwSize - (_sz))
+
+/* Points pMsg->data at sz bytes of the file from ptr2, with the number of
+** bytes kept there in *pdwKept. That is less than sz if an arena truncated
+** them, even 0. FALSE if the bytes run past the end of the file or there's
+** no memory for them, which is an error rather than a truncation. */
+static BOOL _midiReadTrackCopyData2(MIDI_SOURCE *pSrc, MIDI_ARENA *pArena, MIDI_MSG *pMsg, DWORD ptr2, DWORD sz, DWORD *pdwKept)
+{
+	if (!_midiReadInSource(pSrc, ptr2, sz))
+		return FALSE;
+
+	/* Mapped files don't need a copy at all */
+	if (pSrc->pMem)
+	{
+		pMsg->data = (BYTE *)pSrc->pMem + ptr2;
+		*pdwKept = sz;
+		return TRUE;
+	}
+
+	if (pArena)
+	{
+		pMsg->data = _midiArenaAlloc(pArena, &sz);
+		if (!pMsg->data)
+			sz = 0;
+	}
+	else
+	{
+		if (sz > pMsg->data_sz)
+		{
+			pMsg->pAlloc = (BYTE *)realloc(pMsg->pAlloc, sz); // also acts as malloc. can be tolerated since it only allocs a few bytes
+			pMsg->data_sz = pMsg->pAlloc ? sz : 0;
+		}
+		pMsg->data = pMsg->pAlloc;
+		if (!pMsg->data)
+			return FALSE;
+	}
+
+	if (sz)
+		read_mem_from_pos(pSrc, pMsg->data, ptr2, sz);
+	*pdwKept = sz;
+	return TRUE;
+}
+
+/* Channel and system messages are only ever a few bytes, so they have a
+** place of their own in pMsg rather than using up an arena. FALSE if they
+** run past the end of the file. */
+static BOOL _midiReadTrackCopyShort(MIDI_SOURCE *pSrc, MIDI_MSG *pMsg, DWORD ptr2, DWORD sz)
+{
+	if (!_midiReadInSource(pSrc, ptr2, sz))
+		return FALSE;
+
+	if (pSrc->pMem)
+	{
+		pMsg->data = (BYTE *)pSrc->pMem + ptr2;
+	}
+	else
+	{
+		pMsg->data = pMsg->data_short;
+		read_mem_from_pos(pSrc, pMsg->data, ptr2, sz);
+	}
+	pMsg->iMsgSize = sz;
+	return TRUE;
+}
+
+void midiArenaInit(MIDI_ARENA *pArena, BYTE *pBuf, DWORD dwSize, DWORD dwFlags)
+{
+	pArena->pBase = pBuf;
+	pArena->dwSize = dwSize;
+	pArena->dwUsed = 0;
+	pArena->dwFlags = dwFlags;
+}
+
+/* Everything handed out since the last reset becomes invalid */
+void midiArenaReset(MIDI_ARENA *pArena)
+{
+	pArena->dwUsed = 0;
+}
+
+/*
+** Status byte table. Everything the decoders need to know about a status
+** byte is one lookup away, so they never have to pick it apart by hand.
+*/
+#define STATUS_DATA			0		/* not a status, running status applies */
+#define STATUS_CHANNEL		1
+#define STATUS_SYSEX		2
+#define STATUS_META			3
+#define STATUS_SYSTEM		4		/* system common/realtime, not expected in a file */
+
+typedef struct {
+	BYTE	bKind;
+	BYTE	bDataLen;				/* data bytes after the status (meta/SysEx: before the length) */
+	BYTE	bChannel;				/* 1-16, channel messages only */
+} MIDI_STATUS_INFO;
+
+#define _D		{ STATUS_DATA, 0, 0 }
+#define _D16	_D,_D,_D,_D,_D,_D,_D,_D,_D,_D,_D,_D,_D,_D,_D,_D
+#define _C16(n)	{ STATUS_CHANNEL, n, 1 }, { STATUS_CHANNEL, n, 2 }, { STATUS_CHANNEL, n, 3 }, { STATUS_CHANNEL, n, 4 }, \
+				{ STATUS_CHANNEL, n, 5 }, { STATUS_CHANNEL, n, 6 }, { STATUS_CHANNEL, n, 7 }, { STATUS_CHANNEL, n, 8 }, \
+				{ STATUS_CHANNEL, n, 9 }, { STATUS_CHANNEL, n, 10 }, { STATUS_CHANNEL, n, 11 }, { STATUS_CHANNEL, n, 12 }, \
+				{ STATUS_CHANNEL, n, 13 }, { STATUS_CHANNEL, n, 14 }, { STATUS_CHANNEL, n, 15 }, { STATUS_CHANNEL, n, 16 }
+#define _S(n)	{ STATUS_SYSTEM, n, 0 }
+
+static const MIDI_STATUS_INFO _midiStatusTable[256] = {
+	_D16, _D16, _D16, _D16, _D16, _D16, _D16, _D16,		/* 0x00 - 0x7f */
+	_C16(2),											/* 0x80 note off */
+	_C16(2),											/* 0x90 note on */
+	_C16(2),											/* 0xa0 key pressure */
+	_C16(2),											/* 0xb0 control change */
+	_C16(1),											/* 0xc0 program change */
+	_C16(1),											/* 0xd0 channel pressure */
+	_C16(2),											/* 0xe0 pitch wheel */
+	{ STATUS_SYSEX, 0, 0 }, _S(1), _S(2), _S(1),		/* 0xf0 - 0xf3 */
+	_S(0), _S(0), _S(0), { STATUS_SYSEX, 0, 0 },		/* 0xf4 - 0xf7 */
+	_S(0), _S(0), _S(0), _S(0),							/* 0xf8 - 0xfb */
+	_S(0), _S(0), _S(0), { STATUS_META, 1, 0 }			/* 0xfc - 0xff */
+};
+
+#undef _D
+#undef _D16
+#undef _C16
+#undef _S
+
+/* Copies as much of a meta event's payload as fits, returns the number of bytes copied */
+static int _midiCopyPayload(BYTE *pDst, int iMax, const MIDI_MSG *pMsg)
+{
+	int n = pMsg->MsgData.MetaEvent.iSize < iMax ? pMsg->MsgData.MetaEvent.iSize : iMax;
+
+	memcpy(pDst, pMsg->MsgData.MetaEvent.pData, n);
+	return n;
+}
+
+/* Fills in the channel message fields from its two (possible) data bytes.
+** iType and iLastMsgChnl must already be set. */
+static void _midiDecodeChannelMsg(MIDI_MSG *pMsg, BYTE bData0, BYTE bData1)
+{
+	switch(pMsg->iType)
+	{
+	case	msgNoteOn:
+		pMsg->MsgData.NoteOn.iChannel = pMsg->iLastMsgChnl;
+		pMsg->MsgData.NoteOn.iNote = bData0;
+		pMsg->MsgData.NoteOn.iVolume = bData1;
+
+		pMsg->iMsgSize = 3;
+		break;
+
+	case	msgNoteOff:
+		pMsg->MsgData.NoteOff.iChannel = pMsg->iLastMsgChnl;
+		pMsg->MsgData.NoteOff.iNote = bData0;
+
+		pMsg->iMsgSize = 3;
+		break;
+
+	case	msgNoteKeyPressure:
+		pMsg->MsgData.NoteKeyPressure.iChannel = pMsg->iLastMsgChnl;
+		pMsg->MsgData.NoteKeyPressure.iNote = bData0;
+		pMsg->MsgData.NoteKeyPressure.iPressure = bData1;
+
+		pMsg->iMsgSize = 3;
+		break;
+
+	case	msgSetParameter:
+		pMsg->MsgData.NoteParameter.iChannel = pMsg->iLastMsgChnl;
+		pMsg->MsgData.NoteParameter.iControl = (tMIDI_CC)bData0; 
+		pMsg->MsgData.NoteParameter.iParam = bData1;
+		pMsg->iMsgSize = 3;
+		break;
+
+	case	msgSetProgram:
+		pMsg->MsgData.ChangeProgram.iChannel = pMsg->iLastMsgChnl;
+		pMsg->MsgData.ChangeProgram.iProgram = bData0;
+		pMsg->iMsgSize = 2;
+		break;
+
+	case	msgChangePressure:
+		pMsg->MsgData.ChangePressure.iChannel = pMsg->iLastMsgChnl;
+		pMsg->MsgData.ChangePressure.iPressure = bData0;
+		pMsg->iMsgSize = 2;
+		break;
+
+	case	msgSetPitchWheel:
+		pMsg->MsgData.PitchWheel.iChannel = pMsg->iLastMsgChnl;
+		pMsg->MsgData.PitchWheel.iPitch = bData0 | (bData1 << 7);
+		pMsg->MsgData.PitchWheel.iPitch -= MIDI_WHEEL_CENTRE;
+		pMsg->iMsgSize = 3;
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* Places a meta event in a neat structure. 'data' holds the raw event,
+** the payload starts dwHdrSize bytes in and iMsgSize is its length. */
+static void _midiDecodeMetaEvent(MIDI_MSG *pMsg, DWORD dwHdrSize)
+{
+	BYTE bTmp[5];
+	int iLen;
+
+	pMsg->MsgData.MetaEvent.pData = pMsg->data + dwHdrSize;
+	pMsg->MsgData.MetaEvent.iSize = pMsg->iMsgSize;
+
+	memset(bTmp, 0, sizeof(bTmp));
+	memcpy(bTmp, pMsg->MsgData.MetaEvent.pData, pMsg->iMsgSize < sizeof(bTmp) ? pMsg->iMsgSize : sizeof(bTmp));
+
+	switch(pMsg->MsgData.MetaEvent.iType)
+		{
+		case	metaMIDIPort:
+				pMsg->MsgData.MetaEvent.Data.iMIDIPort = bTmp[0];
+
+				break;
+		case	metaSequenceNumber:
+				pMsg->MsgData.MetaEvent.Data.iSequenceNumber = bTmp[0];
+				break;
+		case	metaTextEvent:
+		case	metaCopyright:
+		case	metaTrackName:
+		case	metaInstrument:
+		case	metaLyric:
+		case	metaMarker:
+		case	metaCuePoint:
+				/* MetaEvent.pData has the full text, this is a terminated copy */
+				iLen = _midiCopyPayload(pMsg->MsgData.MetaEvent.Data.Text.pData, sizeof(pMsg->MsgData.MetaEvent.Data.Text.pData) - 1, pMsg);
+				pMsg->MsgData.MetaEvent.Data.Text.pData[iLen] = '\0';
+				break;
+		case	metaEndSequence:
+				/* NO DATA */
+				break;
+		case	metaSetTempo:
+				{
+				
+				DWORD us = bTmp[0] << 16 | (bTmp[1] << 8 ) | bTmp[2];
+				pMsg->MsgData.MetaEvent.Data.Tempo.dwMicros = us;
+				pMsg->MsgData.MetaEvent.Data.Tempo.iBPM = us ? 60000000L/us : 0;
+				}
+				break;
+		case	metaSMPTEOffset:
+				pMsg->MsgData.MetaEvent.Data.SMPTE.iHours = bTmp[0];
+				pMsg->MsgData.MetaEvent.Data.SMPTE.iMins= bTmp[1];
+				pMsg->MsgData.MetaEvent.Data.SMPTE.iSecs = bTmp[2];
+				pMsg->MsgData.MetaEvent.Data.SMPTE.iFrames = bTmp[3];
+				pMsg->MsgData.MetaEvent.Data.SMPTE.iFF = bTmp[4];
+				break;
+		case	metaTimeSig:
+				pMsg->MsgData.MetaEvent.Data.TimeSig.iNom = bTmp[0];
+				pMsg->MsgData.MetaEvent.Data.TimeSig.iDenom = bTmp[1] * MIDI_NOTE_MINIM;
+				/* TODO: Variations without 24 & 8 */
+				break;
+		case	metaKeySig:
+				if (bTmp[0] & 0x80)
+					{
+					/* Do some trendy sign extending in reverse :) */
+					pMsg->MsgData.MetaEvent.Data.KeySig.iKey = ((256 - bTmp[0]) & keyMaskKey); 
+					pMsg->MsgData.MetaEvent.Data.KeySig.iKey |= keyMaskNeg;
+					}
+				else
+					{
+					pMsg->MsgData.MetaEvent.Data.KeySig.iKey = (tMIDI_KEYSIG)(bTmp[0] & keyMaskKey);
+					}
+				if (bTmp[1]) 
+					pMsg->MsgData.MetaEvent.Data.KeySig.iKey |= keyMaskMin;
+				break;
+		case	metaSequencerSpecific:
+				pMsg->MsgData.MetaEvent.Data.Sequencer.iSize = _midiCopyPayload(pMsg->MsgData.MetaEvent.Data.Sequencer.pData, sizeof(pMsg->MsgData.MetaEvent.Data.Sequencer.pData), pMsg);
+				break;
+		}
+}
+
+int midiReadGetNumTracks(const _MIDI_FILE *_pMF)
+{
+	_VAR_CAST;
+	return pMF->Header.iNumTracks;
+}
+
+/* Puts iTrack back at its start */
+void midiReadRewindTrack(const _MIDI_FILE *_pMF, int iTrack)
+{
+	_VAR_CAST;
+	if (!IsTrackValid(iTrack))			return;
+
+	pMF->Track[iTrack].ptr2 = pMF->Track[iTrack].pBase2 + 8;		/* skip the MTrk header */
+	pMF->Track[iTrack].pos = 0;
+	pMF->Track[iTrack].last_status = 0;
+	pMF->Track[iTrack].bFailed = FALSE;
+}
+
+/* Puts the read positions and filter aside in pSaved for midiReadRestore(),
+** then reads through pFilter (NULL for everything) from now on. Returns the
+** number of tracks that can be read. */
+int midiReadSave(const _MIDI_FILE *_pMF, MIDI_READ_STATE *pSaved, const MIDI_FILTER *pFilter)
+{
+	int i;
+
+	_VAR_CAST;
+
+	pSaved->iNumTracks = pMF->Header.iNumTracks < MAX_MIDI_TRACKS ? pMF->Header.iNumTracks : MAX_MIDI_TRACKS;
+	pSaved->pFilter = pMF->pFilter;
+	for(i=0; i < pSaved->iNumTracks; ++i)
+		pSaved->Track[i] = pMF->Track[i];
+
+	pMF->pFilter = pFilter;
+	return pSaved->iNumTracks;
+}
+
+/* As midiReadSave(), then puts every track back at its start for a pass
+** over the whole song */
+int midiReadRewind(const _MIDI_FILE *pMF, MIDI_READ_STATE *pSaved, const MIDI_FILTER *pFilter)
+{
+	int i;
+
+	midiReadSave(pMF, pSaved, pFilter);
+	for(i=0; i < pSaved->iNumTracks; ++i)
+		midiReadRewindTrack(pMF, i);
+	return pSaved->iNumTracks;
+}
+
+void midiReadRestore(const _MIDI_FILE *_pMF, const MIDI_READ_STATE *pSaved)
+{
+	int i;
+
+	_VAR_CAST;
+
+	for(i=0; i < pSaved->iNumTracks; ++i)
+		pMF->Track[i] = pSaved->Track[i];
+	pMF->pFilter = pSaved->pFilter;
+}
+
+
+/*
+** Filters
+*/
+void midiFilterInit(MIDI_FILTER *pFilter, BOOL bPassAll)
+{
+	memset(pFilter, bPassAll ? 0xff : 0, sizeof(*pFilter));
+}
+
+void midiFilterSetChannel(MIDI_FILTER *pFilter, int iChannel, BOOL bPass)
+{
+	if (!IsChannelValid(iChannel))
+		return;
+	if (bPass)
+		pFilter->wChannels |= 1 << (iChannel - 1);
+	else
+		pFilter->wChannels &= ~(1 << (iChannel - 1));
+}
+
+void midiFilterSetMsg(MIDI_FILTER *pFilter, tMIDI_MSG iMsg, BOOL bPass)
+{
+	WORD wBit;
+
+	if (iMsg == msgMetaEvent)
+		wBit = MIDI_FILTER_META;
+	else if (iMsg == msgSysEx1 || iMsg == msgSysEx2)
+		wBit = MIDI_FILTER_SYSEX;
+	else
+		wBit = (WORD)MIDI_FILTER_MSG(iMsg);
+
+	if (bPass)
+		pFilter->wMsgs |= wBit;
+	else
+		pFilter->wMsgs &= ~wBit;
+}
+
+void midiFilterSetMeta(MIDI_FILTER *pFilter, tMIDI_META iType, BOOL bPass)
+{
+	if (bPass)
+		pFilter->bMeta[(iType >> 3) & 15] |= 1 << (iType & 7);
+	else
+		pFilter->bMeta[(iType >> 3) & 15] &= ~(1 << (iType & 7));
+}
+
+/* Steps over any events at the track's read position that pFilter rejects,
+** keeping running status and the absolute time up to date. Returns the
+** delta time that was skipped. */
+static DWORD _midiReadTrackFilter(MIDI_SOURCE *pSrc, const MIDI_FILTER *pFilter, MIDI_FILE_TRACK *pTrack)
+{
+	const MIDI_STATUS_INFO *pInfo;
+	DWORD ptr2, dt, sz, dwSkipped = 0;
+	BYTE bStatus, bType;
+	BOOL bPass;
+
+	while(pTrack->ptr2 < pTrack->pEnd2)
+	{
+		ptr2 = _midiReadVarLen2(pSrc, pTrack->ptr2, &dt);
+		bStatus = read_byte_value_from_pos(pSrc, ptr2);
+		pInfo = &_midiStatusTable[bStatus];
+		if (pInfo->bKind == STATUS_DATA)
+		{
+			bStatus = pTrack->last_status;
+			pInfo = &_midiStatusTable[bStatus];
+			if (pInfo->bKind != STATUS_CHANNEL)
+				break;			/* let the decoder deal with it */
+		}
+		else
+		{
+			++ptr2;
+		}
+
+		switch(pInfo->bKind)
+		{
+		case	STATUS_CHANNEL:
+			bPass = (pFilter->wMsgs & MIDI_FILTER_MSG(bStatus)) && (pFilter->wChannels & (1 << (bStatus & 0x0f)));
+			if (!bPass)
+			{
+				pTrack->last_status = bStatus;
+				ptr2 += pInfo->bDataLen;
+			}
+			break;
+
+		case	STATUS_META:
+			bType = read_byte_value_from_pos(pSrc, ptr2);
+			bPass = (pFilter->wMsgs & MIDI_FILTER_META) && (pFilter->bMeta[(bType >> 3) & 15] & (1 << (bType & 7)));
+			if (!bPass)
+			{
+				ptr2 = _midiReadVarLen2(pSrc, ptr2 + 1, &sz);
+				ptr2 += sz;
+			}
+			break;
+
+		case	STATUS_SYSEX:
+			bPass = (pFilter->wMsgs & MIDI_FILTER_SYSEX) != 0;
+			if (!bPass)
+			{
+				ptr2 = _midiReadVarLen2(pSrc, ptr2, &sz);
+				ptr2 += sz;
+			}
+			break;
+
+		default:
+			bPass = (pFilter->wMsgs & MIDI_FILTER_SYSEX) != 0;
+			if (!bPass)
+				ptr2 += pInfo->bDataLen;
+			break;
+		}
+
+		if (bPass)
+			break;
+
+		pTrack->ptr2 = ptr2;
+		pTrack->pos += dt;
+		dwSkipped += dt;
+	}
+
+	return dwSkipped;
+}
+
+/* Ends a track at an event that runs past the end of the file, so the
+** rest isn't mistaken for a short read. midiReadFailed() reports it. */
+static BOOL _midiReadTrackFail(MIDI_FILE_TRACK *pTrack)
+{
+	pTrack->bFailed = TRUE;
+	pTrack->ptr2 = pTrack->pEnd2;
+	return FALSE;
+}
+
+/* Decodes the next event of one track. Running status lives in the track,
+** not the message, so any MIDI_MSG (or array of them) can be passed in. */
+static BOOL _midiReadTrackMessage(MIDI_SOURCE *pSrc, MIDI_ARENA *pArena, const MIDI_FILTER *pFilter, MIDI_FILE_TRACK *pTrack, MIDI_MSG *pMsg)
+{
+	const MIDI_STATUS_INFO *pInfo;
+	DWORD ptr2, bptr2, sz, dwKept, dwSkipped = 0;
+	BYTE bStatus, bData1;
+
+	if (pFilter)
+		dwSkipped = _midiReadTrackFilter(pSrc, pFilter, pTrack);
+
+	if (pTrack->ptr2 >= pTrack->pEnd2)
+		return FALSE;
+	
+	ptr2 = _midiReadVarLen2(pSrc, pTrack->ptr2, &pMsg->dt);
+	pTrack->pos += pMsg->dt;
+	pMsg->dwAbsPos = pTrack->pos;
+	pMsg->dt += dwSkipped;
+
+	/* bptr2 is where the message starts as stored, i.e. without its status
+	** byte if running status is in use */
+	bptr2 = ptr2;
+	bStatus = read_byte_value_from_pos(pSrc, ptr2);
+	pInfo = &_midiStatusTable[bStatus];
+	pMsg->bImpliedMsg = FALSE;
+	pMsg->bTruncated = FALSE;
+
+	if (pInfo->bKind == STATUS_DATA)
+	{
+		bStatus = pTrack->last_status;
+		pInfo = &_midiStatusTable[bStatus];
+		if (pInfo->bKind != STATUS_CHANNEL)
+			return FALSE;		/* data with no status to run on */
+
+		pMsg->bImpliedMsg = TRUE;
+		pMsg->iImpliedMsg = (tMIDI_MSG)(bStatus & 0xf0);
+	}
+	else
+	{
+		++ptr2;
+	}
+
+	/* Channel messages first, they're nearly everything in a file */
+	if (pInfo->bKind == STATUS_CHANNEL)
+	{
+		pTrack->last_status = bStatus;
+		pMsg->iType = (tMIDI_MSG)(bStatus & 0xf0);
+		pMsg->iLastMsgType = pMsg->iType;
+		pMsg->iLastMsgChnl = pInfo->bChannel;
+
+		bData1 = read_byte_value_from_pos(pSrc, ptr2);
+		_midiDecodeChannelMsg(pMsg, bData1, pInfo->bDataLen == 2 ? read_byte_value_from_pos(pSrc, ptr2 + 1) : 0);
+		ptr2 += pInfo->bDataLen;
+
+		if (!_midiReadTrackCopyShort(pSrc, pMsg, bptr2, ptr2 - bptr2))
+			return _midiReadTrackFail(pTrack);
+		pTrack->ptr2 = ptr2;
+		return TRUE;
+	}
+
+	/* SysEx & Meta events don't carry channel info, but something
+	** important in their lower bits that we must keep */
+	pMsg->iType = (tMIDI_MSG)bStatus;
+	pMsg->iLastMsgType = pMsg->iType;
+	pMsg->iLastMsgChnl = (BYTE)(pTrack->last_status & 0x0f) + 1;
+
+	if (pInfo->bKind == STATUS_SYSTEM)
+	{
+		ptr2 += pInfo->bDataLen;
+		if (!_midiReadTrackCopyShort(pSrc, pMsg, bptr2, ptr2 - bptr2))
+			return _midiReadTrackFail(pTrack);
+		pTrack->ptr2 = ptr2;
+		return TRUE;
+	}
+
+	if (pInfo->bKind == STATUS_META)
+		pMsg->MsgData.MetaEvent.iType = (tMIDI_META)read_byte_value_from_pos(pSrc, ptr2);
+	ptr2 = _midiReadVarLen2(pSrc, ptr2 + pInfo->bDataLen, &pMsg->iMsgSize);
+	if (pMsg->iMsgSize > pSrc->dwSize)
+		return _midiReadTrackFail(pTrack);
+	sz = (ptr2 - bptr2) + pMsg->iMsgSize;
+
+	/* Now copy the data... An arena may keep less than all of it */
+	if (!_midiReadTrackCopyData2(pSrc, pArena, pMsg, bptr2, sz, &dwKept))
+		return _midiReadTrackFail(pTrack);
+	pTrack->ptr2 = ptr2 + pMsg->iMsgSize;
+	pMsg->bTruncated = dwKept < sz;
+
+	if (dwKept < ptr2 - bptr2)
+	{
+		/* Not even room for the header. The event is skipped rather than
+		** ending the track early; bTruncated and no data say so. */
+		pMsg->data = NULL;
+		pMsg->iMsgSize = 0;
+		if (pInfo->bKind == STATUS_META)
+		{
+			pMsg->MsgData.MetaEvent.pData = NULL;
+			pMsg->MsgData.MetaEvent.iSize = 0;
+		}
+		else
+		{
+			pMsg->MsgData.SysEx.pData = NULL;
+			pMsg->MsgData.SysEx.iSize = 0;
+		}
+		return TRUE;
+	}
+
+	if (pInfo->bKind == STATUS_META)
+	{
+		pMsg->iMsgSize = dwKept - (ptr2 - bptr2);
+		_midiDecodeMetaEvent(pMsg, ptr2 - bptr2);
+	}
+	else
+	{
+		pMsg->MsgData.SysEx.pData = pMsg->data; // ok!
+		pMsg->MsgData.SysEx.iSize = dwKept;
+	}
+
+	pMsg->iMsgSize = dwKept;
+	return TRUE;
+}
+
+BOOL midiReadGetNextMessage(const _MIDI_FILE *_pMF, int iTrack, MIDI_MSG *pMsg)
+{
+	_VAR_CAST;
+
+	// just remove and assume the track is valid?
+	if (!IsTrackValid(iTrack))
+		return FALSE;
+	
+	return _midiReadTrackMessage(&pMF->Src, pMF->pArena, pMF->pFilter, &pMF->Track[iTrack], pMsg);
+}
+
+/* TRUE if reading iTrack stopped early because an event ran past the end
+** of the file, rather than at the track's end. Rewinding clears it. */
+BOOL midiReadFailed(const _MIDI_FILE *_pMF, int iTrack)
+{
+	_VAR_CAST;
+
+	if (!IsTrackValid(iTrack))
+		return FALSE;
+	return pMF->Track[iTrack].bFailed;
+}
+
+/* Decodes up to n events of a track into pMsgs[], which must all have been
+** through midiReadInitMessage(). Returns how many were filled; fewer than
+** n means the end of the track was reached. The track is checked once for
+** the whole batch rather than once per message. */
+int midiReadGetMessages(const _MIDI_FILE *_pMF, int iTrack, MIDI_MSG *pMsgs, int n)
+{
+	MIDI_FILE_TRACK *pTrack;
+	int i;
+
+	_VAR_CAST;
+
+	if (!IsTrackValid(iTrack))
+		return 0;
+
+	pTrack = &pMF->Track[iTrack];
+	for(i=0; i < n; ++i)
+		if (!_midiReadTrackMessage(&pMF->Src, pMF->pArena, pMF->pFilter, pTrack, &pMsgs[i]))
+			break;
+
+	return i;
+}
+
+
+/* Same walk as _midiReadTrackMessage(), but only notes where things are */
+static BOOL _midiReadTrackEvent(MIDI_SOURCE *pSrc, const MIDI_FILTER *pFilter, MIDI_FILE_TRACK *pTrack, MIDI_EVENT *pEvent)
+{
+	const MIDI_STATUS_INFO *pInfo;
+	DWORD ptr2, dt, sz;
+	BYTE bStatus;
+
+	if (pFilter)
+		_midiReadTrackFilter(pSrc, pFilter, pTrack);
+
+	ptr2 = pTrack->ptr2;
+	if (ptr2 >= pTrack->pEnd2)
+		return FALSE;
+
+	ptr2 = _midiReadVarLen2(pSrc, ptr2, &dt);
+	pTrack->pos += dt;
+	pEvent->dwAbsPos = pTrack->pos;
+	pEvent->dwPayload = 0;
+	pEvent->bData1 = 0;
+	pEvent->bData2 = 0;
+
+	bStatus = read_byte_value_from_pos(pSrc, ptr2);
+	pInfo = &_midiStatusTable[bStatus];
+	if (pInfo->bKind == STATUS_DATA)
+	{
+		bStatus = pTrack->last_status;
+		pInfo = &_midiStatusTable[bStatus];
+		if (pInfo->bKind != STATUS_CHANNEL)
+			return FALSE;
+	}
+	else
+	{
+		++ptr2;
+	}
+	pEvent->bStatus = bStatus;
+
+	switch(pInfo->bKind)
+	{
+	case	STATUS_CHANNEL:
+		pTrack->last_status = bStatus;
+		pEvent->bData1 = read_byte_value_from_pos(pSrc, ptr2);
+		if (pInfo->bDataLen == 2)
+			pEvent->bData2 = read_byte_value_from_pos(pSrc, ptr2 + 1);
+		ptr2 += pInfo->bDataLen;
+		break;
+
+	case	STATUS_META:
+		pEvent->bData1 = read_byte_value_from_pos(pSrc, ptr2++);
+		/* fall through */
+	case	STATUS_SYSEX:
+		pEvent->dwPayload = ptr2;
+		ptr2 = _midiReadVarLen2(pSrc, ptr2, &sz);
+		ptr2 += sz;
+		break;
+
+	default:
+		ptr2 += pInfo->bDataLen;
+		break;
+	}
+
+	if (ptr2 > pSrc->dwSize || ptr2 < pTrack->ptr2)
+		return _midiReadTrackFail(pTrack);
+	pTrack->ptr2 = ptr2;
+	return TRUE;
+}
+
+BOOL midiReadGetNextEvent(const _MIDI_FILE *_pMF, int iTrack, MIDI_EVENT *pEvent)
+{
+	_VAR_CAST;
+
+	if (!IsTrackValid(iTrack))
+		return FALSE;
+
+	pEvent->bTrack = (BYTE)iTrack;
+	return _midiReadTrackEvent(&pMF->Src, pMF->pFilter, &pMF->Track[iTrack], pEvent);
+}
+
+int midiReadGetEvents(const _MIDI_FILE *_pMF, int iTrack, MIDI_EVENT *pEvents, int n)
+{
+	MIDI_FILE_TRACK *pTrack;
+	int i;
+
+	_VAR_CAST;
+
+	if (!IsTrackValid(iTrack))
+		return 0;
+
+	pTrack = &pMF->Track[iTrack];
+	for(i=0; i < n; ++i)
+	{
+		if (!_midiReadTrackEvent(&pMF->Src, pMF->pFilter, pTrack, &pEvents[i]))
+			break;
+		pEvents[i].bTrack = (BYTE)iTrack;
+	}
+
+	return i;
+}
+
+/* Finds where an event's payload starts, with its size in *pdwSize cut
+** down to what the file really holds */
+static DWORD _midiReadPayloadStart(MIDI_SOURCE *pSrc, const MIDI_EVENT *pEvent, DWORD *pdwSize)
+{
+	DWORD ptr2 = _midiReadVarLen2(pSrc, pEvent->dwPayload, pdwSize);
+
+	if (ptr2 >= pSrc->dwSize)
+		*pdwSize = 0;
+	else if (*pdwSize > pSrc->dwSize - ptr2)
+		*pdwSize = pSrc->dwSize - ptr2;
+	return ptr2;
+}
+
+/* Size of the payload of a meta/SysEx event, 0 for channel messages. A
+** payload running past the end of the file only counts up to there. */
+DWORD midiReadGetEventPayloadSize(const _MIDI_FILE *_pMF, const MIDI_EVENT *pEvent)
+{
+	DWORD sz = 0;
+
+	_VAR_CAST;
+
+	if (pEvent->dwPayload)
+		_midiReadPayloadStart(&pMF->Src, pEvent, &sz);
+	return sz;
+}
+
+/* Returns the payload of a meta/SysEx event, with the number of bytes
+** that can be used there in *pdwSize. Memory and mapped files return a
+** pointer straight into the file and the whole payload; others copy as
+** much as fits into pBuf. A payload running past the end of the file is
+** cut short there. NULL for channel messages. */
+const BYTE *midiReadGetEventPayload(const _MIDI_FILE *_pMF, const MIDI_EVENT *pEvent, BYTE *pBuf, DWORD dwBufSize, DWORD *pdwSize)
+{
+	MIDI_SOURCE *pSrc;
+	DWORD ptr2;
+
+	_VAR_CAST;
+
+	*pdwSize = 0;
+	if (!pEvent->dwPayload)
+		return NULL;
+
+	pSrc = &pMF->Src;
+	ptr2 = _midiReadPayloadStart(pSrc, pEvent, pdwSize);
+	if (pSrc->pMem)
+		return pSrc->pMem + ptr2;
+
+	if (*pdwSize > dwBufSize)
+		*pdwSize = dwBufSize;
+	read_mem_from_pos(pSrc, pBuf, ptr2, *pdwSize);
+	return pBuf;
+}
+
+
+/* Copies dwLen bytes of a meta/SysEx payload starting dwOffset bytes in,
+** so one too big for any buffer can be streamed through a small one.
+** Returns the number of bytes copied, 0 past the end. */
+DWORD midiReadGetEventPayloadPart(const _MIDI_FILE *_pMF, const MIDI_EVENT *pEvent, DWORD dwOffset, BYTE *pBuf, DWORD dwLen)
+{
+	DWORD ptr2, sz;
+
+	_VAR_CAST;
+
+	if (!pEvent->dwPayload)
+		return 0;
+
+	ptr2 = _midiReadPayloadStart(&pMF->Src, pEvent, &sz);
+	if (dwOffset >= sz)
+		return 0;
+	if (dwLen > sz - dwOffset)
+		dwLen = sz - dwOffset;
+
+	read_mem_from_pos(&pMF->Src, pBuf, ptr2 + dwOffset, dwLen);
+	return dwLen;
+}
+
+
+/*
+** Merged reading
+*/
+#define MERGE_BEFORE(_pM, _a, _b)	((_pM)->dwNext[_a] < (_pM)->dwNext[_b] || ((_pM)->dwNext[_a] == (_pM)->dwNext[_b] && (_a) < (_b)))
+
+/* Works out when a track's next event is due, without reading it */
+static BOOL _midiMergePeek(MIDI_MERGE *pMerge, int iTrack)
+{
+	_MIDI_FILE *pMF = (_MIDI_FILE *)pMerge->pMF;
+	MIDI_FILE_TRACK *pTrack = &pMF->Track[iTrack];
+	DWORD dt;
+
+	/* Filtered events mustn't hold the track's place in the queue */
+	if (pMF->pFilter)
+		_midiReadTrackFilter(&pMF->Src, pMF->pFilter, pTrack);
+
+	if (pTrack->ptr2 >= pTrack->pEnd2)
+		return FALSE;
+
+	_midiReadVarLen2(&pMF->Src, pTrack->ptr2, &dt);
+	pMerge->dwNext[iTrack] = pTrack->pos + dt;
+	return TRUE;
+}
+
+static void _midiMergeSiftDown(MIDI_MERGE *pMerge, int i)
+{
+	BYTE bTrack = pMerge->bHeap[i];
+	int iChild;
+
+	while((iChild = 2*i + 1) < pMerge->iCount)
+	{
+		if (iChild + 1 < pMerge->iCount && MERGE_BEFORE(pMerge, pMerge->bHeap[iChild + 1], pMerge->bHeap[iChild]))
+			++iChild;
+		if (!MERGE_BEFORE(pMerge, pMerge->bHeap[iChild], bTrack))
+			break;
+		pMerge->bHeap[i] = pMerge->bHeap[iChild];
+		i = iChild;
+	}
+	pMerge->bHeap[i] = bTrack;
+}
+
+/* The top track has been read from; requeue it, or drop it if it's done
+** or couldn't be read */
+static void _midiMergeAdvance(MIDI_MERGE *pMerge, BOOL bRead)
+{
+	if (!bRead || !_midiMergePeek(pMerge, pMerge->bHeap[0]))
+		pMerge->bHeap[0] = pMerge->bHeap[--pMerge->iCount];
+	if (pMerge->iCount)
+		_midiMergeSiftDown(pMerge, 0);
+}
+
+/* Starts from wherever each track's read position currently is */
+void midiMergeInit(MIDI_MERGE *pMerge, const _MIDI_FILE *_pMF)
+{
+	int i, iNum;
+
+	_VAR_CAST;
+
+	pMerge->pMF = pMF;
+	pMerge->iCount = 0;
+	pMerge->dwPos = 0;
+
+	/* The first dt counts from where reading starts, e.g. after a seek.
+	** Each track sits just after its last event before there, so the
+	** latest of them is the last event of the song before it. */
+	iNum = pMF->Header.iNumTracks < MAX_MIDI_TRACKS ? pMF->Header.iNumTracks : MAX_MIDI_TRACKS;
+	for(i=0; i < iNum; ++i)
+	{
+		if (pMF->Track[i].pos > pMerge->dwPos)
+			pMerge->dwPos = pMF->Track[i].pos;
+		if (_midiMergePeek(pMerge, i))
+			pMerge->bHeap[pMerge->iCount++] = (BYTE)i;
+	}
+
+	for(i=pMerge->iCount/2 - 1; i >= 0; --i)
+		_midiMergeSiftDown(pMerge, i);
+}
+
+/* When the next event is due, i.e. how long a player has to wait */
+BOOL midiMergeGetNextPos(const MIDI_MERGE *pMerge, DWORD *pdwPos)
+{
+	if (!pMerge->iCount)
+		return FALSE;
+
+	*pdwPos = pMerge->dwNext[pMerge->bHeap[0]];
+	return TRUE;
+}
+
+/* Reads the next event of the whole song. pMsg->dt is the time since the
+** previous event returned, whichever track that came from. */
+BOOL midiMergeGetNextMessage(MIDI_MERGE *pMerge, MIDI_MSG *pMsg, int *piTrack)
+{
+	_MIDI_FILE *pMF = (_MIDI_FILE *)pMerge->pMF;
+	BOOL bRead;
+	int iTrack;
+
+	while(pMerge->iCount)
+	{
+		iTrack = pMerge->bHeap[0];
+		bRead = _midiReadTrackMessage(&pMF->Src, pMF->pArena, pMF->pFilter, &pMF->Track[iTrack], pMsg);
+		_midiMergeAdvance(pMerge, bRead);
+
+		if (bRead)
+		{
+			pMsg->dt = pMsg->dwAbsPos - pMerge->dwPos;
+			pMerge->dwPos = pMsg->dwAbsPos;
+			if (piTrack)
+				*piTrack = iTrack;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+BOOL midiMergeGetNextEvent(MIDI_MERGE *pMerge, MIDI_EVENT *pEvent)
+{
+	_MIDI_FILE *pMF = (_MIDI_FILE *)pMerge->pMF;
+	BOOL bRead;
+	int iTrack;
+
+	while(pMerge->iCount)
+	{
+		iTrack = pMerge->bHeap[0];
+		bRead = _midiReadTrackEvent(&pMF->Src, pMF->pFilter, &pMF->Track[iTrack], pEvent);
+		_midiMergeAdvance(pMerge, bRead);
+
+		if (bRead)
+		{
+			pEvent->bTrack = (BYTE)iTrack;
+			pMerge->dwPos = pEvent->dwAbsPos;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+
+/*
+** Push parser
+*/
+enum {
+	PUSH_CHUNK,			/* collecting an 8 byte chunk header */
+	PUSH_MTHD,			/* collecting the MThd fields */
+	PUSH_SKIP,			/* discarding the rest of a chunk */
+	PUSH_DELTA,
+	PUSH_STATUS,
+	PUSH_DATA,			/* channel message data bytes */
+	PUSH_META_TYPE,
+	PUSH_LENGTH,		/* meta/SysEx length */
+	PUSH_PAYLOAD,
+	PUSH_ERROR
+};
+
+void midiPushInit(MIDI_PUSH *pPush)
+{
+	memset(pPush, 0, sizeof(*pPush));
+	pPush->iTrack = -1;
+	pPush->iState = PUSH_CHUNK;
+}
+
+void midiPushFeed(MIDI_PUSH *pPush, const BYTE *pData, DWORD dwSize)
+{
+	/* Must stay valid until midiPushGetNextMessage() returns FALSE */
+	pPush->pIn = pData;
+	pPush->dwInLeft = dwSize;
+}
+
+BOOL midiPushFailed(const MIDI_PUSH *pPush)
+{
+	return pPush->iState == PUSH_ERROR;
+}
+
+void midiPushFree(MIDI_PUSH *pPush)
+{
+	if (pPush->pBuf)
+		free((void *)pPush->pBuf);
+	pPush->pBuf = NULL;
+	pPush->dwBufSize = 0;
+	pPush->dwBufLen = 0;
+}
+
+static BOOL _midiPushSetState(MIDI_PUSH *pPush, int iState)
+{
+	pPush->iState = iState;
+	return FALSE;
+}
+
+/* Fills pMsg from the event that has just been completed */
+static void _midiPushEmit(MIDI_PUSH *pPush, MIDI_MSG *pMsg)
+{
+	BYTE bStatus = pPush->iRunStatus;
+
+	pPush->pos += pPush->dt;
+	pMsg->dt = pPush->dt;
+	pMsg->dwAbsPos = pPush->pos;
+	pMsg->bImpliedMsg = FALSE;
+	pMsg->bTruncated = FALSE;
+
+	if (pPush->iState == PUSH_PAYLOAD)
+	{
+		pMsg->data = pPush->pBuf;
+		pMsg->iType = (tMIDI_MSG)pPush->pBuf[0];
+		pMsg->iLastMsgChnl = (BYTE)(bStatus & 0x0f) + 1;
+		pMsg->iMsgSize = pPush->dwBufLen - pPush->dwHdrSize;
+
+		if (pMsg->iType == msgMetaEvent)
+		{
+			pMsg->MsgData.MetaEvent.iType = (tMIDI_META)pPush->pBuf[1];
+			_midiDecodeMetaEvent(pMsg, pPush->dwHdrSize);
+		}
+		else
+		{
+			pMsg->MsgData.SysEx.pData = pMsg->data;
+			pMsg->MsgData.SysEx.iSize = pPush->dwBufLen;
+		}
+		pMsg->iMsgSize = pPush->dwBufLen;
+	}
+	else if (pPush->bTmp[0] >= msgSysEx1)
+	{
+		/* A system message, which leaves running status alone */
+		pMsg->iType = (tMIDI_MSG)pPush->bTmp[0];
+		pMsg->iLastMsgChnl = (BYTE)(bStatus & 0x0f) + 1;
+		pMsg->data = pPush->bTmp;
+		pMsg->iMsgSize = pPush->dwHave;
+	}
+	else
+	{
+		pMsg->iType = (tMIDI_MSG)(bStatus & 0xf0);
+		pMsg->iLastMsgChnl = (BYTE)(bStatus & 0x0f) + 1;
+		pMsg->data = pPush->bTmp;
+
+		if (pPush->bImplied)
+			_midiDecodeChannelMsg(pMsg, pPush->bTmp[0], pPush->bTmp[1]);
+		else
+			_midiDecodeChannelMsg(pMsg, pPush->bTmp[1], pPush->bTmp[2]);
+
+		if (pPush->bImplied)
+		{
+			pMsg->bImpliedMsg = TRUE;
+			pMsg->iImpliedMsg = pMsg->iType;
+			pMsg->iMsgSize--;
+		}
+	}
+	pMsg->iLastMsgType = pMsg->iType;
+
+	pPush->dt = 0;
+	pPush->dwHave = 0;
+	pPush->iState = PUSH_DELTA;
+}
+
+/* Makes room for a meta/SysEx event of the given total size */
+static BOOL _midiPushReserve(MIDI_PUSH *pPush, DWORD sz)
+{
+	if (sz > pPush->dwBufSize)
+	{
+		BYTE *p = (BYTE *)realloc(pPush->pBuf, sz);
+
+		if (!p)
+			return FALSE;
+		pPush->pBuf = p;
+		pPush->dwBufSize = sz;
+	}
+	return TRUE;
+}
+
+/* Consumes as much of the fed data as it takes to complete one message.
+** Returns FALSE once it's all gone (or the data turned out to be bad),
+** in which case feed the next piece and call again. Message data points
+** into the parser and is only valid until the next call. */
+BOOL midiPushGetNextMessage(MIDI_PUSH *pPush, MIDI_MSG *pMsg)
+{
+	while(pPush->dwInLeft && pPush->iState != PUSH_ERROR)
+	{
+		BYTE b;
+
+		/* Bulk states first, everything else goes a byte at a time */
+		if (pPush->iState == PUSH_SKIP || pPush->iState == PUSH_PAYLOAD)
+		{
+			DWORD n = pPush->iState == PUSH_SKIP ? pPush->dwChunkLeft : pPush->dwNeed;
+
+			if (n > pPush->dwInLeft)
+				n = pPush->dwInLeft;
+			if (pPush->iState == PUSH_PAYLOAD)
+			{
+				memcpy(pPush->pBuf + pPush->dwBufLen, pPush->pIn, n);
+				pPush->dwBufLen += n;
+				pPush->dwNeed -= n;
+			}
+			pPush->pIn += n;
+			pPush->dwInLeft -= n;
+			pPush->dwChunkLeft -= n;
+
+			if (pPush->iState == PUSH_SKIP && !pPush->dwChunkLeft)
+				pPush->iState = PUSH_CHUNK;
+			else if (pPush->iState == PUSH_PAYLOAD && !pPush->dwNeed)
+			{
+				_midiPushEmit(pPush, pMsg);
+				return TRUE;
+			}
+			continue;
+		}
+
+		if (pPush->iState >= PUSH_DELTA)
+		{
+			/* Inside a track, where nothing may run past the chunk */
+			if (!pPush->dwChunkLeft)
+			{
+				if (pPush->iState != PUSH_DELTA || pPush->dwHave)
+					return _midiPushSetState(pPush, PUSH_ERROR);
+				pPush->iState = PUSH_CHUNK;
+				continue;
+			}
+			--pPush->dwChunkLeft;
+		}
+
+		b = *pPush->pIn++;
+		--pPush->dwInLeft;
+
+		switch(pPush->iState)
+		{
+		case	PUSH_CHUNK:
+			pPush->bTmp[pPush->dwHave++] = b;
+			if (pPush->dwHave < 8)
+				break;
+
+			pPush->dwHave = 0;
+			pPush->dwChunkLeft = (DWORD)pPush->bTmp[4] << 24 | (DWORD)pPush->bTmp[5] << 16 | (DWORD)pPush->bTmp[6] << 8 | pPush->bTmp[7];
+			if (!memcmp(pPush->bTmp, "MThd", 4))
+			{
+				pPush->Header.iHeaderSize = pPush->dwChunkLeft;
+				pPush->iState = pPush->dwChunkLeft >= 6 ? PUSH_MTHD : PUSH_ERROR;
+			}
+			else if (pPush->iTrack == -1 && !pPush->Header.iHeaderSize)
+			{
+				pPush->iState = PUSH_ERROR;		/* not a MIDI file */
+			}
+			else if (!memcmp(pPush->bTmp, "MTrk", 4))
+			{
+				++pPush->iTrack;
+				pPush->pos = 0;
+				pPush->dt = 0;
+				pPush->iRunStatus = 0;
+				pPush->iState = PUSH_DELTA;
+			}
+			else
+			{
+				pPush->iState = pPush->dwChunkLeft ? PUSH_SKIP : PUSH_CHUNK;
+			}
+			break;
+
+		case	PUSH_MTHD:
+			pPush->bTmp[pPush->dwHave++] = b;
+			--pPush->dwChunkLeft;
+			if (pPush->dwHave < 6)
+				break;
+
+			pPush->dwHave = 0;
+			pPush->Header.iVersion = (WORD)(pPush->bTmp[0] << 8 | pPush->bTmp[1]);
+			pPush->Header.iNumTracks = (WORD)(pPush->bTmp[2] << 8 | pPush->bTmp[3]);
+			pPush->Header.PPQN = (WORD)(pPush->bTmp[4] << 8 | pPush->bTmp[5]);
+			pPush->iState = pPush->dwChunkLeft ? PUSH_SKIP : PUSH_CHUNK;
+			break;
+
+		case	PUSH_DELTA:
+			pPush->dt = (pPush->dt << 7) | (b & 0x7f);
+			if (++pPush->dwHave > 4)
+				return _midiPushSetState(pPush, PUSH_ERROR);
+			if (!(b & 0x80))
+			{
+				pPush->dwHave = 0;
+				pPush->iState = PUSH_STATUS;
+			}
+			break;
+
+		case	PUSH_STATUS:
+			pPush->dwHave = 0;
+			if (b == msgMetaEvent)
+			{
+				pPush->bTmp[pPush->dwHave++] = b;
+				pPush->iState = PUSH_META_TYPE;
+			}
+			else if (b == msgSysEx1 || b == msgSysEx2)
+			{
+				pPush->bTmp[pPush->dwHave++] = b;
+				pPush->dwValue = 0;
+				pPush->iState = PUSH_LENGTH;
+			}
+			else if (b > msgSysEx1)
+			{
+				/* System messages have no business in a file, but are
+				** stepped over by their length as the pull reader does */
+				pPush->bTmp[pPush->dwHave++] = b;
+				pPush->dwNeed = _midiStatusTable[b].bDataLen;
+				if (!pPush->dwNeed)
+				{
+					_midiPushEmit(pPush, pMsg);
+					return TRUE;
+				}
+				pPush->iState = PUSH_DATA;
+			}
+			else
+			{
+				/* bTmp holds the message as it appeared in the file */
+				if (b & 0x80)
+				{
+					pPush->iRunStatus = b;
+					pPush->bImplied = FALSE;
+				}
+				else if (pPush->iRunStatus)
+				{
+					pPush->bImplied = TRUE;
+				}
+				else
+				{
+					return _midiPushSetState(pPush, PUSH_ERROR);
+				}
+
+				memset(pPush->bTmp, 0, 3);
+				pPush->bTmp[pPush->dwHave++] = b;
+				pPush->dwNeed = _midiStatusTable[pPush->iRunStatus].bDataLen - pPush->bImplied;
+				if (!pPush->dwNeed)
+				{
+					_midiPushEmit(pPush, pMsg);
+					return TRUE;
+				}
+				pPush->iState = PUSH_DATA;
+			}
+			break;
+
+		case	PUSH_DATA:
+			pPush->bTmp[pPush->dwHave++] = b;
+			if (--pPush->dwNeed)
+				break;
+			_midiPushEmit(pPush, pMsg);
+			return TRUE;
+
+		case	PUSH_META_TYPE:
+			pPush->bTmp[pPush->dwHave++] = b;
+			pPush->dwValue = 0;
+			pPush->iState = PUSH_LENGTH;
+			break;
+
+		case	PUSH_LENGTH:
+			pPush->bTmp[pPush->dwHave++] = b;
+			pPush->dwValue = (pPush->dwValue << 7) | (b & 0x7f);
+			if (b & 0x80)
+			{
+				if (pPush->dwHave >= 6)
+					return _midiPushSetState(pPush, PUSH_ERROR);
+				break;
+			}
+
+			if (pPush->dwValue > pPush->dwChunkLeft || !_midiPushReserve(pPush, pPush->dwHave + pPush->dwValue))
+				return _midiPushSetState(pPush, PUSH_ERROR);
+			memcpy(pPush->pBuf, pPush->bTmp, pPush->dwHave);
+			pPush->dwHdrSize = pPush->dwBufLen = pPush->dwHave;
+			pPush->dwNeed = pPush->dwValue;
+			pPush->iState = PUSH_PAYLOAD;
+			if (!pPush->dwNeed)
+			{
+				_midiPushEmit(pPush, pMsg);
+				return TRUE;
+			}
+			break;
+		}
+	}
+
+	return FALSE;
+}
+
+
+// ok
+void midiReadInitMessage(MIDI_MSG *pMsg)
+{
+	pMsg->data = NULL;
+	pMsg->pAlloc = NULL;
+	pMsg->data_sz = 0;
+	pMsg->bImpliedMsg = FALSE;
+	pMsg->bTruncated = FALSE;
+}
+
+
+// ok!
+void midiReadFreeMessage(MIDI_MSG *pMsg)
+{
+	if (pMsg->pAlloc)
+		free((void *)pMsg->pAlloc);
+	pMsg->pAlloc = NULL;
+	pMsg->data = NULL;
+	pMsg->data_sz = 0;
 }
 
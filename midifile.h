@@ -33,6 +33,20 @@
 **						not explicitly stored)
 **		midiSong*		For operations that work across the song, i.e. SetTempo
 **		midiTrack*		For operations on a specific track, i.e. AddNoteOn
+**		midiSource*		For the byte sources the reader pulls its data from
+**		midiArena*		For caller supplied payload memory
+**		midiFilter*		For choosing which events the reader bothers to decode
+**		midiPush*		For parsing data that is pushed in as it arrives
+**		midiStore*		For tracks decoded once into columns, for repeated scans
+**		midiMerge*		For reading all tracks together in time order
+**		midiSeek*		For jumping to a point in the song
+**		midiIndex*		For the sidecar file that saves re-scanning a song on open
+**		midiTempo*		For converting between ticks and real time
+**		midiChase*		For restoring programs, controllers etc. after a seek
+**		midiProbe*		For catalogue details, without decoding the whole song
+**		midiOptimize*	For re-encoding a song in as few bytes as possible
+**		midiConvert*	For rewriting a song in another file format
+**		midiCompile*	For songs compiled into ready timed messages for small players
 */
 
 /*
@@ -41,6 +55,7 @@
 typedef	unsigned char		BYTE;
 typedef	unsigned short		WORD;
 typedef	unsigned long		DWORD;
+typedef	unsigned long long	QWORD;		/* only for time calculations that can't fit in 32 bits */
 typedef int					BOOL;
 #ifndef TRUE
 #define TRUE	1
@@ -50,14 +65,125 @@ typedef int					BOOL;
 #endif
 
 
-void read_mem_from_pos(void* dst, DWORD pos, DWORD length);
-void read_string_from_pos_s(void* dst, DWORD pos, DWORD max_length);
-DWORD read_dword_value_from_pos(DWORD pos);
-WORD read_word_value_from_pos(DWORD pos);
-BYTE read_byte_value_from_pos(DWORD pos);
 
+/*
+** Byte sources
+**
+** The reader never touches stdio directly. Everything it needs is fetched
+** through a MIDI_SOURCE, which is a small vtable (open/readAt/size/close)
+** plus a read window. Small reads are served from the window; the backend
+** is only called when a read falls outside of it, so the parser issues a
+** few large reads per track instead of one fseek/fread per byte.
+**
+** The window is whichever sector of a small LRU cache was used last. All
+** track cursors of a file share that cache, so a Format 1 file whose
+** tracks are read interleaved doesn't re-read the same sectors over and
+** over. Sectors are aligned to match SD-card and floppy block reads.
+** Only sources that aren't directly addressable have a cache at all. It
+** is either supplied by the caller, i.e. a static array on a small target,
+** or taken from the heap when the source is opened.
+*/
+#ifndef MIDI_SOURCE_SECTOR_SIZE
+#define MIDI_SOURCE_SECTOR_SIZE		512
+#endif
+#ifndef MIDI_SOURCE_CACHE_SECTORS
+#define MIDI_SOURCE_CACHE_SECTORS	4		/* sectors allocated when the caller doesn't supply any */
+#endif
+
+typedef struct _MIDI_SOURCE MIDI_SOURCE;
+
+typedef struct {
+	BOOL	(*open)(MIDI_SOURCE *pSrc, const void *pParam);
+	DWORD	(*readAt)(MIDI_SOURCE *pSrc, DWORD pos, void *pDst, DWORD length);	/* returns bytes read */
+	DWORD	(*size)(MIDI_SOURCE *pSrc);
+	void	(*close)(MIDI_SOURCE *pSrc);
+} MIDI_SOURCE_FUNCS;
+
+typedef struct {
+	DWORD	dwPos;				/* sector aligned offset */
+	DWORD	dwLen;				/* valid bytes, 0 while unused */
+	DWORD	dwLastUse;
+	BYTE	data[MIDI_SOURCE_SECTOR_SIZE];
+} MIDI_SOURCE_SECTOR;
+
+struct _MIDI_SOURCE {
+	const MIDI_SOURCE_FUNCS	*pFuncs;
+	void		*pHandle;			/* backend specific, i.e. FILE* */
+	DWORD		dwSize;				/* total number of bytes in the source */
+	const BYTE	*pMem;				/* whole source if it is directly addressable, else NULL */
+
+	/* Read window - bytes [dwWinPos, dwWinPos+dwWinLen) are available at pWin */
+	const BYTE	*pWin;
+	DWORD		dwWinPos;
+	DWORD		dwWinLen;
+
+	/* Sector cache behind the window (NULL for directly addressable sources) */
+	MIDI_SOURCE_SECTOR	*pCache;
+	int			iCacheSectors;
+	BOOL		bOwnCache;			/* pCache came from the heap and is freed on close */
+	DWORD		dwClock;			/* LRU time stamp */
+	DWORD		dwHits;				/* sector lookups served from the cache */
+	DWORD		dwMisses;			/* sector lookups that went to the backend */
+};
+
+extern const MIDI_SOURCE_FUNCS	midiSourceFile;		/* pParam is the filename */
+extern const MIDI_SOURCE_FUNCS	midiSourceMapped;	/* pParam is the filename, fails where mmap is unavailable */
+extern const MIDI_SOURCE_FUNCS	midiSourceMemory;	/* pParam is a MIDI_SOURCE_MEM */
+
+typedef struct {
+	const BYTE	*pData;			/* i.e. a song linked into flash */
+	DWORD		dwSize;
+} MIDI_SOURCE_MEM;
+
+BOOL		midiSourceOpen(MIDI_SOURCE *pSrc, const MIDI_SOURCE_FUNCS *pFuncs, const void *pParam);
+BOOL		midiSourceOpenCached(MIDI_SOURCE *pSrc, const MIDI_SOURCE_FUNCS *pFuncs, const void *pParam, MIDI_SOURCE_SECTOR *pCache, int iNumSectors);
+DWORD		midiSourceRead(MIDI_SOURCE *pSrc, DWORD pos, void *pDst, DWORD length);
+DWORD		midiSourceGetSize(const MIDI_SOURCE *pSrc);
+void		midiSourceGetCacheStats(const MIDI_SOURCE *pSrc, DWORD *pdwHits, DWORD *pdwMisses);
+void		midiSourceClose(MIDI_SOURCE *pSrc);
+
+
+/*
+** Payload arenas. With one set on a file, message data read from a
+** non-addressable source is carved out of caller supplied memory instead
+** of the heap. Nothing is freed individually; call midiArenaReset() at a
+** point that suits, e.g. after each batch of messages has been handled.
+*/
+#define MIDI_ARENA_SCRATCH		0x01	/* every message starts at the beginning again, so only the last one is valid */
+#define MIDI_ARENA_TRUNCATE		0x02	/* cut payloads that don't fit rather than fail */
 
+typedef struct {
+	BYTE		*pBase;
+	DWORD		dwSize;
+	DWORD		dwUsed;
+	DWORD		dwFlags;
+} MIDI_ARENA;
+
+void		midiArenaInit(MIDI_ARENA *pArena, BYTE *pBuf, DWORD dwSize, DWORD dwFlags);
+void		midiArenaReset(MIDI_ARENA *pArena);
+
+
+/*
+** Event filters. Events that don't pass are skipped by length as the
+** track is read, without being decoded or copied; absolute times and
+** running status stay correct and the next delivered message's dt covers
+** the skipped ones. Channel messages must pass both the channel and the
+** message mask, meta events both MIDI_FILTER_META and the meta mask.
+*/
+#define MIDI_FILTER_MSG(_m)		(1 << (((_m) >> 4) & 0x0f))	/* for msgNoteOff .. msgSetPitchWheel */
+#define MIDI_FILTER_SYSEX		0x0001
+#define MIDI_FILTER_META		0x0002
+
+typedef struct {
+	WORD		wChannels;		/* bit n-1 for channel n */
+	WORD		wMsgs;			/* MIDI_FILTER_xxx bits */
+	BYTE		bMeta[16];		/* one bit per meta event type */
+} MIDI_FILTER;
 
+void		midiFilterInit(MIDI_FILTER *pFilter, BOOL bPassAll);
+void		midiFilterSetChannel(MIDI_FILTER *pFilter, int iChannel, BOOL bPass);
+void		midiFilterSetMsg(MIDI_FILTER *pFilter, tMIDI_MSG iMsg, BOOL bPass);
+void		midiFilterSetMeta(MIDI_FILTER *pFilter, tMIDI_META iType, BOOL bPass);
 
 
 /*
@@ -80,6 +206,8 @@ BYTE read_byte_value_from_pos(DWORD pos);
 // - coon
 
 #define MAX_MIDI_TRACKS			16 // default: 256 
+#define MAX_TRACK_POLYPHONY		4  // notes held at once per track when writing, default: 64
+#define MIDI_WRITE_BLOCK_SIZE	1024		/* tracks being written grow by this much at a time */
 
 /*
 ** MIDI structures, accessibly externably
@@ -100,9 +228,41 @@ typedef struct 	{
 	/* For Writing MIDI Files */
 	BYTE iDefaultChannel;			/* use for write only */
 	BYTE last_status;				/* used for running status */
+	BYTE bFailed;					/* reading stopped at an event that runs past the end of the data */
 
 } MIDI_FILE_TRACK;
 
+/* Written tracks are kept as a chain of fixed size blocks, so growing one
+** never moves what has already been written */
+typedef struct MIDI_WRITE_BLOCK {
+	struct MIDI_WRITE_BLOCK	*pNext;
+	DWORD					dwUsed;
+	BYTE					data[MIDI_WRITE_BLOCK_SIZE];
+} MIDI_WRITE_BLOCK;
+
+typedef struct {
+	BYTE	note, chn;
+	BYTE	valid;
+	DWORD	end_pos;				/* when its note off is due */
+} MIDI_LAST_NOTE;
+
+typedef struct {
+	MIDI_WRITE_BLOCK	*pFirst, *pLast;
+	DWORD				dwSize;			/* bytes in the track so far */
+	DWORD				dt;				/* time since the last event, not yet written */
+	BOOL				bUsed;
+	BOOL				bEnded;			/* end of track is written */
+	void				*pSpill;		/* FILE * holding the start of the track, once memory is full */
+	DWORD				dwSpilled;		/* bytes in pSpill */
+	MIDI_LAST_NOTE		LastNote[MAX_TRACK_POLYPHONY];
+} MIDI_WRITE_TRACK;
+
+typedef struct {
+	void				*pFile;			/* FILE *, kept opaque so this header needs no stdio */
+	DWORD				dwHighWater;	/* most bytes a track keeps in memory, 0 for no limit */
+	MIDI_WRITE_TRACK	Track[MAX_MIDI_TRACKS];
+} MIDI_WRITER;
+
 typedef struct 	{
 	DWORD	iHeaderSize;
 	/**/
@@ -112,7 +272,7 @@ typedef struct 	{
 } MIDI_HEADER;
 
 typedef struct {
-	FILE				*pFile;
+	MIDI_SOURCE			Src;			/* every file owns its source, so any number can be open at once */
 	BOOL				bOpenForWriting;
 
 	MIDI_HEADER			Header;
@@ -121,8 +281,21 @@ typedef struct {
 	DWORD file_sz;
 
 	MIDI_FILE_TRACK		Track[MAX_MIDI_TRACKS];
+	MIDI_ARENA			*pArena;		/* where payloads go, NULL for the heap */
+	const MIDI_FILTER	*pFilter;		/* events to skip, NULL to read everything */
+	MIDI_WRITER			*pWriter;		/* only when open for writing */
 } _MIDI_FILE;
 
+/*
+** Read positions and filter of a file, put aside by midiReadSave() or
+** midiReadRewind() while a pass is made and put back by midiReadRestore()
+*/
+typedef struct {
+	int					iNumTracks;
+	MIDI_FILE_TRACK		Track[MAX_MIDI_TRACKS];
+	const MIDI_FILTER	*pFilter;
+} MIDI_READ_STATE;
+
 
 //typedef	void 	_MIDI_FILE;
 typedef struct {
@@ -136,8 +309,11 @@ typedef struct {
 					tMIDI_MSG	iImpliedMsg;
 
 					/* Raw data chunk */
-					BYTE *data;		/* dynamic data block */
-					DWORD data_sz;
+					BYTE *data;		/* raw message bytes - either pAlloc or, for a mapped file, the mapping itself (read only!) */
+					BYTE *pAlloc;	/* dynamic data block */
+					DWORD data_sz;	/* size of pAlloc */
+					BOOL bTruncated;	/* arena was too small, sizes below are what was kept; data is NULL if none was */
+					BYTE data_short[4];	/* channel and system messages, which never go in an arena */
 					
 					union {
 						struct {
@@ -173,6 +349,8 @@ typedef struct {
 								} PitchWheel;
 						struct {
 								tMIDI_META	iType;
+								const BYTE	*pData;		/* payload, inside 'data' */
+								int			iSize;
 								union {
 									int					iMIDIPort;
 									int					iSequenceNumber;
@@ -182,7 +360,8 @@ typedef struct {
 										
 										} Text;
 									struct {
-										int				iBPM;
+										int				iBPM;		/* rounded down, use dwMicros for timing */
+										DWORD			dwMicros;	/* microseconds per quarter note, exactly */
 										} Tempo;
 									struct {
 										int				iHours, iMins;
@@ -212,10 +391,213 @@ typedef struct {
 	
 				} MIDI_MSG;
 
+/*
+** Compact alternative to MIDI_MSG, 12 bytes on the 32 bit targets. Only
+** the raw bytes are kept; meta and SysEx payloads stay in the file and
+** are fetched with midiReadGetEventPayload() when needed.
+*/
+typedef struct {
+	DWORD		dwAbsPos;		/* absolute time in ticks (dt is the difference to the previous one) */
+	DWORD		dwPayload;		/* meta/SysEx: file offset of the length, which the payload follows */
+	BYTE		bStatus;		/* status byte with running status applied, 0xff for meta events */
+	BYTE		bData1;			/* first data byte, or the meta event type */
+	BYTE		bData2;			/* second data byte, if the message has one */
+	BYTE		bTrack;			/* track it came from */
+} MIDI_EVENT;
+
+/*
+** Push parser, for files that arrive in pieces from a pipe, socket or UART
+** and can't be seeked. Hand over whatever arrived with midiPushFeed(), then
+** call midiPushGetNextMessage() until it returns FALSE. All state, including
+** half a delta time or half a SysEx, is kept here between pieces.
+*/
+typedef struct {
+	MIDI_HEADER	Header;			/* valid once the MThd chunk has gone past */
+	int			iTrack;			/* track of the last message, -1 before the first MTrk */
+	DWORD		pos;			/* absolute time in that track */
+
+	/* Private */
+	int			iState;
+	const BYTE	*pIn;			/* what's left of the piece being fed */
+	DWORD		dwInLeft;
+	DWORD		dwChunkLeft;
+	DWORD		dwValue;		/* delta time or length being assembled */
+	DWORD		dwNeed;			/* bytes still missing from the current item */
+	DWORD		dt;
+	BYTE		iRunStatus;
+	BOOL		bImplied;
+	BYTE		bTmp[16];		/* chunk headers and channel messages */
+	DWORD		dwHave;			/* bytes in bTmp */
+	BYTE		*pBuf;			/* raw meta/SysEx event */
+	DWORD		dwBufSize;
+	DWORD		dwBufLen;
+	DWORD		dwHdrSize;		/* bytes in pBuf before the payload */
+} MIDI_PUSH;
+
+/*
+** Merged reading. Hands out the events of every track in time order,
+** ties going to the lower track number, by keeping the tracks in a heap
+** keyed on the time of their next event. Only the tracks' read positions
+** are used, so it costs a few bytes per track rather than a MIDI_MSG.
+*/
+typedef struct {
+	const _MIDI_FILE	*pMF;
+	int					iCount;						/* tracks that still have events */
+	BYTE				bHeap[MAX_MIDI_TRACKS];		/* track numbers, next due at the top */
+	DWORD				dwNext[MAX_MIDI_TRACKS];	/* time of each track's next event */
+	DWORD				dwPos;						/* time of the last event handed out, or where reading started */
+} MIDI_MERGE;
+
+/*
+** Columnar track store. Every track is decoded once into parallel arrays,
+** so repeated passes (statistics, playback) become plain array loops
+** instead of re-parsing the file. Column i of each array is event i.
+*/
+typedef struct {
+	int			iCount;
+	int			iAlloc;
+	DWORD		*pdwAbsPos;		/* absolute time in ticks, never decreasing */
+	BYTE		*pbStatus;		/* as MIDI_EVENT */
+	BYTE		*pbData1;
+	BYTE		*pbData2;
+	DWORD		*pdwPayload;
+} MIDI_STORE_TRACK;
+
+typedef struct {
+	int					iNumTracks;
+	MIDI_STORE_TRACK	Track[MAX_MIDI_TRACKS];
+} MIDI_STORE;
+
+/*
+** Seek index. A snapshot of each track's read state every so often, so a
+** seek only has to decode forward from the nearest one instead of from
+** the start of every track.
+*/
+typedef struct {
+	DWORD		ptr2;			/* as MIDI_FILE_TRACK, taken between two events */
+	DWORD		pos;
+	BYTE		last_status;
+} MIDI_SEEK_POINT;
+
+typedef struct {
+	int					iCount;
+	int					iAlloc;
+	MIDI_SEEK_POINT		*pPoints;		/* in increasing time order, the first is the track start */
+} MIDI_SEEK_TRACK;
+
+/*
+** Channel state, i.e. everything a device needs to be told after a seek so
+** that the next note sounds as it would have done playing from the start.
+** Anything the song hasn't set yet reads MIDI_CHASE_UNSET.
+*/
+#define MIDI_CHASE_UNSET		0xff
+
+typedef struct {
+	WORD		wUsed;					/* bit n set once channel n+1 has any state */
+	BYTE		bProgram[16];
+	BYTE		bCC[16][128];
+	WORD		wPitch[16];				/* raw 14 bit value, 0xffff if unset */
+	BYTE		bPressure[16];
+	DWORD		dwTempo;				/* microseconds per quarter note, 0 if unset */
+} MIDI_CHASE;
+
+typedef struct {
+	DWORD		dwPos;					/* state from every event before this tick */
+	MIDI_CHASE	State;
+} MIDI_CHASE_POINT;
+
+typedef struct {
+	int					iNumTracks;
+	MIDI_SEEK_TRACK		Track[MAX_MIDI_TRACKS];
+	int					iNumChase;		/* only if midiChaseBuildIndex() was called */
+	MIDI_CHASE_POINT	*pChase;
+} MIDI_SEEK_INDEX;
+
+/*
+** Sidecar index, i.e. song.mid.idx next to song.mid. Holds everything
+** that otherwise takes a full pass over the song: the track table, seek
+** and channel state snapshots, tempo changes and a few totals. It's tied
+** to the song by a checksum of the song's size, start and end, and rebuilt
+** when that no longer matches.
+*/
+#define MIDI_INDEX_SEEK_EVERY	256		/* events between seek snapshots */
+#define MIDI_INDEX_CHASE_EVERY	7680	/* ticks between chase snapshots, 16 beats at 480 PPQN */
+#define MIDI_INDEX_CHECK_BYTES	4096	/* bytes at each end of the song covered by the checksum */
+
+typedef struct {
+	DWORD		dwPos;			/* tick */
+	DWORD		dwTempo;		/* microseconds per quarter note from here on */
+} MIDI_TEMPO_CHANGE;
+
+typedef struct {
+	DWORD				dwCheck;						/* checksum of the song it belongs to */
+	DWORD				dwSize;							/* size of the song */
+	int					iNumTracks;
+	DWORD				pBase2[MAX_MIDI_TRACKS];		/* track table, as MIDI_FILE_TRACK */
+	DWORD				size[MAX_MIDI_TRACKS];
+	MIDI_SEEK_INDEX		Seek;
+	int					iNumTempos;
+	MIDI_TEMPO_CHANGE	*pTempos;						/* in time order */
+	DWORD				dwNumEvents;
+	DWORD				dwEndPos;						/* tick of the last event */
+} MIDI_INDEX;
+
+/*
+** Song details for catalogues. Only meta events are decoded to get them,
+** everything else is skipped by its length.
+*/
+#define MIDI_PROBE_TEXT			128
+
+typedef struct {
+	WORD			wFormat;
+	WORD			wNumTracks;
+	WORD			wPPQN;							/* as in the header, SMPTE if the top bit is set */
+	char			szTitle[MIDI_PROBE_TEXT];		/* first track name in the first track */
+	char			szCopyright[MIDI_PROBE_TEXT];
+	DWORD			dwTempo;						/* initial microseconds per quarter note */
+	int				iTimeSigNom, iTimeSigDenom;		/* e.g. 6 and 8, both 0 if there isn't one */
+	BOOL			bHaveKeySig;
+	tMIDI_KEYSIG	iKeySig;
+	BOOL			bComplete;						/* FALSE if stopped early, leaving the two below 0 */
+	DWORD			dwEndPos;						/* in ticks */
+	QWORD			qwDuration;						/* in microseconds */
+} MIDI_PROBE;
+
+/*
+** Compiled song, as written by midiCompileFile(). The file is a list of
+** fixed size records, each a delay in microseconds and up to 3 bytes to
+** send, so playing one needs no tempo maths, no variable length numbers
+** and no merging of tracks.
+*/
+#define MIDI_COMPILED_RECORD	8		/* bytes per record */
+
+typedef struct {
+	const BYTE	*pNext;			/* next record */
+	DWORD		dwLeft;			/* records still to play */
+} MIDI_COMPILED;
+
+/*
+** Tempo map. The song's time line is split at every tempo change, and the
+** real time at the start of each piece is kept, so converting either way
+** is a binary search and one multiply/divide. Times are kept multiplied
+** by dwDivision, which keeps every segment exact however long the song.
+*/
+typedef struct {
+	DWORD		dwPos;			/* tick the segment starts at */
+	DWORD		dwTempo;		/* microseconds per quarter note */
+	QWORD		qwStart;		/* time at dwPos, in microseconds * dwDivision */
+} MIDI_TEMPO_SEGMENT;
+
+typedef struct {
+	DWORD				dwDivision;		/* ticks per quarter note */
+	int					iNumSegments;
+	MIDI_TEMPO_SEGMENT	*pSegments;
+} MIDI_TEMPO_MAP;
+
 /*
 ** midiFile* Prototypes
 */
-// _MIDI_FILE  *midiFileCreate(const char *pFilename, BOOL bOverwriteIfExists);
+void		midiFileCreate(_MIDI_FILE *pMF, const char *pFilename, BOOL bOverwriteIfExists, BOOL *create_success);
 int			midiFileSetTracksDefaultChannel(_MIDI_FILE *pMF, int iTrack, int iChannel);
 int			midiFileGetTracksDefaultChannel(const _MIDI_FILE *pMF, int iTrack);
 BOOL		midiFileFlushTrack(_MIDI_FILE *pMF, int iTrack, BOOL bFlushToEnd, DWORD dwEndTimePos);
@@ -225,6 +607,13 @@ int			midiFileGetPPQN(const _MIDI_FILE *pMF);
 int			midiFileSetVersion(_MIDI_FILE *pMF, int iVersion);
 int			midiFileGetVersion(const _MIDI_FILE *pMF);
 void midiFileOpen(_MIDI_FILE* pMF, const char *pFilename, BOOL* open_success);
+void midiFileOpenCached(_MIDI_FILE* pMF, const char *pFilename, MIDI_SOURCE_SECTOR *pCache, int iNumSectors, BOOL* open_success);
+void midiFileOpenIndexed(_MIDI_FILE* pMF, const char *pFilename, const MIDI_INDEX *pIndex, BOOL* open_success);
+void midiFileOpenMapped(_MIDI_FILE* pMF, const char *pFilename, BOOL* open_success);
+void midiFileOpenMemory(_MIDI_FILE* pMF, const BYTE *pData, DWORD dwSize, BOOL* open_success);
+void		midiFileSetArena(_MIDI_FILE *pMF, MIDI_ARENA *pArena);
+void		midiFileSetFilter(_MIDI_FILE *pMF, const MIDI_FILTER *pFilter);
+BOOL		midiFileSetSpill(_MIDI_FILE *pMF, DWORD dwHighWater);
 BOOL		midiFileClose(_MIDI_FILE *pMF);
 
 /*
@@ -253,15 +642,116 @@ BOOL		midiTrackSetPitchWheel(_MIDI_FILE *pMF, int iTrack, int iWheelPos);
 BOOL		midiTrackAddNote(_MIDI_FILE *pMF, int iTrack, int iNote, int iLength, int iVol, BOOL bAutoInc, BOOL bOverrideLength);
 BOOL		midiTrackAddRest(_MIDI_FILE *pMF, int iTrack, int iLength, BOOL bOverridePPQN);
 BOOL		midiTrackGetEndPos(_MIDI_FILE *pMF, int iTrack);
+BOOL		midiTrackAddEvent(_MIDI_FILE *pMF, int iTrack, const _MIDI_FILE *pSrc, const MIDI_EVENT *pEvent);
 
 /*
 ** midiRead* Prototypes
 */
 int			midiReadGetNumTracks(const _MIDI_FILE *pMF);
+void		midiReadRewindTrack(const _MIDI_FILE *pMF, int iTrack);
+int			midiReadSave(const _MIDI_FILE *pMF, MIDI_READ_STATE *pSaved, const MIDI_FILTER *pFilter);
+int			midiReadRewind(const _MIDI_FILE *pMF, MIDI_READ_STATE *pSaved, const MIDI_FILTER *pFilter);
+void		midiReadRestore(const _MIDI_FILE *pMF, const MIDI_READ_STATE *pSaved);
 BOOL		midiReadGetNextMessage(const _MIDI_FILE *pMF, int iTrack, MIDI_MSG *pMsg);
+BOOL		midiReadFailed(const _MIDI_FILE *pMF, int iTrack);
+int			midiReadGetMessages(const _MIDI_FILE *pMF, int iTrack, MIDI_MSG *pMsgs, int n);
+BOOL		midiReadGetNextEvent(const _MIDI_FILE *pMF, int iTrack, MIDI_EVENT *pEvent);
+int			midiReadGetEvents(const _MIDI_FILE *pMF, int iTrack, MIDI_EVENT *pEvents, int n);
+DWORD		midiReadGetEventPayloadSize(const _MIDI_FILE *pMF, const MIDI_EVENT *pEvent);
+const BYTE	*midiReadGetEventPayload(const _MIDI_FILE *pMF, const MIDI_EVENT *pEvent, BYTE *pBuf, DWORD dwBufSize, DWORD *pdwSize);
+DWORD		midiReadGetEventPayloadPart(const _MIDI_FILE *pMF, const MIDI_EVENT *pEvent, DWORD dwOffset, BYTE *pBuf, DWORD dwLen);
 void		midiReadInitMessage(MIDI_MSG *pMsg);
 void		midiReadFreeMessage(MIDI_MSG *pMsg);
 
+/*
+** midiPush* Prototypes
+*/
+void		midiPushInit(MIDI_PUSH *pPush);
+void		midiPushFeed(MIDI_PUSH *pPush, const BYTE *pData, DWORD dwSize);
+BOOL		midiPushGetNextMessage(MIDI_PUSH *pPush, MIDI_MSG *pMsg);
+BOOL		midiPushFailed(const MIDI_PUSH *pPush);
+void		midiPushFree(MIDI_PUSH *pPush);
+
+/*
+** midiMerge* Prototypes
+*/
+void		midiMergeInit(MIDI_MERGE *pMerge, const _MIDI_FILE *pMF);
+BOOL		midiMergeGetNextPos(const MIDI_MERGE *pMerge, DWORD *pdwPos);
+BOOL		midiMergeGetNextMessage(MIDI_MERGE *pMerge, MIDI_MSG *pMsg, int *piTrack);
+BOOL		midiMergeGetNextEvent(MIDI_MERGE *pMerge, MIDI_EVENT *pEvent);
+
+/*
+** midiSeek* Prototypes
+*/
+BOOL		midiSeekBuildIndex(MIDI_SEEK_INDEX *pIndex, const _MIDI_FILE *pMF, DWORD dwEvery, BOOL bTicks);
+void		midiSeekFreeIndex(MIDI_SEEK_INDEX *pIndex);
+BOOL		midiSeekToTick(_MIDI_FILE *pMF, const MIDI_SEEK_INDEX *pIndex, DWORD dwTick);
+BOOL		midiSeekToMicros(_MIDI_FILE *pMF, const MIDI_SEEK_INDEX *pIndex, const MIDI_TEMPO_MAP *pMap, QWORD qwMicros);
+
+/*
+** midiIndex* Prototypes
+*/
+BOOL		midiIndexBuild(MIDI_INDEX *pIndex, const _MIDI_FILE *pMF);
+BOOL		midiIndexSave(const MIDI_INDEX *pIndex, const char *pFilename);
+BOOL		midiIndexRead(MIDI_INDEX *pIndex, const char *pFilename);
+BOOL		midiIndexLoad(MIDI_INDEX *pIndex, const _MIDI_FILE *pMF, const char *pFilename);
+BOOL		midiIndexOpen(MIDI_INDEX *pIndex, _MIDI_FILE *pMF, const char *pSongFilename);
+BOOL		midiIndexOpenSong(MIDI_INDEX *pIndex, _MIDI_FILE *pMF, const char *pSongFilename);
+void		midiIndexFree(MIDI_INDEX *pIndex);
+
+/*
+** midiTempo* Prototypes
+*/
+BOOL		midiTempoBuild(MIDI_TEMPO_MAP *pMap, const _MIDI_FILE *pMF);
+BOOL		midiTempoBuildFromList(MIDI_TEMPO_MAP *pMap, WORD wDivision, const MIDI_TEMPO_CHANGE *pTempos, int iNumTempos);
+BOOL		midiTempoAddChange(MIDI_TEMPO_CHANGE **ppTempos, int *piNum, int *piAlloc, DWORD dwPos, DWORD dwTempo);
+BOOL		midiTempoGetEventTempo(const _MIDI_FILE *pMF, const MIDI_EVENT *pEvent, DWORD *pdwTempo);
+void		midiTempoFree(MIDI_TEMPO_MAP *pMap);
+QWORD		midiTempoTickToMicros(const MIDI_TEMPO_MAP *pMap, DWORD dwTick);
+DWORD		midiTempoMicrosToTick(const MIDI_TEMPO_MAP *pMap, QWORD qwMicros);
+
+/*
+** midiChase* Prototypes
+*/
+void		midiChaseInit(MIDI_CHASE *pChase);
+void		midiChaseUpdate(MIDI_CHASE *pChase, const MIDI_MSG *pMsg);
+void		midiChaseUpdateEvent(MIDI_CHASE *pChase, const _MIDI_FILE *pMF, const MIDI_EVENT *pEvent);
+BOOL		midiChaseIsRedundant(const MIDI_CHASE *pChase, const MIDI_EVENT *pEvent);
+int			midiChaseGetNextMsg(const MIDI_CHASE *pChase, int *piPos, BYTE *pMsg);
+BOOL		midiChaseBuildIndex(MIDI_SEEK_INDEX *pIndex, const _MIDI_FILE *pMF, DWORD dwEvery);
+BOOL		midiChaseSeekToTick(_MIDI_FILE *pMF, const MIDI_SEEK_INDEX *pIndex, DWORD dwTick, MIDI_CHASE *pChase);
+
+/*
+** midiProbe* Prototypes
+*/
+BOOL		midiProbeGetInfo(MIDI_PROBE *pProbe, const _MIDI_FILE *pMF, BOOL bQuick);
+
+/*
+** midiOptimize* Prototypes
+*/
+BOOL		midiOptimizeFile(const _MIDI_FILE *pMF, const char *pFilename);
+
+/*
+** midiConvert* Prototypes
+*/
+BOOL		midiConvertToFormat0(const _MIDI_FILE *pMF, const char *pFilename);
+
+/*
+** midiCompile* Prototypes
+*/
+BOOL		midiCompileFile(const _MIDI_FILE *pMF, const char *pFilename);
+BOOL		midiCompileInit(MIDI_COMPILED *pSong, const BYTE *pData, DWORD dwSize);
+BOOL		midiCompileGetNext(MIDI_COMPILED *pSong, DWORD *pdwDelay, BYTE *pMsg, int *piLen);
+
+/*
+** midiStore* Prototypes
+*/
+BOOL		midiStoreBuild(MIDI_STORE *pStore, const _MIDI_FILE *pMF);
+void		midiStoreFree(MIDI_STORE *pStore);
+BOOL		midiStoreGetEvent(const MIDI_STORE *pStore, int iTrack, int iEvent, MIDI_EVENT *pEvent);
+int			midiStoreCountStatus(const MIDI_STORE *pStore, int iTrack, BYTE bStatus);
+DWORD		midiStoreGetEndPos(const MIDI_STORE *pStore);
+
 
 #endif /* _MIDIFILE_H */
 
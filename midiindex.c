@@ -0,0 +1,514 @@
+/*
+ * midiindex.c - Sidecar index files for Steevs MIDI Library. Saves the
+ *				 results of a full pass over a song next to it, so opening
+ *				 it again doesn't need one.
+ * Version 1.4
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of
+ *  the License,or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "midifile.h"
+
+/*
+** File layout, all values big endian like the MIDI file itself:
+**
+**	"MIDX", version, song checksum, song size, number of tracks
+**	per track: pBase2, size, number of seek points, then for each point
+**			   ptr2, pos and last_status (9 bytes)
+**	number of tempo changes, then pos and tempo for each
+**	number of chase snapshots, then for each pos, 2 byte channel mask and
+**			   tempo, then program, pressure, 2 byte pitch wheel and 128
+**			   controllers for each channel in the mask
+**	number of events, end tick
+**	CRC-32 of everything before it
+*/
+#define MIDI_INDEX_VERSION		2
+#define MIDI_INDEX_CHASE_SIZE	(4 + 128)		/* per channel */
+
+
+static BYTE *_midiIndexPut(BYTE *p, DWORD v)
+{
+	p[0] = (BYTE)(v >> 24);
+	p[1] = (BYTE)(v >> 16);
+	p[2] = (BYTE)(v >> 8);
+	p[3] = (BYTE)v;
+	return p + 4;
+}
+
+static DWORD _midiIndexGet(const BYTE *p)
+{
+	return ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | p[3];
+}
+
+static int _midiIndexChannels(WORD wUsed)
+{
+	int n = 0;
+
+	for(; wUsed; wUsed &= wUsed - 1)
+		++n;
+	return n;
+}
+
+static BYTE *_midiIndexPutChase(BYTE *p, const MIDI_CHASE_POINT *pPoint)
+{
+	const MIDI_CHASE *pChase = &pPoint->State;
+	int iChn;
+
+	p = _midiIndexPut(p, pPoint->dwPos);
+	*p++ = (BYTE)(pChase->wUsed >> 8);
+	*p++ = (BYTE)pChase->wUsed;
+	p = _midiIndexPut(p, pChase->dwTempo);
+	for(iChn=0; iChn < 16; ++iChn)
+	{
+		if (pChase->wUsed & (1 << iChn))
+		{
+			*p++ = pChase->bProgram[iChn];
+			*p++ = pChase->bPressure[iChn];
+			*p++ = (BYTE)(pChase->wPitch[iChn] >> 8);
+			*p++ = (BYTE)pChase->wPitch[iChn];
+			memcpy(p, pChase->bCC[iChn], 128);
+			p += 128;
+		}
+	}
+	return p;
+}
+
+/* Fills in a snapshot from the channels saved, leaving the rest unset.
+** Returns FALSE for anything the chase itself couldn't have made. */
+static BOOL _midiIndexGetChase(const BYTE *p, MIDI_CHASE_POINT *pPoint)
+{
+	MIDI_CHASE *pChase = &pPoint->State;
+	int iChn, i;
+
+	midiChaseInit(pChase);
+	pPoint->dwPos = _midiIndexGet(p);
+	pChase->wUsed = (WORD)((p[4] << 8) | p[5]);
+	pChase->dwTempo = _midiIndexGet(p + 6);
+	if (pChase->dwTempo > 0xffffff)
+		return FALSE;
+	p += 10;
+
+	for(iChn=0; iChn < 16; ++iChn)
+	{
+		if (pChase->wUsed & (1 << iChn))
+		{
+			pChase->bProgram[iChn] = p[0];
+			pChase->bPressure[iChn] = p[1];
+			pChase->wPitch[iChn] = (WORD)((p[2] << 8) | p[3]);
+			memcpy(pChase->bCC[iChn], p + 4, 128);
+			p += MIDI_INDEX_CHASE_SIZE;
+
+			if ((pChase->bProgram[iChn] > 127 && pChase->bProgram[iChn] != MIDI_CHASE_UNSET)
+				|| (pChase->bPressure[iChn] > 127 && pChase->bPressure[iChn] != MIDI_CHASE_UNSET)
+				|| (pChase->wPitch[iChn] > 0x3fff && pChase->wPitch[iChn] != 0xffff))
+				return FALSE;
+			for(i=0; i < 128; ++i)
+				if (pChase->bCC[iChn][i] > 127 && pChase->bCC[iChn][i] != MIDI_CHASE_UNSET)
+					return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static DWORD _midiIndexCrc(DWORD crc, const BYTE *p, DWORD len)
+{
+	int i;
+
+	/* Bitwise rather than a 1K table, this is only run on open. Masked
+	** as a DWORD may be wider than 32 bits */
+	crc = ~crc & 0xffffffffUL;
+	while(len--)
+	{
+		crc ^= *p++;
+		for(i=0; i < 8; ++i)
+			crc = (crc >> 1) ^ (0xedb88320UL & (0 - (crc & 1)));
+	}
+	return ~crc & 0xffffffffUL;
+}
+
+/* Adds len bytes of the song from pos, a little at a time to spare the stack */
+static DWORD _midiIndexCrcSource(DWORD crc, MIDI_SOURCE *pSrc, DWORD pos, DWORD len)
+{
+	BYTE buf[64];
+	DWORD n;
+
+	while(len)
+	{
+		n = len < sizeof(buf) ? len : sizeof(buf);
+		midiSourceRead(pSrc, pos, buf, n);
+		crc = _midiIndexCrc(crc, buf, n);
+		pos += n;
+		len -= n;
+	}
+	return crc;
+}
+
+/* The checksum that ties an index to its song, taken over the size and
+** both ends of the file rather than all of it, to keep opens quick */
+static DWORD _midiIndexSongCheck(const _MIDI_FILE *pMF)
+{
+	MIDI_SOURCE *pSrc = (MIDI_SOURCE *)&pMF->Src;
+	DWORD dwSize = midiSourceGetSize(pSrc);
+	DWORD n = dwSize < MIDI_INDEX_CHECK_BYTES ? dwSize : MIDI_INDEX_CHECK_BYTES;
+	BYTE b[4];
+	DWORD crc;
+
+	_midiIndexPut(b, dwSize);
+	crc = _midiIndexCrc(0, b, 4);
+	crc = _midiIndexCrcSource(crc, pSrc, 0, n);
+	return _midiIndexCrcSource(crc, pSrc, dwSize - n, n);
+}
+
+/* Makes the full pass over pMF. Any filter on the file is ignored, and
+** the read positions are left as they were. */
+BOOL midiIndexBuild(MIDI_INDEX *pIndex, const _MIDI_FILE *pMF)
+{
+	MIDI_READ_STATE Saved;
+	MIDI_EVENT ev;
+	DWORD dwTempo;
+	BOOL bOK;
+	int i, iAlloc = 0;
+
+	memset(pIndex, 0, sizeof(*pIndex));
+	pIndex->dwCheck = _midiIndexSongCheck(pMF);
+	pIndex->dwSize = midiSourceGetSize(&pMF->Src);
+	pIndex->iNumTracks = midiReadRewind(pMF, &Saved, NULL);
+	bOK = midiSeekBuildIndex(&pIndex->Seek, pMF, MIDI_INDEX_SEEK_EVERY, FALSE)
+		&& midiChaseBuildIndex(&pIndex->Seek, pMF, MIDI_INDEX_CHASE_EVERY);
+
+	for(i=0; i < pIndex->iNumTracks && bOK; ++i)
+	{
+		pIndex->pBase2[i] = pMF->Track[i].pBase2;
+		pIndex->size[i] = pMF->Track[i].size;
+
+		while(bOK && midiReadGetNextEvent(pMF, i, &ev))
+		{
+			++pIndex->dwNumEvents;
+			if (ev.dwAbsPos > pIndex->dwEndPos)
+				pIndex->dwEndPos = ev.dwAbsPos;
+
+			if (midiTempoGetEventTempo(pMF, &ev, &dwTempo))
+				bOK = midiTempoAddChange(&pIndex->pTempos, &pIndex->iNumTempos, &iAlloc, ev.dwAbsPos, dwTempo);
+		}
+	}
+	midiReadRestore(pMF, &Saved);
+
+	if (!bOK)
+		midiIndexFree(pIndex);
+	return bOK;
+}
+
+void midiIndexFree(MIDI_INDEX *pIndex)
+{
+	midiSeekFreeIndex(&pIndex->Seek);
+	free(pIndex->pTempos);
+	pIndex->pTempos = NULL;
+	pIndex->iNumTempos = 0;
+}
+
+
+/*
+** Saving & loading
+*/
+BOOL midiIndexSave(const MIDI_INDEX *pIndex, const char *pFilename)
+{
+	DWORD dwLen = 20 + 4 + 8 + 4;
+	BYTE *pBuf, *p;
+	FILE *fp;
+	BOOL bOK;
+	int i, j;
+
+	for(i=0; i < pIndex->iNumTracks; ++i)
+		dwLen += 12 + 9 * pIndex->Seek.Track[i].iCount;
+	dwLen += 8 * pIndex->iNumTempos;
+	dwLen += 4;
+	for(i=0; i < pIndex->Seek.iNumChase; ++i)
+		dwLen += 10 + MIDI_INDEX_CHASE_SIZE * _midiIndexChannels(pIndex->Seek.pChase[i].State.wUsed);
+
+	if ((pBuf = (BYTE *)malloc(dwLen)) == NULL)
+		return FALSE;
+
+	memcpy(pBuf, "MIDX", 4);
+	p = _midiIndexPut(pBuf + 4, MIDI_INDEX_VERSION);
+	p = _midiIndexPut(p, pIndex->dwCheck);
+	p = _midiIndexPut(p, pIndex->dwSize);
+	p = _midiIndexPut(p, pIndex->iNumTracks);
+	for(i=0; i < pIndex->iNumTracks; ++i)
+	{
+		const MIDI_SEEK_TRACK *pSeek = &pIndex->Seek.Track[i];
+
+		p = _midiIndexPut(p, pIndex->pBase2[i]);
+		p = _midiIndexPut(p, pIndex->size[i]);
+		p = _midiIndexPut(p, pSeek->iCount);
+		for(j=0; j < pSeek->iCount; ++j)
+		{
+			p = _midiIndexPut(p, pSeek->pPoints[j].ptr2);
+			p = _midiIndexPut(p, pSeek->pPoints[j].pos);
+			*p++ = pSeek->pPoints[j].last_status;
+		}
+	}
+	p = _midiIndexPut(p, pIndex->iNumTempos);
+	for(i=0; i < pIndex->iNumTempos; ++i)
+	{
+		p = _midiIndexPut(p, pIndex->pTempos[i].dwPos);
+		p = _midiIndexPut(p, pIndex->pTempos[i].dwTempo);
+	}
+	p = _midiIndexPut(p, pIndex->Seek.iNumChase);
+	for(i=0; i < pIndex->Seek.iNumChase; ++i)
+		p = _midiIndexPutChase(p, &pIndex->Seek.pChase[i]);
+	p = _midiIndexPut(p, pIndex->dwNumEvents);
+	p = _midiIndexPut(p, pIndex->dwEndPos);
+	p = _midiIndexPut(p, _midiIndexCrc(0, pBuf, (DWORD)(p - pBuf)));
+
+	bOK = FALSE;
+	if ((fp = fopen(pFilename, "wb")) != NULL)
+	{
+		bOK = fwrite(pBuf, 1, dwLen, fp) == dwLen;
+		bOK = !fclose(fp) && bOK;
+	}
+	free(pBuf);
+	return bOK;
+}
+
+/* Reads an index from pFilename without looking at the song, i.e. for
+** midiFileOpenIndexed(). Everything in it is checked to be self consistent,
+** but it can still be out of date; midiIndexLoad() checks that as well. */
+BOOL midiIndexRead(MIDI_INDEX *pIndex, const char *pFilename)
+{
+	FILE *fp;
+	BYTE *pBuf = NULL;
+	const BYTE *p, *pEnd;
+	DWORD dwNum, dwStart, dwEnd, dwLen;
+	long lLen;
+	BOOL bOK = FALSE;
+	int i, j;
+
+	memset(pIndex, 0, sizeof(*pIndex));
+
+	if ((fp = fopen(pFilename, "rb")) == NULL)
+		return FALSE;
+	if (!fseek(fp, 0, SEEK_END) && (lLen = ftell(fp)) >= 36 && !fseek(fp, 0, SEEK_SET))
+	{
+		pBuf = (BYTE *)malloc(lLen);
+		if (pBuf && fread(pBuf, 1, lLen, fp) != (size_t)lLen)
+		{
+			free(pBuf);
+			pBuf = NULL;
+		}
+	}
+	fclose(fp);
+	if (!pBuf)
+		return FALSE;
+
+	pEnd = pBuf + lLen - 4;
+
+	/* Everything is checked before use; a bad index is just rebuilt. Counts
+	** are checked against what's left of the file before they're multiplied
+	** by anything, so a damaged one can't wrap round to a small size. */
+#define LEFT		((DWORD)(pEnd - p))
+#define NEED(_n)	if (LEFT < (DWORD)(_n)) goto done
+	p = pBuf + 20;
+	dwNum = _midiIndexGet(p - 4);
+	if (memcmp(pBuf, "MIDX", 4) || _midiIndexGet(pBuf + 4) != MIDI_INDEX_VERSION
+		|| _midiIndexGet(pEnd) != _midiIndexCrc(0, pBuf, (DWORD)(pEnd - pBuf))
+		|| dwNum > MAX_MIDI_TRACKS)
+		goto done;
+
+	pIndex->dwCheck = _midiIndexGet(pBuf + 8);
+	pIndex->dwSize = _midiIndexGet(pBuf + 12);
+	pIndex->iNumTracks = (int)dwNum;
+	pIndex->Seek.iNumTracks = (int)dwNum;
+	for(i=0; i < pIndex->iNumTracks; ++i)
+	{
+		MIDI_SEEK_TRACK *pSeek = &pIndex->Seek.Track[i];
+
+		NEED(12);
+		pIndex->pBase2[i] = _midiIndexGet(p);
+		pIndex->size[i] = _midiIndexGet(p + 4);
+		dwNum = _midiIndexGet(p + 8);
+		p += 12;
+
+		/* Every point has to be inside its track and in time order */
+		dwStart = pIndex->pBase2[i] + 8;
+		dwEnd = dwStart + pIndex->size[i];
+		if (dwStart < 8 || dwEnd < dwStart || dwNum > LEFT / 9)
+			goto done;
+		if (dwNum && (pSeek->pPoints = (MIDI_SEEK_POINT *)malloc(dwNum * sizeof(MIDI_SEEK_POINT))) == NULL)
+			goto done;
+		pSeek->iCount = pSeek->iAlloc = (int)dwNum;
+		for(j=0; j < pSeek->iCount; ++j, p += 9)
+		{
+			pSeek->pPoints[j].ptr2 = _midiIndexGet(p);
+			pSeek->pPoints[j].pos = _midiIndexGet(p + 4);
+			pSeek->pPoints[j].last_status = p[8];
+			if (pSeek->pPoints[j].ptr2 < dwStart || pSeek->pPoints[j].ptr2 > dwEnd
+				|| (j && pSeek->pPoints[j].pos < pSeek->pPoints[j-1].pos)
+				|| (p[8] && !(p[8] & 0x80)))
+				goto done;
+		}
+	}
+
+	NEED(4);
+	dwNum = _midiIndexGet(p);
+	p += 4;
+	NEED(8);
+	if (dwNum > (LEFT - 8) / 8)
+		goto done;
+	if (dwNum && (pIndex->pTempos = (MIDI_TEMPO_CHANGE *)malloc(dwNum * sizeof(MIDI_TEMPO_CHANGE))) == NULL)
+		goto done;
+	pIndex->iNumTempos = (int)dwNum;
+	for(i=0; i < pIndex->iNumTempos; ++i, p += 8)
+	{
+		pIndex->pTempos[i].dwPos = _midiIndexGet(p);
+		pIndex->pTempos[i].dwTempo = _midiIndexGet(p + 4);
+
+		/* A tempo is 24 bits in the file, and 0 would divide by zero */
+		if (!pIndex->pTempos[i].dwTempo || pIndex->pTempos[i].dwTempo > 0xffffff
+			|| (i && pIndex->pTempos[i].dwPos < pIndex->pTempos[i-1].dwPos))
+			goto done;
+	}
+
+	/* Chase snapshots are at least 10 bytes, more for each channel used */
+	NEED(4);
+	dwNum = _midiIndexGet(p);
+	p += 4;
+	NEED(8);
+	if (dwNum > (LEFT - 8) / 10)
+		goto done;
+	if (dwNum && (pIndex->Seek.pChase = (MIDI_CHASE_POINT *)malloc(dwNum * sizeof(MIDI_CHASE_POINT))) == NULL)
+		goto done;
+	for(i=0; i < (int)dwNum; ++i)
+	{
+		MIDI_CHASE_POINT *pPoint = &pIndex->Seek.pChase[i];
+
+		NEED(10 + 8);
+		dwLen = 10 + MIDI_INDEX_CHASE_SIZE * _midiIndexChannels((WORD)((p[4] << 8) | p[5]));
+		NEED(dwLen + 8);
+		if (!_midiIndexGetChase(p, pPoint) || (i && pPoint->dwPos < pPoint[-1].dwPos))
+			goto done;
+		p += dwLen;
+	}
+	pIndex->Seek.iNumChase = (int)dwNum;
+	pIndex->dwNumEvents = _midiIndexGet(p);
+	pIndex->dwEndPos = _midiIndexGet(p + 4);
+	bOK = TRUE;
+#undef NEED
+#undef LEFT
+
+done:
+	free(pBuf);
+	if (!bOK)
+		midiIndexFree(pIndex);
+	return bOK;
+}
+
+/* Is pIndex for pMF's song as it is now, with the same track table? */
+static BOOL _midiIndexMatches(const MIDI_INDEX *pIndex, const _MIDI_FILE *pMF)
+{
+	int i, iNum = midiReadGetNumTracks(pMF) < MAX_MIDI_TRACKS ? midiReadGetNumTracks(pMF) : MAX_MIDI_TRACKS;
+
+	if (pIndex->iNumTracks != iNum || pIndex->dwSize != midiSourceGetSize(&pMF->Src)
+		|| pIndex->dwCheck != _midiIndexSongCheck(pMF))
+		return FALSE;
+	for(i=0; i < iNum; ++i)
+		if (pIndex->pBase2[i] != pMF->Track[i].pBase2 || pIndex->size[i] != pMF->Track[i].size)
+			return FALSE;
+	return TRUE;
+}
+
+/* Reads an index saved for pMF's song. Fails if it is missing, damaged,
+** or was made from a different version of the song. */
+BOOL midiIndexLoad(MIDI_INDEX *pIndex, const _MIDI_FILE *pMF, const char *pFilename)
+{
+	if (!midiIndexRead(pIndex, pFilename))
+		return FALSE;
+	if (_midiIndexMatches(pIndex, pMF))
+		return TRUE;
+	midiIndexFree(pIndex);
+	return FALSE;
+}
+
+/* <song>.idx, for freeing by the caller */
+static char *_midiIndexName(const char *pSongFilename)
+{
+	size_t len = strlen(pSongFilename);
+	char *pIdxName = (char *)malloc(len + 5);
+
+	if (pIdxName)
+	{
+		memcpy(pIdxName, pSongFilename, len);
+		memcpy(pIdxName + len, ".idx", 5);
+	}
+	return pIdxName;
+}
+
+/* Loads the index kept next to an opened song, as <song>.idx, building
+** and saving a new one if it isn't there or is out of date. Not being able
+** to save it (i.e. read only media) isn't an error. */
+BOOL midiIndexOpen(MIDI_INDEX *pIndex, _MIDI_FILE *pMF, const char *pSongFilename)
+{
+	char *pIdxName = _midiIndexName(pSongFilename);
+	BOOL bOK;
+
+	if (!pIdxName)
+		return FALSE;
+
+	bOK = midiIndexLoad(pIndex, pMF, pIdxName);
+	if (!bOK && (bOK = midiIndexBuild(pIndex, pMF)) != FALSE)
+		midiIndexSave(pIndex, pIdxName);
+
+	free(pIdxName);
+	return bOK;
+}
+
+/* Opens a song and its index together. With a good index the track table
+** comes from it, so only the header and the two ends of the song covered
+** by the checksum are read. Otherwise the song is opened as usual and the
+** index rebuilt, as midiIndexOpen(). On failure pMF is left closed. */
+BOOL midiIndexOpenSong(MIDI_INDEX *pIndex, _MIDI_FILE *pMF, const char *pSongFilename)
+{
+	char *pIdxName = _midiIndexName(pSongFilename);
+	BOOL bRead, bOK;
+
+	if (!pIdxName)
+		return FALSE;
+
+	bRead = midiIndexRead(pIndex, pIdxName);
+	midiFileOpenIndexed(pMF, pSongFilename, bRead ? pIndex : NULL, &bOK);
+	if (bOK && bRead && !_midiIndexMatches(pIndex, pMF))
+	{
+		/* Stale, so the track table it gave may be wrong too */
+		midiIndexFree(pIndex);
+		midiFileClose(pMF);
+		midiFileOpen(pMF, pSongFilename, &bOK);
+		bRead = FALSE;
+	}
+
+	if (bOK && !bRead)
+	{
+		if ((bOK = midiIndexBuild(pIndex, pMF)) != FALSE)
+			midiIndexSave(pIndex, pIdxName);
+		else
+			midiFileClose(pMF);
+	}
+	else if (!bOK && bRead)
+		midiIndexFree(pIndex);
+
+	free(pIdxName);
+	return bOK;
+}
@@ -0,0 +1,89 @@
+/*
+ * midiopt.c - Shrinks a MIDI file without changing how it plays, merges
+ *				its tracks into a format 0 file, or compiles it for a small
+ *				player.
+ *				Requires Steevs MIDI Library.
+ * Version 1.4
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of
+ *  the License,or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "midifile.h"
+
+static DWORD getFileSize(const char *pFilename)
+{
+	FILE *fp;
+	long sz;
+
+	if ((fp = fopen(pFilename, "rb")) == NULL)
+		return 0;
+	fseek(fp, 0, SEEK_END);
+	sz = ftell(fp);
+	fclose(fp);
+	return sz < 0 ? 0 : (DWORD)sz;
+}
+
+int main(int argc, char* argv[])
+{
+	_MIDI_FILE mf;
+	BOOL open_success, bOK, bFormat0 = FALSE, bCompile = FALSE;
+	DWORD dwIn, dwOut;
+
+	if (argc == 4 && strcmp(argv[1], "-0") == 0)
+		bFormat0 = TRUE;
+	else if (argc == 4 && strcmp(argv[1], "-c") == 0)
+		bCompile = TRUE;
+	if (bFormat0 || bCompile)
+	{
+		++argv;
+		--argc;
+	}
+	if (argc != 3)
+	{
+		printf("Usage: %s [-0|-c] <in filename> <out filename>\n", argv[0]);
+		printf("\t-0\tMerge all tracks into one format 0 track instead\n");
+		printf("\t-c\tCompile into timed messages for midiCompileGetNext() instead\n");
+		return 1;
+	}
+
+	midiFileOpen(&mf, argv[1], &open_success);
+	if (!open_success)
+	{
+		printf("Open Failed!\nInvalid MIDI-File Header!\n");
+		return 1;
+	}
+
+	dwIn = midiSourceGetSize(&mf.Src);
+	if (bCompile)
+		bOK = midiCompileFile(&mf, argv[2]);
+	else if (bFormat0)
+		bOK = midiConvertToFormat0(&mf, argv[2]);
+	else
+		bOK = midiOptimizeFile(&mf, argv[2]);
+	midiFileClose(&mf);
+
+	if (!bOK)
+	{
+		printf("Couldn't write %s\n", argv[2]);
+		return 1;
+	}
+
+	dwOut = getFileSize(argv[2]);
+	printf("%s: %lu -> %lu bytes (%lu%%)\n", argv[2], dwIn, dwOut, dwIn ? dwOut * 100 / dwIn : 0);
+	return 0;
+}
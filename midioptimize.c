@@ -0,0 +1,161 @@
+/*
+ * midioptimize.c - Size optimiser for Steevs MIDI Library. Re-encodes a
+ *					song in as few bytes as possible without changing how
+ *					it plays.
+ * Version 1.4
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of
+ *  the License,or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdlib.h>
+#include "midifile.h"
+
+
+/* Text events with nothing in them are only there to pass time, which the
+** next event's delta time can do just as well */
+static BOOL _midiOptimizeIsEmptyText(const _MIDI_FILE *pMF, const MIDI_EVENT *pEvent)
+{
+	BYTE b;
+
+	return pEvent->bData1 >= metaTextEvent && pEvent->bData1 <= metaCuePoint
+		&& midiReadGetEventPayloadPart(pMF, pEvent, 0, &b, 1) == 0;
+}
+
+/* Format 0 and 1 songs are read merged, as they play. Format 2 tracks are
+** separate patterns, so they're read one at a time, each starting from
+** nothing set. */
+static BOOL _midiOptimizeGetNext(const _MIDI_FILE *pMF, MIDI_MERGE *pMerge, int *piTrack, int iNum, MIDI_CHASE *pState, WORD *pwBankChanged, MIDI_EVENT *pEvent)
+{
+	if (pMF->Header.iVersion != 2)
+		return midiMergeGetNextEvent(pMerge, pEvent);
+
+	for(; *piTrack < iNum; ++*piTrack)
+	{
+		if (midiReadGetNextEvent(pMF, *piTrack, pEvent))
+			return TRUE;
+		midiChaseInit(pState);
+		*pwBankChanged = 0;
+	}
+	return FALSE;
+}
+
+/* Writes pMF to pFilename in its smallest form:
+**	- running status wherever possible (the writer always does this)
+**	- note offs as note ons with no volume, unless they carry a release velocity
+**	- controller, program, pressure and pitch wheel changes that don't
+**	  change anything are dropped, judged in playing order across all tracks
+**	  (or within each track for format 2)
+**	- empty text events go, their time joining the next event's
+**	- tracks left with nothing in them go, though the song still ends
+**	  when the longest of them did
+** Events are always written in the order they play, so a merge of the
+** result gives the same stream as a merge of the original. */
+BOOL midiOptimizeFile(const _MIDI_FILE *pMF, const char *pFilename)
+{
+	MIDI_READ_STATE Saved;
+	DWORD dwEnd[MAX_MIDI_TRACKS], dwSongEnd = 0;
+	BOOL bUsed[MAX_MIDI_TRACKS];
+	WORD wBankChanged = 0;			/* a program change must follow, even if it's the same one */
+	_MIDI_FILE out;
+	MIDI_MERGE merge;
+	MIDI_CHASE state;
+	MIDI_EVENT ev;
+	BOOL bOK;
+	int i, iNum, iTrack = 0, iLongest = -1;
+
+	midiFileCreate(&out, pFilename, TRUE, &bOK);
+	if (!bOK)
+		return FALSE;
+	midiFileSetPPQN(&out, pMF->Header.PPQN);
+	midiFileSetVersion(&out, pMF->Header.iVersion);
+
+	iNum = midiReadRewind(pMF, &Saved, NULL);
+	for(i=0; i < iNum; ++i)
+	{
+		dwEnd[i] = 0;
+		bUsed[i] = FALSE;
+	}
+
+	midiChaseInit(&state);
+	midiMergeInit(&merge, pMF);
+
+	while(bOK && _midiOptimizeGetNext(pMF, &merge, &iTrack, iNum, &state, &wBankChanged, &ev))
+	{
+		i = ev.bTrack;
+		if (ev.dwAbsPos > dwEnd[i])
+			dwEnd[i] = ev.dwAbsPos;
+
+		if (ev.bStatus >= msgNoteOff && ev.bStatus < msgSysEx1)
+		{
+			int iChn = ev.bStatus & 0x0f;
+
+			if (midiChaseIsRedundant(&state, &ev) && !((ev.bStatus & 0xf0) == msgSetProgram && (wBankChanged & (1 << iChn))))
+				continue;
+			midiChaseUpdateEvent(&state, pMF, &ev);
+
+			if ((ev.bStatus & 0xf0) == msgSetParameter && (ev.bData1 == ccBankSelect || ev.bData1 == ccBankSelectLSB))
+				wBankChanged |= 1 << iChn;
+			else if ((ev.bStatus & 0xf0) == msgSetProgram)
+				wBankChanged &= ~(1 << iChn);
+
+			if ((ev.bStatus & 0xf0) == msgNoteOff && (ev.bData2 == 0 || ev.bData2 == 64))
+			{
+				/* 64 is what's sent when there's no release velocity */
+				ev.bStatus = (BYTE)(msgNoteOn | iChn);
+				ev.bData2 = 0;
+			}
+		}
+		else if (ev.bStatus == msgMetaEvent || ev.bStatus == msgSysEx1 || ev.bStatus == msgSysEx2)
+		{
+			if (ev.bStatus == msgMetaEvent && (ev.bData1 == metaEndSequence || _midiOptimizeIsEmptyText(pMF, &ev)))
+				continue;
+			midiChaseUpdateEvent(&state, pMF, &ev);
+		}
+		else
+		{
+			continue;		/* system messages have no place in a file */
+		}
+
+		/* Moved on by absolute time, as the gap needn't fit an int */
+		bOK = midiFileFlushTrack(&out, i, FALSE, ev.dwAbsPos)
+			&& midiTrackAddEvent(&out, i, pMF, &ev);
+		bUsed[i] = TRUE;
+	}
+
+	/* In format 0 and 1 the tracks play together, so if the one ending last
+	** has gone, the longest left is stretched to end there instead */
+	if (pMF->Header.iVersion != 2 && iNum)
+	{
+		for(i=0; i < iNum; ++i)
+		{
+			if (dwEnd[i] > dwSongEnd)
+				dwSongEnd = dwEnd[i];
+			if (bUsed[i] && (iLongest < 0 || dwEnd[i] > dwEnd[iLongest]))
+				iLongest = i;
+		}
+		if (iLongest < 0)
+			iLongest = 0;
+		bUsed[iLongest] = TRUE;
+		dwEnd[iLongest] = dwSongEnd;
+	}
+
+	/* Each track still ends where it did, so the song keeps its length */
+	for(i=0; i < iNum && bOK; ++i)
+		if (bUsed[i])
+			bOK = midiFileFlushTrack(&out, i, FALSE, dwEnd[i]) && midiSongAddEndSequence(&out, i);
+
+	midiReadRestore(pMF, &Saved);
+	return midiFileClose(&out) && bOK;
+}
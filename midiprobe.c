@@ -0,0 +1,159 @@
+/*
+ * midiprobe.c - Song details for Steevs MIDI Library. Gets what a
+ *				 catalogue needs from a file by decoding only its meta
+ *				 events.
+ * Version 1.4
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of
+ *  the License,or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "midifile.h"
+
+
+static void _midiProbeGetText(const _MIDI_FILE *pMF, const MIDI_EVENT *pEvent, char *pText)
+{
+	DWORD n = midiReadGetEventPayloadPart(pMF, pEvent, 0, (BYTE *)pText, MIDI_PROBE_TEXT - 1);
+
+	pText[n] = '\0';
+}
+
+/* Fills in pProbe from pMF's header and meta events. With bQuick set each
+** track is only read until it is past the earliest tempo found so far,
+** and the first until the title has turned up too, which is usually the
+** first few events of each; bComplete then says whether the end of the
+** song was reached, and with it the duration. The file's read positions
+** are left as they were. */
+BOOL midiProbeGetInfo(MIDI_PROBE *pProbe, const _MIDI_FILE *pMF, BOOL bQuick)
+{
+	MIDI_TEMPO_CHANGE *pTempos = NULL;
+	MIDI_READ_STATE Saved;
+	MIDI_FILTER filter;
+	MIDI_EVENT ev;
+	BYTE bTmp[4];
+	DWORD dwTempo, dwTempoPos = 0, dwSigPos = 0, dwKeyPos = 0;
+	BOOL bTitle = FALSE, bTempo = FALSE, bCut = FALSE, bOK = TRUE;
+	int i, iNum, iNumTempos = 0, iAlloc = 0;
+
+	memset(pProbe, 0, sizeof(*pProbe));
+	pProbe->wFormat = pMF->Header.iVersion;
+	pProbe->wNumTracks = pMF->Header.iNumTracks;
+	pProbe->wPPQN = pMF->Header.PPQN;
+	pProbe->dwTempo = 500000;
+
+	midiFilterInit(&filter, FALSE);
+	midiFilterSetMsg(&filter, msgMetaEvent, TRUE);
+	midiFilterSetMeta(&filter, metaTrackName, TRUE);
+	midiFilterSetMeta(&filter, metaCopyright, TRUE);
+	midiFilterSetMeta(&filter, metaSetTempo, TRUE);
+	midiFilterSetMeta(&filter, metaTimeSig, TRUE);
+	midiFilterSetMeta(&filter, metaKeySig, TRUE);
+	midiFilterSetMeta(&filter, metaEndSequence, TRUE);
+
+	iNum = midiReadRewind(pMF, &Saved, &filter);
+	for(i=0; i < iNum && bOK; ++i)
+	{
+		while(bOK && midiReadGetNextEvent(pMF, i, &ev))
+		{
+			/* Nothing further on in this track can be the initial tempo */
+			if (bQuick && bTempo && ev.dwAbsPos > dwTempoPos && (i > 0 || bTitle))
+			{
+				bCut = TRUE;
+				break;
+			}
+
+			switch(ev.bData1)
+			{
+			case	metaTrackName:
+				if (i == 0 && !bTitle)
+				{
+					_midiProbeGetText(pMF, &ev, pProbe->szTitle);
+					bTitle = TRUE;
+				}
+				break;
+
+			case	metaCopyright:
+				if (!pProbe->szCopyright[0])
+					_midiProbeGetText(pMF, &ev, pProbe->szCopyright);
+				break;
+
+			case	metaSetTempo:
+				if (midiTempoGetEventTempo(pMF, &ev, &dwTempo))
+				{
+					/* The last of several at the earliest time is the one that plays */
+					if (!bTempo || ev.dwAbsPos <= dwTempoPos)
+					{
+						pProbe->dwTempo = dwTempo;
+						dwTempoPos = ev.dwAbsPos;
+						bTempo = TRUE;
+					}
+					bOK = midiTempoAddChange(&pTempos, &iNumTempos, &iAlloc, ev.dwAbsPos, dwTempo);
+				}
+				break;
+
+			case	metaTimeSig:
+				if ((!pProbe->iTimeSigNom || ev.dwAbsPos < dwSigPos) && midiReadGetEventPayloadPart(pMF, &ev, 0, bTmp, 2) == 2)
+				{
+					pProbe->iTimeSigNom = bTmp[0];
+					pProbe->iTimeSigDenom = 1 << (bTmp[1] & 0x0f);
+					dwSigPos = ev.dwAbsPos;
+				}
+				break;
+
+			case	metaKeySig:
+				if ((!pProbe->bHaveKeySig || ev.dwAbsPos < dwKeyPos) && midiReadGetEventPayloadPart(pMF, &ev, 0, bTmp, 2) == 2)
+				{
+					/* Same encoding as MIDI_MSG's KeySig.iKey */
+					if (bTmp[0] & 0x80)
+						pProbe->iKeySig = (tMIDI_KEYSIG)(((256 - bTmp[0]) & keyMaskKey) | keyMaskNeg);
+					else
+						pProbe->iKeySig = (tMIDI_KEYSIG)(bTmp[0] & keyMaskKey);
+					if (bTmp[1])
+						pProbe->iKeySig = (tMIDI_KEYSIG)(pProbe->iKeySig | keyMaskMin);
+					pProbe->bHaveKeySig = TRUE;
+					dwKeyPos = ev.dwAbsPos;
+				}
+				break;
+			}
+
+			if (ev.dwAbsPos > pProbe->dwEndPos)
+				pProbe->dwEndPos = ev.dwAbsPos;
+		}
+
+		if (pMF->Track[i].pos > pProbe->dwEndPos)
+			pProbe->dwEndPos = pMF->Track[i].pos;
+	}
+	midiReadRestore(pMF, &Saved);
+
+	if (bOK && !bCut)
+	{
+		MIDI_TEMPO_MAP map;
+
+		pProbe->bComplete = TRUE;
+		if (midiTempoBuildFromList(&map, pProbe->wPPQN, pTempos, iNumTempos))
+		{
+			pProbe->qwDuration = midiTempoTickToMicros(&map, pProbe->dwEndPos);
+			midiTempoFree(&map);
+		}
+	}
+	else
+	{
+		pProbe->dwEndPos = 0;
+	}
+
+	free(pTempos);
+	return bOK;
+}
@@ -0,0 +1,172 @@
+/*
+ * midiseek.c - Seeking for Steevs MIDI Library. Keeps snapshots of each
+ *				track's read state so playback can start anywhere in a song
+ *				without decoding everything before it.
+ * Version 1.4
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of
+ *  the License,or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "midifile.h"
+
+
+static BOOL _midiSeekAddPoint(MIDI_SEEK_TRACK *pSeek, const MIDI_FILE_TRACK *pTrack)
+{
+	MIDI_SEEK_POINT *pPoint;
+
+	if (pSeek->iCount == pSeek->iAlloc)
+	{
+		int iAlloc = pSeek->iAlloc ? pSeek->iAlloc * 2 : 64;
+		void *p = realloc(pSeek->pPoints, iAlloc * sizeof(MIDI_SEEK_POINT));
+
+		if (!p)
+			return FALSE;
+		pSeek->pPoints = (MIDI_SEEK_POINT *)p;
+		pSeek->iAlloc = iAlloc;
+	}
+
+	pPoint = &pSeek->pPoints[pSeek->iCount++];
+	pPoint->ptr2 = pTrack->ptr2;
+	pPoint->pos = pTrack->pos;
+	pPoint->last_status = pTrack->last_status;
+	return TRUE;
+}
+
+/* Walks every track once, taking a snapshot every dwEvery events, or every
+** dwEvery ticks if bTicks is set. The file's read positions are left as
+** they were. */
+BOOL midiSeekBuildIndex(MIDI_SEEK_INDEX *pIndex, const _MIDI_FILE *pMF, DWORD dwEvery, BOOL bTicks)
+{
+	MIDI_READ_STATE Saved;
+	const MIDI_FILE_TRACK *pTrack;
+	MIDI_EVENT ev;
+	DWORD dwCount, dwLastPos;
+	BOOL bOK = TRUE;
+	int iTrack;
+
+	memset(pIndex, 0, sizeof(*pIndex));
+	if (!dwEvery)
+		dwEvery = 1;
+
+	pIndex->iNumTracks = midiReadRewind(pMF, &Saved, pMF->pFilter);
+	for(iTrack=0; iTrack < pIndex->iNumTracks && bOK; ++iTrack)
+	{
+		pTrack = &pMF->Track[iTrack];
+
+		bOK = _midiSeekAddPoint(&pIndex->Track[iTrack], pTrack);
+		dwCount = 0;
+		dwLastPos = 0;
+		while(bOK && midiReadGetNextEvent(pMF, iTrack, &ev))
+		{
+			if (bTicks ? pTrack->pos - dwLastPos >= dwEvery : ++dwCount == dwEvery)
+			{
+				bOK = _midiSeekAddPoint(&pIndex->Track[iTrack], pTrack);
+				dwCount = 0;
+				dwLastPos = pTrack->pos;
+			}
+		}
+	}
+	midiReadRestore(pMF, &Saved);
+
+	if (!bOK)
+		midiSeekFreeIndex(pIndex);
+	return bOK;
+}
+
+void midiSeekFreeIndex(MIDI_SEEK_INDEX *pIndex)
+{
+	int i;
+
+	for(i=0; i < MAX_MIDI_TRACKS; ++i)
+		free(pIndex->Track[i].pPoints);
+	free(pIndex->pChase);
+	memset(pIndex, 0, sizeof(*pIndex));
+}
+
+/* Positions every track so that the next event read is the first one at
+** or after dwTick. Without an index each track is decoded from its start.
+** Any MIDI_MERGE on the file has to be initialised again afterwards. */
+BOOL midiSeekToTick(_MIDI_FILE *pMF, const MIDI_SEEK_INDEX *pIndex, DWORD dwTick)
+{
+	MIDI_FILE_TRACK Saved, *pTrack;
+	MIDI_EVENT ev;
+	int iTrack, iNum;
+
+	iNum = midiReadGetNumTracks(pMF);
+	if (iNum > MAX_MIDI_TRACKS)
+		iNum = MAX_MIDI_TRACKS;
+
+	for(iTrack=0; iTrack < iNum; ++iTrack)
+	{
+		pTrack = &pMF->Track[iTrack];
+
+		if (pIndex && iTrack < pIndex->iNumTracks && pIndex->Track[iTrack].iCount)
+		{
+			const MIDI_SEEK_TRACK *pSeek = &pIndex->Track[iTrack];
+			int lo = 0, hi = pSeek->iCount - 1, mid;
+
+			/* Last snapshot strictly before dwTick, as events at dwTick
+			** itself may come just before a snapshot taken at dwTick */
+			while(lo < hi)
+			{
+				mid = (lo + hi + 1) / 2;
+				if (pSeek->pPoints[mid].pos < dwTick)
+					lo = mid;
+				else
+					hi = mid - 1;
+			}
+
+			pTrack->ptr2 = pSeek->pPoints[lo].ptr2;
+			pTrack->pos = pSeek->pPoints[lo].pos;
+			pTrack->last_status = pSeek->pPoints[lo].last_status;
+			pTrack->bFailed = FALSE;
+		}
+		else
+		{
+			midiReadRewindTrack(pMF, iTrack);
+		}
+
+		/* Decode forward, stopping just short of the first event due */
+		for(;;)
+		{
+			Saved = *pTrack;
+			if (!midiReadGetNextEvent(pMF, iTrack, &ev))
+				break;
+			if (ev.dwAbsPos >= dwTick)
+			{
+				*pTrack = Saved;
+				break;
+			}
+		}
+	}
+
+	return TRUE;
+}
+
+/* As midiSeekToTick(), for the first event at or after qwMicros into the
+** song. The tempo map turns the time into a tick, then the index does the
+** rest, so nothing before the target is decoded. */
+BOOL midiSeekToMicros(_MIDI_FILE *pMF, const MIDI_SEEK_INDEX *pIndex, const MIDI_TEMPO_MAP *pMap, QWORD qwMicros)
+{
+	DWORD dwTick = midiTempoMicrosToTick(pMap, qwMicros);
+
+	/* That's the last tick at or before the time; we want the first one at or after */
+	if (midiTempoTickToMicros(pMap, dwTick) < qwMicros && dwTick != 0xffffffffUL)
+		++dwTick;
+
+	return midiSeekToTick(pMF, pIndex, dwTick);
+}
@@ -0,0 +1,402 @@
+/*
+ * midisrc.c - Byte sources for Steevs MIDI Library. Everything the reader
+ *				needs from a MIDI file is fetched through one of these, so
+ *				the parser itself never calls stdio.
+ * Version 1.4
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of
+ *  the License,or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <windows.h>
+#define MIDI_HAVE_MMAP
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define MIDI_HAVE_MMAP
+#endif
+#include "midifile.h"
+
+
+/*
+** stdio backend
+*/
+static BOOL _midiSourceFileOpen(MIDI_SOURCE *pSrc, const void *pParam)
+{
+	FILE *fp = fopen((const char *)pParam, "rb");
+
+	if (!fp)
+		return FALSE;
+
+	/* We do our own buffering in the sector cache, so stdio's would only
+	** mean every byte gets copied twice */
+	setvbuf(fp, NULL, _IONBF, 0);
+
+	pSrc->pHandle = fp;
+	return TRUE;
+}
+
+static DWORD _midiSourceFileReadAt(MIDI_SOURCE *pSrc, DWORD pos, void *pDst, DWORD length)
+{
+	FILE *fp = (FILE *)pSrc->pHandle;
+
+	if (fseek(fp, pos, SEEK_SET))
+		return 0;
+
+	return (DWORD)fread(pDst, 1, length, fp);
+}
+
+static DWORD _midiSourceFileSize(MIDI_SOURCE *pSrc)
+{
+	FILE *fp = (FILE *)pSrc->pHandle;
+	long sz;
+
+	if (fseek(fp, 0, SEEK_END))
+		return 0;
+	sz = ftell(fp);
+
+	return sz < 0 ? 0 : (DWORD)sz;
+}
+
+static void _midiSourceFileClose(MIDI_SOURCE *pSrc)
+{
+	fclose((FILE *)pSrc->pHandle);
+}
+
+const MIDI_SOURCE_FUNCS midiSourceFile = {
+	_midiSourceFileOpen,
+	_midiSourceFileReadAt,
+	_midiSourceFileSize,
+	_midiSourceFileClose
+};
+
+
+/*
+** Memory mapped backend. The whole file is visible through pMem, so the
+** reader never copies anything and payloads can point into the mapping.
+*/
+static BOOL _midiSourceMapOpen(MIDI_SOURCE *pSrc, const void *pParam)
+{
+#if defined(_WIN32)
+	HANDLE hFile, hMap;
+	DWORD sz;
+	void *p = NULL;
+
+	hFile = CreateFileA((const char *)pParam, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	sz = GetFileSize(hFile, NULL);
+	hMap = sz && sz != INVALID_FILE_SIZE ? CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	if (hMap)
+	{
+		p = MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, 0);
+		CloseHandle(hMap);		/* the view keeps the mapping alive */
+	}
+	CloseHandle(hFile);
+
+	if (!p)
+		return FALSE;
+#elif defined(MIDI_HAVE_MMAP)
+	struct stat st;
+	DWORD sz;
+	void *p;
+	int fd = open((const char *)pParam, O_RDONLY);
+
+	if (fd < 0)
+		return FALSE;
+
+	if (fstat(fd, &st) || st.st_size <= 0)
+	{
+		close(fd);
+		return FALSE;
+	}
+
+	sz = (DWORD)st.st_size;
+	p = mmap(NULL, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);				/* the mapping keeps the file alive */
+
+	if (p == MAP_FAILED)
+		return FALSE;
+#ifdef MADV_SEQUENTIAL
+	madvise(p, sz, MADV_SEQUENTIAL);
+#endif
+#endif
+
+#ifdef MIDI_HAVE_MMAP
+	pSrc->pHandle = p;
+	pSrc->pMem = (const BYTE *)p;
+	pSrc->dwSize = sz;
+	return TRUE;
+#else
+	return FALSE;
+#endif
+}
+
+static DWORD _midiSourceMemReadAt(MIDI_SOURCE *pSrc, DWORD pos, void *pDst, DWORD length)
+{
+	if (pos >= pSrc->dwSize)
+		return 0;
+	if (length > pSrc->dwSize - pos)
+		length = pSrc->dwSize - pos;
+
+	memcpy(pDst, pSrc->pMem + pos, length);
+	return length;
+}
+
+static DWORD _midiSourceMemSize(MIDI_SOURCE *pSrc)
+{
+	return pSrc->dwSize;		/* known since open */
+}
+
+static void _midiSourceMapClose(MIDI_SOURCE *pSrc)
+{
+#if defined(_WIN32)
+	UnmapViewOfFile(pSrc->pHandle);
+#elif defined(MIDI_HAVE_MMAP)
+	munmap(pSrc->pHandle, pSrc->dwSize);
+#endif
+}
+
+const MIDI_SOURCE_FUNCS midiSourceMapped = {
+	_midiSourceMapOpen,
+	_midiSourceMemReadAt,
+	_midiSourceMemSize,
+	_midiSourceMapClose
+};
+
+
+/*
+** Memory backend. Decodes in place from a caller supplied buffer, which
+** may be const data in flash. Nothing is ever copied or freed.
+*/
+static BOOL _midiSourceMemOpen(MIDI_SOURCE *pSrc, const void *pParam)
+{
+	const MIDI_SOURCE_MEM *pMem = (const MIDI_SOURCE_MEM *)pParam;
+
+	if (!pMem->pData)
+		return FALSE;
+
+	pSrc->pMem = pMem->pData;
+	pSrc->dwSize = pMem->dwSize;
+	return TRUE;
+}
+
+static void _midiSourceMemClose(MIDI_SOURCE *pSrc)
+{
+	/* The buffer belongs to the caller */
+	(void)pSrc;
+}
+
+const MIDI_SOURCE_FUNCS midiSourceMemory = {
+	_midiSourceMemOpen,
+	_midiSourceMemReadAt,
+	_midiSourceMemSize,
+	_midiSourceMemClose
+};
+
+
+/*
+** Sector cache
+*/
+static void _midiSourceCacheReset(MIDI_SOURCE *pSrc)
+{
+	int i;
+
+	for(i=0; i < pSrc->iCacheSectors; ++i)
+	{
+		pSrc->pCache[i].dwLen = 0;
+		pSrc->pCache[i].dwLastUse = 0;
+	}
+	pSrc->dwClock = 0;
+	pSrc->dwHits = 0;
+	pSrc->dwMisses = 0;
+}
+
+/* Makes the sector holding pos the read window, loading it over the least
+** recently used one if necessary. Returns FALSE if pos can't be read. */
+static BOOL _midiSourceCacheSelect(MIDI_SOURCE *pSrc, DWORD pos)
+{
+	DWORD dwSector = pos - pos % MIDI_SOURCE_SECTOR_SIZE;
+	int i, iVictim = -1;
+
+	for(i=0; i < pSrc->iCacheSectors; ++i)
+	{
+		if (pSrc->pCache[i].dwLen && pSrc->pCache[i].dwPos == dwSector)
+		{
+			++pSrc->dwHits;
+			break;
+		}
+		/* A free slot is always better than evicting a live sector */
+		if (iVictim < 0 || (pSrc->pCache[iVictim].dwLen && (!pSrc->pCache[i].dwLen || pSrc->pCache[i].dwLastUse < pSrc->pCache[iVictim].dwLastUse)))
+			iVictim = i;
+	}
+
+	if (i == pSrc->iCacheSectors)
+	{
+		i = iVictim;
+		++pSrc->dwMisses;
+		pSrc->pCache[i].dwPos = dwSector;
+		pSrc->pCache[i].dwLen = pSrc->pFuncs->readAt(pSrc, dwSector, pSrc->pCache[i].data, MIDI_SOURCE_SECTOR_SIZE);
+	}
+
+	pSrc->pCache[i].dwLastUse = ++pSrc->dwClock;
+	pSrc->pWin = pSrc->pCache[i].data;
+	pSrc->dwWinPos = pSrc->pCache[i].dwPos;
+	pSrc->dwWinLen = pSrc->pCache[i].dwLen;
+
+	return pos - pSrc->dwWinPos < pSrc->dwWinLen;
+}
+
+
+/*
+** Generic source handling
+*/
+BOOL midiSourceOpen(MIDI_SOURCE *pSrc, const MIDI_SOURCE_FUNCS *pFuncs, const void *pParam)
+{
+	return midiSourceOpenCached(pSrc, pFuncs, pParam, NULL, MIDI_SOURCE_CACHE_SECTORS);
+}
+
+/* As midiSourceOpen(), with iNumSectors sectors of cache. They are taken
+** from pCache, which must stay valid until the source is closed, or from
+** the heap if pCache is NULL. A directly addressable source uses neither. */
+BOOL midiSourceOpenCached(MIDI_SOURCE *pSrc, const MIDI_SOURCE_FUNCS *pFuncs, const void *pParam, MIDI_SOURCE_SECTOR *pCache, int iNumSectors)
+{
+	pSrc->pFuncs = pFuncs;
+	pSrc->pHandle = NULL;
+	pSrc->pMem = NULL;
+	pSrc->pWin = NULL;
+	pSrc->dwWinPos = 0;
+	pSrc->dwWinLen = 0;
+	pSrc->pCache = NULL;
+	pSrc->iCacheSectors = 0;
+	pSrc->bOwnCache = FALSE;
+
+	if (!pFuncs->open(pSrc, pParam))
+	{
+		pSrc->pFuncs = NULL;
+		return FALSE;
+	}
+
+	pSrc->dwSize = pFuncs->size(pSrc);
+
+	/* A directly addressable source is one big window that never moves */
+	if (pSrc->pMem)
+	{
+		pSrc->pWin = pSrc->pMem;
+		pSrc->dwWinLen = pSrc->dwSize;
+	}
+	else
+	{
+		if (iNumSectors < 1)
+			iNumSectors = 1;
+		if (!pCache)
+		{
+			pCache = (MIDI_SOURCE_SECTOR *)malloc(iNumSectors * sizeof(MIDI_SOURCE_SECTOR));
+			pSrc->bOwnCache = TRUE;
+		}
+		if (!pCache)
+		{
+			midiSourceClose(pSrc);
+			return FALSE;
+		}
+		pSrc->pCache = pCache;
+		pSrc->iCacheSectors = iNumSectors;
+	}
+
+	_midiSourceCacheReset(pSrc);
+	return TRUE;
+}
+
+/* Copies length bytes from pos. Anything past the end of the source
+** reads as zero, so callers can treat short reads like the old fread()
+** into a zeroed variable did. */
+DWORD midiSourceRead(MIDI_SOURCE *pSrc, DWORD pos, void *pDst, DWORD length)
+{
+	BYTE *pOut = (BYTE *)pDst;
+	DWORD done = 0;
+
+	while(done < length)
+	{
+		DWORD ofs = pos - pSrc->dwWinPos;
+
+		if (ofs < pSrc->dwWinLen)
+		{
+			DWORD n = pSrc->dwWinLen - ofs;
+
+			if (n > length - done)
+				n = length - done;
+			memcpy(pOut + done, pSrc->pWin + ofs, n);
+			done += n;
+			pos += n;
+		}
+		else if (pSrc->pMem || pos >= pSrc->dwSize)
+		{
+			break;		/* past the end */
+		}
+		else if (length - done >= MIDI_SOURCE_SECTOR_SIZE)
+		{
+			/* Big enough to go straight to the backend without flushing the cache */
+			++pSrc->dwMisses;
+			done += pSrc->pFuncs->readAt(pSrc, pos, pOut + done, length - done);
+			break;
+		}
+		else if (!_midiSourceCacheSelect(pSrc, pos))
+		{
+			break;
+		}
+	}
+
+	if (done < length)
+		memset(pOut + done, 0, length - done);
+
+	return done;
+}
+
+DWORD midiSourceGetSize(const MIDI_SOURCE *pSrc)
+{
+	return pSrc->dwSize;
+}
+
+void midiSourceGetCacheStats(const MIDI_SOURCE *pSrc, DWORD *pdwHits, DWORD *pdwMisses)
+{
+	*pdwHits = pSrc->dwHits;
+	*pdwMisses = pSrc->dwMisses;
+}
+
+void midiSourceClose(MIDI_SOURCE *pSrc)
+{
+	if (pSrc->pFuncs)
+		pSrc->pFuncs->close(pSrc);
+	if (pSrc->bOwnCache)
+		free(pSrc->pCache);
+	pSrc->pFuncs = NULL;
+	pSrc->pHandle = NULL;
+	pSrc->pMem = NULL;
+	pSrc->pWin = NULL;
+	pSrc->dwWinPos = 0;
+	pSrc->dwWinLen = 0;
+	pSrc->pCache = NULL;
+	pSrc->iCacheSectors = 0;
+	pSrc->bOwnCache = FALSE;
+	pSrc->dwClock = 0;
+	pSrc->dwHits = 0;
+	pSrc->dwMisses = 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * midistore.c - Columnar track store for Steevs MIDI Library. Decodes each
+ *				 track once into parallel arrays for code that makes many
+ *				 passes over the same file.
+ * Version 1.4
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of
+ *  the License,or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "midifile.h"
+
+
+#define MIDI_STORE_BATCH	32		/* events decoded per midiReadGetEvents() call */
+
+static BOOL _midiStoreGrow(MIDI_STORE_TRACK *pCol, int iNeed)
+{
+	int iAlloc = pCol->iAlloc ? pCol->iAlloc : 256;
+	void *p;
+
+	while(iAlloc < iNeed)
+		iAlloc *= 2;
+	if (iAlloc == pCol->iAlloc)
+		return TRUE;
+
+	/* Each column is grown separately, so a failure leaves the rest usable */
+	if ((p = realloc(pCol->pdwAbsPos, iAlloc * sizeof(DWORD))) == NULL)		return FALSE;
+	pCol->pdwAbsPos = (DWORD *)p;
+	if ((p = realloc(pCol->pbStatus, iAlloc)) == NULL)						return FALSE;
+	pCol->pbStatus = (BYTE *)p;
+	if ((p = realloc(pCol->pbData1, iAlloc)) == NULL)						return FALSE;
+	pCol->pbData1 = (BYTE *)p;
+	if ((p = realloc(pCol->pbData2, iAlloc)) == NULL)						return FALSE;
+	pCol->pbData2 = (BYTE *)p;
+	if ((p = realloc(pCol->pdwPayload, iAlloc * sizeof(DWORD))) == NULL)	return FALSE;
+	pCol->pdwPayload = (DWORD *)p;
+
+	pCol->iAlloc = iAlloc;
+	return TRUE;
+}
+
+/* Decodes every track of pMF from its start, whatever has been read of it
+** already. The file's read positions are left as they were, so this can be
+** mixed with the midiRead* functions. */
+BOOL midiStoreBuild(MIDI_STORE *pStore, const _MIDI_FILE *pMF)
+{
+	MIDI_READ_STATE Saved;
+	MIDI_EVENT Events[MIDI_STORE_BATCH];
+	BOOL bOK = TRUE;
+	int iTrack, i, n;
+
+	memset(pStore, 0, sizeof(*pStore));
+	pStore->iNumTracks = midiReadRewind(pMF, &Saved, pMF->pFilter);
+
+	for(iTrack=0; iTrack < pStore->iNumTracks && bOK; ++iTrack)
+	{
+		MIDI_STORE_TRACK *pCol = &pStore->Track[iTrack];
+
+		do
+		{
+			n = midiReadGetEvents(pMF, iTrack, Events, MIDI_STORE_BATCH);
+			if (!_midiStoreGrow(pCol, pCol->iCount + n))
+			{
+				bOK = FALSE;
+				break;
+			}
+
+			for(i=0; i < n; ++i)
+			{
+				pCol->pdwAbsPos[pCol->iCount] = Events[i].dwAbsPos;
+				pCol->pbStatus[pCol->iCount] = Events[i].bStatus;
+				pCol->pbData1[pCol->iCount] = Events[i].bData1;
+				pCol->pbData2[pCol->iCount] = Events[i].bData2;
+				pCol->pdwPayload[pCol->iCount] = Events[i].dwPayload;
+				++pCol->iCount;
+			}
+		} while(n == MIDI_STORE_BATCH);
+	}
+	midiReadRestore(pMF, &Saved);
+
+	if (!bOK)
+		midiStoreFree(pStore);
+	return bOK;
+}
+
+void midiStoreFree(MIDI_STORE *pStore)
+{
+	int i;
+
+	for(i=0; i < MAX_MIDI_TRACKS; ++i)
+	{
+		free(pStore->Track[i].pdwAbsPos);
+		free(pStore->Track[i].pbStatus);
+		free(pStore->Track[i].pbData1);
+		free(pStore->Track[i].pbData2);
+		free(pStore->Track[i].pdwPayload);
+	}
+	memset(pStore, 0, sizeof(*pStore));
+}
+
+/* Reassembles one row, e.g. to pass to midiReadGetEventPayload() */
+BOOL midiStoreGetEvent(const MIDI_STORE *pStore, int iTrack, int iEvent, MIDI_EVENT *pEvent)
+{
+	const MIDI_STORE_TRACK *pCol;
+
+	if (iTrack < 0 || iTrack >= pStore->iNumTracks)
+		return FALSE;
+	pCol = &pStore->Track[iTrack];
+	if (iEvent < 0 || iEvent >= pCol->iCount)
+		return FALSE;
+
+	pEvent->dwAbsPos = pCol->pdwAbsPos[iEvent];
+	pEvent->bStatus = pCol->pbStatus[iEvent];
+	pEvent->bData1 = pCol->pbData1[iEvent];
+	pEvent->bData2 = pCol->pbData2[iEvent];
+	pEvent->dwPayload = pCol->pdwPayload[iEvent];
+	pEvent->bTrack = (BYTE)iTrack;
+	return TRUE;
+}
+
+/* Number of events with exactly this status byte, e.g. 0x99 for note ons
+** on channel 10. Only the status column is touched. */
+int midiStoreCountStatus(const MIDI_STORE *pStore, int iTrack, BYTE bStatus)
+{
+	const BYTE *pbStatus;
+	int i, n, iCount = 0;
+
+	if (iTrack < 0 || iTrack >= pStore->iNumTracks)
+		return 0;
+
+	pbStatus = pStore->Track[iTrack].pbStatus;
+	n = pStore->Track[iTrack].iCount;
+	for(i=0; i < n; ++i)
+		iCount += pbStatus[i] == bStatus;
+
+	return iCount;
+}
+
+/* Tick of the last event in any track */
+DWORD midiStoreGetEndPos(const MIDI_STORE *pStore)
+{
+	DWORD dwEnd = 0;
+	int i;
+
+	for(i=0; i < pStore->iNumTracks; ++i)
+	{
+		const MIDI_STORE_TRACK *pCol = &pStore->Track[i];
+
+		if (pCol->iCount && pCol->pdwAbsPos[pCol->iCount - 1] > dwEnd)
+			dwEnd = pCol->pdwAbsPos[pCol->iCount - 1];
+	}
+	return dwEnd;
+}
@@ -0,0 +1,233 @@
+/*
+ * miditempo.c - Tempo map for Steevs MIDI Library. Converts between song
+ *				 position in ticks and real time in microseconds, exactly.
+ * Version 1.4
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of
+ *  the License,or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "midifile.h"
+
+
+#define MIDI_TEMPO_DEFAULT		500000		/* 120 BPM, until the song says otherwise */
+
+/* Adds a change to a list kept in time order, growing it as needed.
+** Tracks are usually scanned one after another, so a change can come
+** before ones already there; equal times stay in the order added. */
+BOOL midiTempoAddChange(MIDI_TEMPO_CHANGE **ppTempos, int *piNum, int *piAlloc, DWORD dwPos, DWORD dwTempo)
+{
+	MIDI_TEMPO_CHANGE *pTempos = *ppTempos;
+	int i;
+
+	if (*piNum == *piAlloc)
+	{
+		int iAlloc = *piAlloc ? *piAlloc * 2 : 16;
+		void *p = realloc(pTempos, iAlloc * sizeof(MIDI_TEMPO_CHANGE));
+
+		if (!p)
+			return FALSE;
+		*ppTempos = pTempos = (MIDI_TEMPO_CHANGE *)p;
+		*piAlloc = iAlloc;
+	}
+
+	for(i=*piNum; i > 0 && pTempos[i-1].dwPos > dwPos; --i)
+		pTempos[i] = pTempos[i-1];
+
+	pTempos[i].dwPos = dwPos;
+	pTempos[i].dwTempo = dwTempo;
+	++*piNum;
+	return TRUE;
+}
+
+/* TRUE if pEvent is a tempo change, with its microseconds per quarter note
+** in *pdwTempo */
+BOOL midiTempoGetEventTempo(const _MIDI_FILE *pMF, const MIDI_EVENT *pEvent, DWORD *pdwTempo)
+{
+	BYTE bTempo[3];
+
+	if (pEvent->bStatus != msgMetaEvent || pEvent->bData1 != metaSetTempo
+		|| midiReadGetEventPayloadPart(pMF, pEvent, 0, bTempo, 3) != 3)
+		return FALSE;
+
+	*pdwTempo = ((DWORD)bTempo[0] << 16) | ((DWORD)bTempo[1] << 8) | bTempo[2];
+	return TRUE;
+}
+
+/* Finds every tempo change in the song. The file's read positions are left
+** as they were. If a MIDI_INDEX is already loaded, midiTempoBuildFromList()
+** on its tempo list does the same without touching the file. */
+BOOL midiTempoBuild(MIDI_TEMPO_MAP *pMap, const _MIDI_FILE *pMF)
+{
+	MIDI_TEMPO_CHANGE *pTempos = NULL;
+	MIDI_READ_STATE Saved;
+	MIDI_EVENT ev;
+	DWORD dwTempo;
+	BOOL bOK = TRUE;
+	int i, iNum, iNumTempos = 0, iAlloc = 0;
+
+	/* The caller's filter may well hide the tempo changes */
+	iNum = midiReadRewind(pMF, &Saved, NULL);
+	for(i=0; i < iNum && bOK; ++i)
+	{
+		while(bOK && midiReadGetNextEvent(pMF, i, &ev))
+		{
+			if (midiTempoGetEventTempo(pMF, &ev, &dwTempo))
+				bOK = midiTempoAddChange(&pTempos, &iNumTempos, &iAlloc, ev.dwAbsPos, dwTempo);
+		}
+	}
+	midiReadRestore(pMF, &Saved);
+
+	if (bOK)
+		bOK = midiTempoBuildFromList(pMap, pMF->Header.PPQN, pTempos, iNumTempos);
+	else
+		memset(pMap, 0, sizeof(*pMap));
+
+	free(pTempos);
+	return bOK;
+}
+
+/* pTempos must be in time order, as MIDI_INDEX keeps them. wDivision is
+** straight from the file header, so SMPTE timing is handled here too. */
+BOOL midiTempoBuildFromList(MIDI_TEMPO_MAP *pMap, WORD wDivision, const MIDI_TEMPO_CHANGE *pTempos, int iNumTempos)
+{
+	MIDI_TEMPO_SEGMENT *pSeg;
+	int i, n;
+
+	memset(pMap, 0, sizeof(*pMap));
+
+	if (wDivision & 0x8000)
+	{
+		/* SMPTE: a fixed number of ticks per second and tempo changes
+		** don't apply. Treat a second as the 'quarter note'. */
+		int iFPS = -(signed char)(wDivision >> 8);
+		DWORD dwTPF = wDivision & 0xff;
+
+		pMap->pSegments = (MIDI_TEMPO_SEGMENT *)malloc(sizeof(MIDI_TEMPO_SEGMENT));
+		if (!pMap->pSegments)
+			return FALSE;
+		pMap->iNumSegments = 1;
+		pMap->pSegments[0].dwPos = 0;
+		pMap->pSegments[0].qwStart = 0;
+		if (iFPS == 29)
+		{
+			/* 29.97 drop frame: 30 frames take 1.001 seconds */
+			pMap->dwDivision = 30 * dwTPF;
+			pMap->pSegments[0].dwTempo = 1001000;
+		}
+		else
+		{
+			pMap->dwDivision = iFPS * dwTPF;
+			pMap->pSegments[0].dwTempo = 1000000;
+		}
+		if (!pMap->dwDivision)
+		{
+			midiTempoFree(pMap);
+			return FALSE;
+		}
+		return TRUE;
+	}
+
+	if (!wDivision)
+		return FALSE;
+
+	pMap->dwDivision = wDivision;
+	pMap->pSegments = (MIDI_TEMPO_SEGMENT *)malloc((iNumTempos + 1) * sizeof(MIDI_TEMPO_SEGMENT));
+	if (!pMap->pSegments)
+		return FALSE;
+
+	pSeg = pMap->pSegments;
+	pSeg->dwPos = 0;
+	pSeg->dwTempo = MIDI_TEMPO_DEFAULT;
+	pSeg->qwStart = 0;
+	n = 1;
+
+	for(i=0; i < iNumTempos; ++i)
+	{
+		if (pTempos[i].dwPos == pSeg->dwPos)
+		{
+			/* Several changes at once; the last one is what plays */
+			pSeg->dwTempo = pTempos[i].dwTempo;
+			continue;
+		}
+
+		pSeg[1].dwPos = pTempos[i].dwPos;
+		pSeg[1].dwTempo = pTempos[i].dwTempo;
+		pSeg[1].qwStart = pSeg->qwStart + (QWORD)(pTempos[i].dwPos - pSeg->dwPos) * pSeg->dwTempo;
+		++pSeg;
+		++n;
+	}
+
+	pMap->iNumSegments = n;
+	return TRUE;
+}
+
+void midiTempoFree(MIDI_TEMPO_MAP *pMap)
+{
+	free(pMap->pSegments);
+	memset(pMap, 0, sizeof(*pMap));
+}
+
+/* Time of dwTick from the start of the song, rounded down */
+QWORD midiTempoTickToMicros(const MIDI_TEMPO_MAP *pMap, DWORD dwTick)
+{
+	const MIDI_TEMPO_SEGMENT *pSeg;
+	int lo = 0, hi = pMap->iNumSegments - 1, mid;
+
+	if (hi < 0)
+		return 0;
+
+	/* Last segment starting at or before dwTick */
+	while(lo < hi)
+	{
+		mid = (lo + hi + 1) / 2;
+		if (pMap->pSegments[mid].dwPos <= dwTick)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	pSeg = &pMap->pSegments[lo];
+	return (pSeg->qwStart + (QWORD)(dwTick - pSeg->dwPos) * pSeg->dwTempo) / pMap->dwDivision;
+}
+
+/* Last tick at or before qwMicros from the start of the song */
+DWORD midiTempoMicrosToTick(const MIDI_TEMPO_MAP *pMap, QWORD qwMicros)
+{
+	const MIDI_TEMPO_SEGMENT *pSeg;
+	QWORD qwTime, qwTicks;
+	int lo = 0, hi = pMap->iNumSegments - 1, mid;
+
+	if (hi < 0)
+		return 0;
+
+	qwTime = qwMicros * pMap->dwDivision;
+	while(lo < hi)
+	{
+		mid = (lo + hi + 1) / 2;
+		if (pMap->pSegments[mid].qwStart <= qwTime)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	pSeg = &pMap->pSegments[lo];
+	if (!pSeg->dwTempo)
+		return pSeg->dwPos;		/* time stands still, so we never leave here */
+
+	qwTicks = pSeg->dwPos + (qwTime - pSeg->qwStart) / pSeg->dwTempo;
+	return qwTicks > 0xffffffffUL ? 0xffffffffUL : (DWORD)qwTicks;
+}
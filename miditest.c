@@ -0,0 +1,1041 @@
+/*
+ * miditest.c - Self checks for Steevs MIDI Library. Builds small songs in
+ *				memory or in temporary files and checks what each part of
+ *				the library makes of them. Exits with 1 if anything fails.
+ *				Requires Steevs MIDI Library.
+ * Version 1.4
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License as
+ *  published by the Free Software Foundation; either version 2 of
+ *  the License,or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "midifile.h"
+
+#define TEST_FILE		"miditest.mid"		/* scratch file, removed again */
+
+static int iChecks = 0, iFailures = 0;
+
+#define CHECK(_x)		checkResult((_x) != 0, #_x, __LINE__)
+
+static void checkResult(BOOL bOK, const char *pExpr, int iLine)
+{
+	++iChecks;
+	if (!bOK)
+	{
+		++iFailures;
+		printf("miditest.c(%d): failed: %s\n", iLine, pExpr);
+	}
+}
+
+/*
+** Test songs
+*/
+typedef struct {
+	const BYTE	*pData;			/* track events, without the MTrk header */
+	DWORD		dwSize;
+} TEST_TRACK;
+
+#define TEST_TRACK_OF(_a)	{ _a, sizeof(_a) }
+
+static const BYTE trkNotes[] = {
+	0x00, 0x90, 60, 100,
+	0x60, 0x80, 60, 0,
+	0x00, 0xff, 0x2f, 0x00
+};
+
+/* Writes a whole file into pOut, returning its size */
+static DWORD buildFile(BYTE *pOut, int iVersion, int iPPQN, const TEST_TRACK *pTracks, int iNumTracks)
+{
+	BYTE *p = pOut;
+	int i;
+
+	memcpy(p, "MThd\0\0\0\6", 8);
+	p[8] = 0;
+	p[9] = (BYTE)iVersion;
+	p[10] = 0;
+	p[11] = (BYTE)iNumTracks;
+	p[12] = (BYTE)(iPPQN >> 8);
+	p[13] = (BYTE)iPPQN;
+	p += 14;
+
+	for(i=0; i < iNumTracks; ++i)
+	{
+		memcpy(p, "MTrk", 4);
+		p[4] = (BYTE)(pTracks[i].dwSize >> 24);
+		p[5] = (BYTE)(pTracks[i].dwSize >> 16);
+		p[6] = (BYTE)(pTracks[i].dwSize >> 8);
+		p[7] = (BYTE)pTracks[i].dwSize;
+		memcpy(p + 8, pTracks[i].pData, pTracks[i].dwSize);
+		p += 8 + pTracks[i].dwSize;
+	}
+
+	return (DWORD)(p - pOut);
+}
+
+static BOOL writeBytes(const char *pFilename, const BYTE *pData, DWORD dwSize)
+{
+	FILE *fp = fopen(pFilename, "wb");
+	BOOL bOK;
+
+	if (!fp)
+		return FALSE;
+	bOK = fwrite(pData, 1, dwSize, fp) == dwSize;
+	return fclose(fp) == 0 && bOK;
+}
+
+/* Reads a track to its end, returning the number of messages */
+static int readAll(_MIDI_FILE *pMF, int iTrack)
+{
+	MIDI_MSG msg;
+	int n = 0;
+
+	midiReadInitMessage(&msg);
+	while(midiReadGetNextMessage(pMF, iTrack, &msg))
+		++n;
+	midiReadFreeMessage(&msg);
+	return n;
+}
+
+
+/* Fills pOut with iNotes notes on iChannel (0-15), ending the track.
+** Returns the number of bytes. */
+static DWORD makeNotes(BYTE *pOut, int iNotes, int iChannel, int iStep)
+{
+	BYTE *p = pOut;
+	int i;
+
+	for(i=0; i < iNotes; ++i)
+	{
+		*p++ = 0;
+		*p++ = (BYTE)(0x90 | iChannel);
+		*p++ = (BYTE)(36 + i % 48);
+		*p++ = (BYTE)(1 + i % 127);
+		*p++ = (BYTE)iStep;
+		*p++ = (BYTE)(0x80 | iChannel);
+		*p++ = (BYTE)(36 + i % 48);
+		*p++ = 0;
+	}
+	memcpy(p, "\0\xff\x2f\0", 4);
+	return (DWORD)(p + 4 - pOut);
+}
+
+/*
+** Byte sources: data cut off by the end of the file is an error, not a
+** short read
+*/
+static void testTruncatedData(void)
+{
+	static const BYTE trkText[] = { 0x00, 0xff, 0x01, 0x10, 'c', 'u', 't' };
+	TEST_TRACK track = TEST_TRACK_OF(trkNotes);
+	BYTE buf[64];
+	_MIDI_FILE mf;
+	DWORD dwSize;
+	BOOL bOK;
+
+	/* The whole file reads cleanly */
+	dwSize = buildFile(buf, 0, 96, &track, 1);
+	midiFileOpenMemory(&mf, buf, dwSize, &bOK);
+	CHECK(bOK);
+	CHECK(readAll(&mf, 0) == 3);
+	CHECK(!midiReadFailed(&mf, 0));
+	midiFileClose(&mf);
+
+	/* Cut in the middle of the note off */
+	midiFileOpenMemory(&mf, buf, 14 + 8 + 6, &bOK);
+	CHECK(bOK);
+	CHECK(readAll(&mf, 0) == 1);
+	CHECK(midiReadFailed(&mf, 0));
+	midiFileClose(&mf);
+
+	/* A meta event longer than what's left, from memory and from a file */
+	track.pData = trkText;
+	track.dwSize = sizeof(trkText);
+	dwSize = buildFile(buf, 0, 96, &track, 1);
+	midiFileOpenMemory(&mf, buf, dwSize, &bOK);
+	CHECK(readAll(&mf, 0) == 0);
+	CHECK(midiReadFailed(&mf, 0));
+	midiFileClose(&mf);
+
+	CHECK(writeBytes(TEST_FILE, buf, dwSize));
+	midiFileOpen(&mf, TEST_FILE, &bOK);
+	CHECK(bOK);
+	CHECK(readAll(&mf, 0) == 0);
+	CHECK(midiReadFailed(&mf, 0));
+	midiFileClose(&mf);
+	remove(TEST_FILE);
+}
+
+
+/*
+** Byte sources: a caller supplied cache of any size reads the same as
+** memory, and memory sources have no cache at all
+*/
+static void testSourceCache(void)
+{
+	static BYTE trk1[8 * 300 + 4], trk2[8 * 300 + 4], buf[14 + 2 * (8 + sizeof(trk1))];
+	static MIDI_SOURCE_SECTOR Cache[1];
+	TEST_TRACK tracks[2];
+	_MIDI_FILE mfMem, mfFile;
+	MIDI_EVENT evMem, evFile;
+	DWORD dwSize;
+	BOOL bOK, bMore;
+	int i, iMismatches = 0;
+
+	tracks[0].pData = trk1;
+	tracks[0].dwSize = makeNotes(trk1, 300, 0, 10);
+	tracks[1].pData = trk2;
+	tracks[1].dwSize = makeNotes(trk2, 300, 1, 7);
+	dwSize = buildFile(buf, 1, 96, tracks, 2);
+	CHECK(writeBytes(TEST_FILE, buf, dwSize));
+
+	midiFileOpenMemory(&mfMem, buf, dwSize, &bOK);
+	CHECK(bOK);
+	CHECK(mfMem.Src.pCache == NULL);
+	midiFileOpenCached(&mfFile, TEST_FILE, Cache, 1, &bOK);
+	CHECK(bOK);
+	CHECK(mfFile.Src.pCache == Cache && !mfFile.Src.bOwnCache);
+
+	/* Both tracks in turn, so the one sector is always being replaced */
+	do
+	{
+		bMore = FALSE;
+		for(i=0; i < 2; ++i)
+		{
+			if (midiReadGetNextEvent(&mfMem, i, &evMem))
+			{
+				bMore = TRUE;
+				if (!midiReadGetNextEvent(&mfFile, i, &evFile) || evMem.dwAbsPos != evFile.dwAbsPos
+					|| evMem.bStatus != evFile.bStatus || evMem.bData1 != evFile.bData1 || evMem.bData2 != evFile.bData2)
+					++iMismatches;
+			}
+		}
+	} while(bMore);
+	CHECK(iMismatches == 0);
+	CHECK(!midiReadGetNextEvent(&mfFile, 0, &evFile) && !midiReadGetNextEvent(&mfFile, 1, &evFile));
+
+	midiFileClose(&mfFile);
+	midiFileClose(&mfMem);
+
+	/* The default cache comes from the heap */
+	midiFileOpen(&mfFile, TEST_FILE, &bOK);
+	CHECK(bOK);
+	CHECK(mfFile.Src.pCache != NULL && mfFile.Src.bOwnCache && mfFile.Src.iCacheSectors == MIDI_SOURCE_CACHE_SECTORS);
+	CHECK(readAll(&mfFile, 1) == 601);
+	midiFileClose(&mfFile);
+	remove(TEST_FILE);
+}
+
+
+/*
+** Push parser: the same file pushed in in pieces of any size reads exactly
+** as the pull reader reads it, stray system messages included
+*/
+static const BYTE trkMixed[] = {
+	0x00, 0xff, 0x51, 0x03, 0x07, 0xa1, 0x20,		/* tempo */
+	0x00, 0xc3, 0x05,								/* program change, channel 4 */
+	0x10, 0x93, 60, 100,
+	0x08, 62, 90,									/* running status */
+	0x00, 0xff, 0x01, 0x03, 'a', 'b', 'c',			/* text, channel 4 still current */
+	0x04, 0xf2, 0x10, 0x20,							/* song position, not expected in a file */
+	0x00, 0xf8,										/* clock */
+	0x02, 64, 80,									/* running status carries on past them */
+	0x00, 0xf0, 0x03, 0x7e, 0x01, 0xf7,				/* SysEx */
+	0x05, 0xf7, 0x02, 0x01, 0x02,					/* SysEx continuation */
+	0x00, 0xe3, 0x00, 0x40,
+	0x83, 0x00, 0x83, 60, 0,						/* two byte delta */
+	0x00, 0xf1, 0x33,								/* MTC quarter frame */
+	0x00, 0xff, 0x2f, 0x00
+};
+
+static BOOL sameMessage(const MIDI_MSG *p1, const MIDI_MSG *p2)
+{
+	return p1->iType == p2->iType && p1->dt == p2->dt && p1->dwAbsPos == p2->dwAbsPos
+		&& p1->iMsgSize == p2->iMsgSize && p1->bImpliedMsg == p2->bImpliedMsg
+		&& p1->iLastMsgType == p2->iLastMsgType && p1->iLastMsgChnl == p2->iLastMsgChnl
+		&& p1->bTruncated == p2->bTruncated
+		&& (!p1->iMsgSize || !memcmp(p1->data, p2->data, p1->iMsgSize));
+}
+
+static void testPushMatchesPull(void)
+{
+	static const int iPieces[] = { 1, 2, 3, 7, 1000 };
+	TEST_TRACK tracks[2];
+	BYTE buf[256];
+	_MIDI_FILE mf;
+	MIDI_PUSH push;
+	MIDI_MSG msgPull, msgPush;
+	DWORD dwSize, dwFed;
+	BOOL bOK;
+	int i, iPushed, iMismatches;
+
+	tracks[0].pData = trkMixed;
+	tracks[0].dwSize = sizeof(trkMixed);
+	tracks[1].pData = trkNotes;
+	tracks[1].dwSize = sizeof(trkNotes);
+	dwSize = buildFile(buf, 1, 96, tracks, 2);
+
+	for(i=0; i < (int)(sizeof(iPieces) / sizeof(iPieces[0])); ++i)
+	{
+		midiFileOpenMemory(&mf, buf, dwSize, &bOK);
+		CHECK(bOK);
+		midiReadInitMessage(&msgPull);
+		midiReadInitMessage(&msgPush);
+		midiPushInit(&push);
+
+		iPushed = iMismatches = 0;
+		for(dwFed=0; dwFed < dwSize; dwFed += iPieces[i])
+		{
+			midiPushFeed(&push, buf + dwFed, dwSize - dwFed < (DWORD)iPieces[i] ? dwSize - dwFed : (DWORD)iPieces[i]);
+			while(midiPushGetNextMessage(&push, &msgPush))
+			{
+				++iPushed;
+				if (!midiReadGetNextMessage(&mf, push.iTrack, &msgPull) || !sameMessage(&msgPull, &msgPush))
+					++iMismatches;
+			}
+		}
+
+		CHECK(!midiPushFailed(&push));
+		CHECK(iMismatches == 0);
+		CHECK(iPushed == 14 + 3);
+		CHECK(!midiReadGetNextMessage(&mf, 0, &msgPull) && !midiReadGetNextMessage(&mf, 1, &msgPull));
+
+		midiPushFree(&push);
+		midiReadFreeMessage(&msgPull);
+		midiFileClose(&mf);
+	}
+}
+
+
+/*
+** Batch reads: all of a track comes out the same however it's split, and a
+** header claiming more tracks than are kept can't reach past them
+*/
+static void testBatchReads(void)
+{
+	static BYTE trk[8 * 40 + 4], buf[14 + 8 + sizeof(trk)];
+	TEST_TRACK track;
+	_MIDI_FILE mf;
+	MIDI_MSG msgs[7];
+	MIDI_EVENT evs[5];
+	DWORD dwSize, dwLast = 0;
+	BOOL bOK, bInOrder = TRUE;
+	int i, n, iTotal = 0;
+
+	track.pData = trk;
+	track.dwSize = makeNotes(trk, 40, 2, 5);
+	dwSize = buildFile(buf, 0, 96, &track, 1);
+	buf[11] = MAX_MIDI_TRACKS + 4;			/* more tracks than can be kept */
+
+	midiFileOpenMemory(&mf, buf, dwSize, &bOK);
+	CHECK(bOK);
+	for(i=0; i < 7; ++i)
+		midiReadInitMessage(&msgs[i]);
+
+	do
+	{
+		n = midiReadGetMessages(&mf, 0, msgs, 7);
+		for(i=0; i < n; ++i)
+		{
+			bInOrder = bInOrder && msgs[i].dwAbsPos >= dwLast;
+			dwLast = msgs[i].dwAbsPos;
+		}
+		iTotal += n;
+	} while(n == 7);
+	CHECK(iTotal == 81);
+	CHECK(bInOrder && dwLast == 40 * 5);
+
+	midiReadRewindTrack(&mf, 0);
+	iTotal = 0;
+	while((n = midiReadGetEvents(&mf, 0, evs, 5)) > 0)
+		iTotal += n;
+	CHECK(iTotal == 81);
+
+	CHECK(midiReadGetMessages(&mf, MAX_MIDI_TRACKS, msgs, 7) == 0);
+	CHECK(midiReadGetMessages(&mf, MAX_MIDI_TRACKS + 3, msgs, 7) == 0);
+	CHECK(midiReadGetEvents(&mf, MAX_MIDI_TRACKS + 1, evs, 5) == 0);
+	CHECK(!midiReadGetNextEvent(&mf, MAX_MIDI_TRACKS, evs));
+
+	for(i=0; i < 7; ++i)
+		midiReadFreeMessage(&msgs[i]);
+	midiFileClose(&mf);
+}
+
+
+/*
+** Event payloads: sizes only ever cover bytes that are really there, in
+** pBuf or in the file
+*/
+static void testEventPayload(void)
+{
+	static const BYTE trkText[] = {
+		0x00, 0xff, 0x01, 0x05, 'h', 'e', 'l', 'l', 'o',
+		0x00, 0xff, 0x2f, 0x00
+	};
+	TEST_TRACK track = TEST_TRACK_OF(trkText);
+	BYTE buf[64], small[3];
+	const BYTE *p;
+	_MIDI_FILE mf;
+	MIDI_EVENT ev;
+	DWORD dwSize, dwGot;
+	BOOL bOK;
+	int iPass;
+
+	dwSize = buildFile(buf, 0, 96, &track, 1);
+	CHECK(writeBytes(TEST_FILE, buf, dwSize));
+
+	for(iPass=0; iPass < 2; ++iPass)
+	{
+		if (iPass == 0)
+			midiFileOpenMemory(&mf, buf, dwSize, &bOK);
+		else
+			midiFileOpen(&mf, TEST_FILE, &bOK);
+		CHECK(bOK);
+
+		CHECK(midiReadGetNextEvent(&mf, 0, &ev) && ev.bStatus == msgMetaEvent);
+		CHECK(midiReadGetEventPayloadSize(&mf, &ev) == 5);
+		p = midiReadGetEventPayload(&mf, &ev, small, sizeof(small), &dwGot);
+		CHECK(p != NULL && !memcmp(p, "hel", 3));
+		CHECK(dwGot == (iPass == 0 ? 5UL : 3UL));
+
+		/* An event whose length runs off the end of the file, i.e. from a
+		** stale index: 0x2f bytes claimed where one is left. Only that
+		** one is ever handed out. */
+		ev.dwPayload = dwSize - 2;
+		CHECK(midiReadGetEventPayloadSize(&mf, &ev) == 1);
+		p = midiReadGetEventPayload(&mf, &ev, small, sizeof(small), &dwGot);
+		CHECK(p != NULL && dwGot == 1 && p[0] == 0);
+		CHECK(midiReadGetEventPayloadPart(&mf, &ev, 0, small, sizeof(small)) == 1);
+		CHECK(midiReadGetEventPayloadPart(&mf, &ev, 1, small, sizeof(small)) == 0);
+		midiFileClose(&mf);
+	}
+	remove(TEST_FILE);
+}
+
+/*
+** Sidecar index: a saved index opens the song without walking its tracks,
+** and a damaged or stale one is never used
+*/
+#define TEST_INDEX		TEST_FILE ".idx"
+
+static DWORD getBE(const BYTE *p)
+{
+	return ((DWORD)p[0] << 24) | ((DWORD)p[1] << 16) | ((DWORD)p[2] << 8) | p[3];
+}
+
+static void putBE(BYTE *p, DWORD v)
+{
+	p[0] = (BYTE)(v >> 24);
+	p[1] = (BYTE)(v >> 16);
+	p[2] = (BYTE)(v >> 8);
+	p[3] = (BYTE)v;
+}
+
+/* Writes an edited index back with a good CRC, so only the checks on what's
+** in it can turn it down */
+static BOOL writeIndex(BYTE *pData, DWORD dwSize)
+{
+	DWORD crc = 0xffffffffUL, i;
+	int j;
+
+	for(i=0; i < dwSize - 4; ++i)
+	{
+		crc ^= pData[i];
+		for(j=0; j < 8; ++j)
+			crc = (crc >> 1) ^ (0xedb88320UL & (0 - (crc & 1)));
+	}
+	putBE(pData + dwSize - 4, ~crc & 0xffffffffUL);
+	return writeBytes(TEST_INDEX, pData, dwSize);
+}
+
+static DWORD readBytes(const char *pFilename, BYTE *pData, DWORD dwMax)
+{
+	FILE *fp = fopen(pFilename, "rb");
+	DWORD n;
+
+	if (!fp)
+		return 0;
+	n = (DWORD)fread(pData, 1, dwMax, fp);
+	fclose(fp);
+	return n;
+}
+
+/* Late enough for a chase snapshot of its own */
+static const BYTE trkLate[] = {
+	0x00, 0xb1, 7, 100,
+	0x82, 0x80, 0x00, 0xc1, 9,
+	0x00, 0xff, 0x2f, 0x00
+};
+
+static void testIndex(void)
+{
+	static BYTE trk[8 * 200 + 4], buf[14 + 24 + sizeof(trkMixed) + sizeof(trk) + sizeof(trkLate)], idx[1024], bad[1024];
+	TEST_TRACK tracks[3];
+	MIDI_INDEX index;
+	MIDI_SEEK_INDEX built;
+	MIDI_CHASE chase;
+	_MIDI_FILE mf, mfWalked;
+	DWORD dwSize, dwIdx, dwTempos, dwChase, n;
+	BOOL bOK;
+	int i;
+
+	tracks[0].pData = trkMixed;
+	tracks[0].dwSize = sizeof(trkMixed);
+	tracks[1].pData = trk;
+	tracks[1].dwSize = makeNotes(trk, 200, 0, 10);
+	tracks[2].pData = trkLate;
+	tracks[2].dwSize = sizeof(trkLate);
+	dwSize = buildFile(buf, 1, 96, tracks, 3);
+	CHECK(writeBytes(TEST_FILE, buf, dwSize));
+	remove(TEST_INDEX);
+
+	/* No index yet, so one is built and saved */
+	CHECK(midiIndexOpenSong(&index, &mf, TEST_FILE));
+	CHECK(index.iNumTracks == 3 && index.dwNumEvents == 14 + 401 + 3);
+	CHECK(index.iNumTempos == 1 && index.pTempos[0].dwTempo == 500000);
+	CHECK(index.Seek.Track[1].iCount == 2);
+	CHECK(index.Seek.iNumChase == 2 && index.Seek.pChase[1].dwPos == 0x8000);
+	midiIndexFree(&index);
+	midiFileClose(&mf);
+	dwIdx = readBytes(TEST_INDEX, idx, sizeof(idx));
+	CHECK(dwIdx > 36 && dwIdx < sizeof(idx));
+
+	/* Opening again takes the track table from it */
+	midiFileOpen(&mfWalked, TEST_FILE, &bOK);
+	CHECK(midiIndexOpenSong(&index, &mf, TEST_FILE));
+	for(i=0; i < 3; ++i)
+	{
+		CHECK(mf.Track[i].pBase2 == mfWalked.Track[i].pBase2 && mf.Track[i].size == mfWalked.Track[i].size);
+		CHECK(mf.Track[i].ptr2 == mfWalked.Track[i].ptr2 && mf.Track[i].pEnd2 == mfWalked.Track[i].pEnd2);
+	}
+	CHECK(readAll(&mf, 0) == 14 && readAll(&mf, 1) == 401);
+
+	/* The chase snapshots come back as they were made */
+	memset(&built, 0, sizeof(built));
+	CHECK(midiChaseBuildIndex(&built, &mf, MIDI_INDEX_CHASE_EVERY));
+	CHECK(index.Seek.iNumChase == built.iNumChase);
+	for(i=0; i < built.iNumChase && i < index.Seek.iNumChase; ++i)
+		CHECK(!memcmp(&index.Seek.pChase[i], &built.pChase[i], sizeof(MIDI_CHASE_POINT)));
+	midiSeekFreeIndex(&built);
+	CHECK(midiChaseSeekToTick(&mf, &index.Seek, 0x8001, &chase));
+	CHECK(chase.bProgram[3] == 5 && chase.bProgram[1] == 9 && chase.bCC[1][7] == 100 && chase.dwTempo == 500000);
+
+	/* The note off at 1500 and everything after it */
+	CHECK(midiSeekToTick(&mf, &index.Seek, 150 * 10) && readAll(&mf, 1) == 401 - 299);
+	midiIndexFree(&index);
+	midiFileClose(&mf);
+
+	/* A table that doesn't fit the file is ignored for the walk */
+	CHECK(midiIndexRead(&index, TEST_INDEX));
+	index.size[1] += 1;
+	midiFileOpenIndexed(&mf, TEST_FILE, &index, &bOK);
+	CHECK(bOK && mf.Track[1].size == mfWalked.Track[1].size);
+	midiFileClose(&mf);
+	midiIndexFree(&index);
+	midiFileClose(&mfWalked);
+
+	/* Cut short anywhere */
+	for(n=0; n < dwIdx; ++n)
+	{
+		CHECK(writeBytes(TEST_INDEX, idx, n));
+		CHECK(!midiIndexRead(&index, TEST_INDEX));
+	}
+
+	/* Counts big enough to wrap once multiplied by the record size: the
+	** first makes 9 * count come out as 5, the second 8 * count + 8 as 0 */
+	memcpy(bad, idx, dwIdx);
+	putBE(bad + 28, 0x1c71c71dUL);
+	CHECK(writeIndex(bad, dwIdx));
+	CHECK(!midiIndexRead(&index, TEST_INDEX));
+
+	for(dwTempos=20, i=0; i < 3; ++i)
+		dwTempos += 12 + 9 * getBE(idx + dwTempos + 8);
+	CHECK(getBE(idx + dwTempos) == 1);
+	memcpy(bad, idx, dwIdx);
+	putBE(bad + dwTempos, 0x1fffffffUL);
+	CHECK(writeIndex(bad, dwIdx));
+	CHECK(!midiIndexRead(&index, TEST_INDEX));
+
+	/* A tempo of zero, or one too big for the file format */
+	memcpy(bad, idx, dwIdx);
+	putBE(bad + dwTempos + 8, 0);
+	CHECK(writeIndex(bad, dwIdx));
+	CHECK(!midiIndexRead(&index, TEST_INDEX));
+	putBE(bad + dwTempos + 8, 0x1000000UL);
+	CHECK(writeIndex(bad, dwIdx));
+	CHECK(!midiIndexRead(&index, TEST_INDEX));
+
+	/* A controller value no chase could have saved, in the second snapshot
+	** after the first's 10 bytes, its own 10 and the channel's first 4 */
+	dwChase = dwTempos + 4 + 8;
+	CHECK(getBE(idx + dwChase) == 2);
+	memcpy(bad, idx, dwIdx);
+	bad[dwChase + 4 + 10 + 10 + 4] = 0x80;
+	CHECK(writeIndex(bad, dwIdx));
+	CHECK(!midiIndexRead(&index, TEST_INDEX));
+	memcpy(bad, idx, dwIdx);
+	putBE(bad + dwChase, 0x7fffffffUL);
+	CHECK(writeIndex(bad, dwIdx));
+	CHECK(!midiIndexRead(&index, TEST_INDEX));
+
+	/* A seek point outside its track */
+	memcpy(bad, idx, dwIdx);
+	putBE(bad + 32, getBE(bad + 20) + 8 + getBE(bad + 24) + 1);
+	CHECK(writeIndex(bad, dwIdx));
+	CHECK(!midiIndexRead(&index, TEST_INDEX));
+
+	/* Untouched, it still reads */
+	CHECK(writeIndex(idx, dwIdx));
+	CHECK(midiIndexRead(&index, TEST_INDEX));
+	midiIndexFree(&index);
+
+	/* Same size song with different notes: the index is stale, so the song
+	** is walked and the index rebuilt */
+	trk[2] ^= 1;
+	buildFile(buf, 1, 96, tracks, 3);
+	CHECK(writeBytes(TEST_FILE, buf, dwSize));
+	CHECK(midiIndexOpenSong(&index, &mf, TEST_FILE));
+	CHECK(readAll(&mf, 1) == 401);
+	midiIndexFree(&index);
+	midiFileClose(&mf);
+	CHECK(midiIndexRead(&index, TEST_INDEX) && index.dwCheck != getBE(idx + 8));
+	midiIndexFree(&index);
+
+	remove(TEST_INDEX);
+	remove(TEST_FILE);
+}
+
+
+/*
+** Probe: a quick probe still finds the earliest tempo, whichever track
+** it's in
+*/
+static void testProbe(void)
+{
+	static const BYTE trkTitle[] = {
+		0x00, 0xff, 0x03, 0x04, 's', 'o', 'n', 'g',
+		0x60, 0xff, 0x51, 0x03, 0x0f, 0x42, 0x40,		/* 1000000 at 96 */
+		0x00, 0xff, 0x2f, 0x00
+	};
+	static const BYTE trkTempo[] = {
+		0x00, 0xff, 0x51, 0x03, 0x07, 0xa1, 0x20,		/* 500000 at 0 */
+		0x81, 0x40, 0xff, 0x2f, 0x00
+	};
+	static const TEST_TRACK tracks[] = { TEST_TRACK_OF(trkTitle), TEST_TRACK_OF(trkNotes), TEST_TRACK_OF(trkTempo) };
+	BYTE buf[128];
+	MIDI_PROBE probe;
+	_MIDI_FILE mf;
+	DWORD dwSize;
+	BOOL bOK;
+
+	dwSize = buildFile(buf, 1, 96, tracks, 3);
+	midiFileOpenMemory(&mf, buf, dwSize, &bOK);
+	CHECK(bOK);
+
+	CHECK(midiProbeGetInfo(&probe, &mf, TRUE));
+	CHECK(!strcmp(probe.szTitle, "song"));
+	CHECK(probe.dwTempo == 500000);
+	CHECK(!probe.bComplete && probe.dwEndPos == 0);
+
+	CHECK(midiProbeGetInfo(&probe, &mf, FALSE));
+	CHECK(probe.dwTempo == 500000);
+	CHECK(probe.bComplete && probe.dwEndPos == 192);
+	CHECK(probe.qwDuration == 500000 + 1000000);
+
+	/* Read positions are left alone */
+	CHECK(readAll(&mf, 0) == 3 && readAll(&mf, 2) == 2);
+	midiFileClose(&mf);
+}
+
+
+/*
+** Writer: what's written reads back the same, note offs in time order
+** even once the song is past 2^31 ticks, and gaps longer than a delta
+** can hold bridged by empty text events
+*/
+static void testWriter(void)
+{
+	static const struct {
+		tMIDI_MSG	iType;
+		DWORD		dwAbsPos;
+		int			iNote;						/* or -1 */
+	} expect[] = {
+		{ msgMetaEvent, 0, -1 },				/* tempo */
+		{ msgSetProgram, 0, -1 },
+		{ msgNoteOn, 0, 60 },
+		{ msgNoteOn, 0, 64 },
+		{ msgNoteOff, 96, 64 },
+		{ msgNoteOff, 192, 60 },
+		{ msgNoteOn, 0x7ffffff0UL, 67 },
+		{ msgNoteOn, 0x7ffffff0UL, 72 },
+		{ msgNoteOff, 0x7ffffff5UL, 72 },
+		{ msgNoteOff, 0x800000f0UL, 67 },
+		{ msgMetaEvent, 0x800000f0UL, -1 },		/* end of track */
+	};
+	_MIDI_FILE mf;
+	MIDI_MSG msg;
+	BOOL bOK;
+	int i, n, iBridges = 0;
+
+	midiFileCreate(&mf, TEST_FILE, TRUE, &bOK);
+	CHECK(bOK);
+	if (!bOK)
+		return;
+	midiFileSetTracksDefaultChannel(&mf, 1, MIDI_CHANNEL_1);
+	CHECK(midiSongAddTempo(&mf, 1, 120));
+	CHECK(midiTrackAddProgramChange(&mf, 1, 5));
+	CHECK(midiTrackAddNote(&mf, 1, 60, 192, 100, FALSE, TRUE));
+	CHECK(midiTrackAddNote(&mf, 1, 64, 96, 100, FALSE, TRUE));
+
+	/* The second note ends first, and its end is past 2^31 */
+	CHECK(midiTrackIncTime(&mf, 1, 0x7ffffff0, TRUE));
+	CHECK(midiTrackAddNote(&mf, 1, 67, 0x100, 100, FALSE, TRUE));
+	CHECK(midiTrackAddNote(&mf, 1, 72, 5, 100, FALSE, TRUE));
+	CHECK(midiFileClose(&mf));
+
+	midiFileOpen(&mf, TEST_FILE, &bOK);
+	CHECK(bOK && midiReadGetNumTracks(&mf) == 1);
+	midiReadInitMessage(&msg);
+	for(n=0; midiReadGetNextMessage(&mf, 0, &msg); ++n)
+	{
+		if (msg.iType == msgMetaEvent && msg.MsgData.MetaEvent.iType == metaTextEvent && !msg.MsgData.MetaEvent.iSize)
+		{
+			CHECK(msg.dt == 0x0fffffffUL);
+			++iBridges;
+			--n;
+			continue;
+		}
+		if (n >= (int)(sizeof(expect) / sizeof(expect[0])))
+			continue;
+		CHECK(msg.dwAbsPos == expect[n].dwAbsPos);
+		/* Note offs are written as note ons with no volume */
+		i = msg.iType == msgNoteOn && msg.MsgData.NoteOn.iVolume == 0 ? msgNoteOff : msg.iType;
+		CHECK(i == (int)expect[n].iType);
+		if (expect[n].iNote >= 0)
+			CHECK(msg.MsgData.NoteOn.iNote == expect[n].iNote);
+	}
+	CHECK(n == (int)(sizeof(expect) / sizeof(expect[0])));
+	CHECK(iBridges == (int)((0x7ffffff0UL - 192) / 0x0fffffffUL));
+	CHECK(!midiReadFailed(&mf, 0));
+	midiReadFreeMessage(&msg);
+	midiFileClose(&mf);
+	remove(TEST_FILE);
+}
+
+
+/*
+** Optimizer: the result plays the same and keeps its length, however
+** much is dropped
+*/
+#define TEST_OUT		"miditest2.mid"
+
+/* Position of the last message of the song, i.e. its length */
+static DWORD songEnd(_MIDI_FILE *pMF)
+{
+	MIDI_MSG msg;
+	DWORD dwEnd = 0;
+	int i;
+
+	midiReadInitMessage(&msg);
+	for(i=0; i < midiReadGetNumTracks(pMF); ++i)
+		while(midiReadGetNextMessage(pMF, i, &msg))
+			if (msg.dwAbsPos > dwEnd)
+				dwEnd = msg.dwAbsPos;
+	midiReadFreeMessage(&msg);
+	return dwEnd;
+}
+
+static void testOptimize(void)
+{
+	static const BYTE trkMeta[] = {
+		0x00, 0xff, 0x51, 0x03, 0x07, 0xa1, 0x20,
+		0x83, 0x00, 0xff, 0x2f, 0x00
+	};
+	static const BYTE trkRedundant[] = {
+		0x00, 0xc0, 0x05,
+		0x00, 0x90, 60, 100,
+		0x10, 0xc0, 0x05,								/* same program again */
+		0x10, 0xff, 0x01, 0x00,							/* empty text */
+		0x10, 0x80, 60, 64,								/* note off, no release velocity */
+		0x00, 0xb0, 7, 100,
+		0x00, 0xb0, 7, 100,								/* same controller value again */
+		0x00, 0xff, 0x2f, 0x00
+	};
+	static const BYTE trkEmpty[] = {
+		0x87, 0x68, 0xff, 0x2f, 0x00					/* only an end, at 1000 */
+	};
+	static BYTE trkGap[4 + 9 * 7 + 8];
+	static BYTE buf[256];
+	TEST_TRACK tracks[3];
+	_MIDI_FILE mf;
+	MIDI_MSG msg;
+	DWORD dwSize;
+	BOOL bOK;
+	BYTE *p;
+	int i, n;
+
+	/* Format 1: the longest track has nothing in it but still sets the length */
+	tracks[0].pData = trkMeta;
+	tracks[0].dwSize = sizeof(trkMeta);
+	tracks[1].pData = trkRedundant;
+	tracks[1].dwSize = sizeof(trkRedundant);
+	tracks[2].pData = trkEmpty;
+	tracks[2].dwSize = sizeof(trkEmpty);
+	dwSize = buildFile(buf, 1, 96, tracks, 3);
+	midiFileOpenMemory(&mf, buf, dwSize, &bOK);
+	CHECK(bOK && midiOptimizeFile(&mf, TEST_OUT));
+	midiFileClose(&mf);
+
+	midiFileOpen(&mf, TEST_OUT, &bOK);
+	CHECK(bOK && midiReadGetNumTracks(&mf) == 2 && midiFileGetVersion(&mf) == 1);
+	CHECK(mf.Track[1].size < sizeof(trkRedundant));
+	midiReadInitMessage(&msg);
+	for(n=0; midiReadGetNextMessage(&mf, 1, &msg); ++n)
+		if (msg.iType == msgNoteOn && msg.MsgData.NoteOn.iVolume == 0)
+			CHECK(msg.dwAbsPos == 0x30);
+	CHECK(n == 5);				/* program, note on and off, controller, end */
+	midiReadFreeMessage(&msg);
+	for(i=0; i < 2; ++i)
+		midiReadRewindTrack(&mf, i);
+	CHECK(songEnd(&mf) == 1000);
+	midiFileClose(&mf);
+
+	/* Format 2: each pattern starts from nothing, so neither program
+	** change is redundant, and an empty pattern just goes */
+	tracks[0].pData = trkRedundant;
+	tracks[0].dwSize = sizeof(trkRedundant);
+	dwSize = buildFile(buf, 2, 96, tracks, 3);
+	midiFileOpenMemory(&mf, buf, dwSize, &bOK);
+	CHECK(bOK && midiOptimizeFile(&mf, TEST_OUT));
+	midiFileClose(&mf);
+
+	midiFileOpen(&mf, TEST_OUT, &bOK);
+	CHECK(bOK && midiReadGetNumTracks(&mf) == 2 && midiFileGetVersion(&mf) == 2);
+	CHECK(readAll(&mf, 0) == 5 && readAll(&mf, 1) == 5);
+	midiFileClose(&mf);
+
+	/* A gap past 2^31 ticks, made of empty text events. They go, and the
+	** writer bridges the gap again with as few as it needs */
+	p = trkGap;
+	memcpy(p, "\0\x90\x3c\x64", 4);
+	p += 4;
+	for(i=0; i < 9; ++i, p += 7)
+		memcpy(p, "\xff\xff\xff\x7f\xff\x01\x00", 7);
+	memcpy(p, "\x05\x3c\x00\0\xff\x2f\0", 7);
+	tracks[0].pData = trkGap;
+	tracks[0].dwSize = (DWORD)(p + 7 - trkGap);
+	dwSize = buildFile(buf, 0, 96, tracks, 1);
+	midiFileOpenMemory(&mf, buf, dwSize, &bOK);
+	CHECK(bOK && midiOptimizeFile(&mf, TEST_OUT));
+	midiFileClose(&mf);
+
+	midiFileOpen(&mf, TEST_OUT, &bOK);
+	CHECK(bOK && midiReadGetNumTracks(&mf) == 1);
+	midiReadInitMessage(&msg);
+	for(n=0; midiReadGetNextMessage(&mf, 0, &msg); ++n)
+		if (msg.iType == msgNoteOn && msg.MsgData.NoteOn.iVolume == 0)
+			CHECK(msg.dwAbsPos == 9 * 0x0fffffffUL + 5);
+	CHECK(n == 1 + 9 + 2);
+	CHECK(!midiReadFailed(&mf, 0));
+	midiReadFreeMessage(&msg);
+	midiFileClose(&mf);
+
+	remove(TEST_OUT);
+}
+
+
+/*
+** Format 0 conversion: one track playing the same stream as a merged read
+** of the original, in the same order, less end of tracks and system
+** messages
+*/
+static BOOL isDropped(const MIDI_MSG *pMsg)
+{
+	return pMsg->iType == msgMetaEvent ? pMsg->MsgData.MetaEvent.iType == metaEndSequence
+		: pMsg->iType > msgSysEx1 && pMsg->iType != msgSysEx2;
+}
+
+/* The same message, whether or not either was sent with running status */
+static BOOL sameContent(const MIDI_MSG *p1, const MIDI_MSG *p2)
+{
+	int i1 = p1->data[0] & 0x80 ? 1 : 0, i2 = p2->data[0] & 0x80 ? 1 : 0;
+
+	if (p1->dwAbsPos != p2->dwAbsPos || p1->iType != p2->iType || p1->iMsgSize - i1 != p2->iMsgSize - i2)
+		return FALSE;
+	if (p1->iType < msgSysEx1 && p1->iLastMsgChnl != p2->iLastMsgChnl)
+		return FALSE;
+	return !memcmp(p1->data + i1, p2->data + i2, p1->iMsgSize - i1);
+}
+
+static void testConvert(void)
+{
+	static BYTE trkGap[4 + 9 * 7 + 8], buf[512];
+	TEST_TRACK tracks[4];
+	_MIDI_FILE mf, mfOut;
+	MIDI_MERGE merge;
+	MIDI_MSG msgIn, msgOut;
+	DWORD dwSize;
+	BOOL bOK, bOut;
+	BYTE *p;
+	int i, n, iMismatches = 0;
+
+	/* A note that ends 9 deltas of 2^28 - 1 and 5 ticks in, past 2^31 */
+	p = trkGap;
+	memcpy(p, "\0\x91\x3c\x64", 4);
+	p += 4;
+	for(i=0; i < 9; ++i, p += 7)
+		memcpy(p, "\xff\xff\xff\x7f\xff\x01\x00", 7);
+	memcpy(p, "\x05\x3c\x00\0\xff\x2f\0", 7);
+
+	tracks[0].pData = trkMixed;
+	tracks[0].dwSize = sizeof(trkMixed);
+	tracks[1].pData = trkNotes;
+	tracks[1].dwSize = sizeof(trkNotes);
+	tracks[2].pData = trkLate;
+	tracks[2].dwSize = sizeof(trkLate);
+	tracks[3].pData = trkGap;
+	tracks[3].dwSize = (DWORD)(p + 7 - trkGap);
+	dwSize = buildFile(buf, 1, 96, tracks, 4);
+	midiFileOpenMemory(&mf, buf, dwSize, &bOK);
+	CHECK(bOK && midiConvertToFormat0(&mf, TEST_OUT));
+
+	midiFileOpen(&mfOut, TEST_OUT, &bOK);
+	CHECK(bOK && midiReadGetNumTracks(&mfOut) == 1 && midiFileGetVersion(&mfOut) == 0);
+	midiReadInitMessage(&msgIn);
+	midiReadInitMessage(&msgOut);
+	midiMergeInit(&merge, &mf);
+	for(n=0; midiMergeGetNextMessage(&merge, &msgIn, NULL); )
+	{
+		if (isDropped(&msgIn))
+			continue;
+		bOut = midiReadGetNextMessage(&mfOut, 0, &msgOut);
+		if (!bOut || !sameContent(&msgIn, &msgOut))
+			++iMismatches;
+		++n;
+	}
+	CHECK(iMismatches == 0);
+	CHECK(n == 14 - 4 + 3 - 1 + 3 - 1 + 12 - 1);
+
+	/* Then the one end of track, where the longest track ended */
+	CHECK(midiReadGetNextMessage(&mfOut, 0, &msgOut) && isDropped(&msgOut));
+	CHECK(msgOut.dwAbsPos == 9 * 0x0fffffffUL + 5);
+	CHECK(!midiReadGetNextMessage(&mfOut, 0, &msgOut) && !midiReadFailed(&mfOut, 0));
+	midiReadFreeMessage(&msgIn);
+	midiReadFreeMessage(&msgOut);
+	midiFileClose(&mfOut);
+
+	/* Format 2 patterns aren't parts of one song */
+	midiFileClose(&mf);
+	dwSize = buildFile(buf, 2, 96, tracks, 2);
+	midiFileOpenMemory(&mf, buf, dwSize, &bOK);
+	CHECK(bOK && !midiConvertToFormat0(&mf, TEST_OUT));
+	midiFileClose(&mf);
+
+	remove(TEST_OUT);
+}
+
+
+/*
+** Compiler: records come out with the right delays across a tempo change,
+** SysEx split three bytes at a time, and an empty 0xf7 event only passes
+** time on to what follows
+*/
+static void testCompile(void)
+{
+	static const BYTE trkTempos[] = {
+		0x00, 0xff, 0x51, 0x03, 0x07, 0xa1, 0x20,		/* 500000 */
+		0x60, 0xff, 0x51, 0x03, 0x0f, 0x42, 0x40,		/* 1000000 at 96 */
+		0x00, 0xff, 0x2f, 0x00
+	};
+	static const BYTE trkEvents[] = {
+		0x00, 0x90, 60, 100,
+		0x30, 0xc0, 0x05,
+		0x81, 0x10, 0x90, 60, 0,						/* 192 */
+		0x00, 0xf0, 0x05, 0x7e, 0x7f, 0x09, 0x01, 0xf7,
+		0x30, 0xf7, 0x00,								/* empty, at 240 */
+		0x30, 0x90, 62, 100,							/* 288 */
+		0x60, 0xff, 0x2f, 0x00							/* 384 */
+	};
+	static const struct {
+		DWORD	dwDelay;
+		int		iLen;
+		BYTE	msg[3];
+	} expect[] = {
+		{ 0, 3, { 0x90, 60, 100 } },
+		{ 250000, 2, { 0xc0, 0x05, 0 } },
+		{ 1250000, 3, { 0x90, 60, 0 } },
+		{ 0, 3, { 0xf0, 0x7e, 0x7f } },
+		{ 0, 3, { 0x09, 0x01, 0xf7 } },
+		{ 1000000, 3, { 0x90, 62, 100 } },
+		{ 1000000, 0, { 0, 0, 0 } },
+	};
+	static const TEST_TRACK tracks[] = { TEST_TRACK_OF(trkTempos), TEST_TRACK_OF(trkEvents) };
+	BYTE buf[128], song[256], msg[3];
+	MIDI_COMPILED compiled;
+	_MIDI_FILE mf;
+	DWORD dwSize, dwDelay;
+	BOOL bOK;
+	int n, iLen;
+
+	dwSize = buildFile(buf, 1, 96, tracks, 2);
+	midiFileOpenMemory(&mf, buf, dwSize, &bOK);
+	CHECK(bOK && midiCompileFile(&mf, TEST_OUT));
+	midiFileClose(&mf);
+
+	dwSize = readBytes(TEST_OUT, song, sizeof(song));
+	CHECK(dwSize == 12 + 7 * MIDI_COMPILED_RECORD);
+	CHECK(midiCompileInit(&compiled, song, dwSize));
+	for(n=0; midiCompileGetNext(&compiled, &dwDelay, msg, &iLen); ++n)
+	{
+		if (n >= (int)(sizeof(expect) / sizeof(expect[0])))
+			continue;
+		CHECK(dwDelay == expect[n].dwDelay && iLen == expect[n].iLen);
+		CHECK(!memcmp(msg, expect[n].msg, iLen));
+	}
+	CHECK(n == (int)(sizeof(expect) / sizeof(expect[0])));
+
+	/* A count claiming more records than there are, or the wrong magic */
+	CHECK(!midiCompileInit(&compiled, song, dwSize - 1));
+	song[0] = 'X';
+	CHECK(!midiCompileInit(&compiled, song, dwSize));
+
+	/* Format 2 patterns don't play as one song */
+	dwSize = buildFile(buf, 2, 96, tracks, 2);
+	midiFileOpenMemory(&mf, buf, dwSize, &bOK);
+	CHECK(bOK && !midiCompileFile(&mf, TEST_OUT));
+	midiFileClose(&mf);
+
+	remove(TEST_OUT);
+}
+
+
+int main(void)
+{
+	testTruncatedData();
+	testSourceCache();
+	testPushMatchesPull();
+	testBatchReads();
+	testEventPayload();
+	testIndex();
+	testProbe();
+	testWriter();
+	testOptimize();
+	testConvert();
+	testCompile();
+
+	printf("%d checks, %d failed\n", iChecks, iFailures);
+	return iFailures ? 1 : 0;
+}